@@ -19,6 +19,8 @@ main(int num_args, char *args[])
 
     SDL_Init(SDL_INIT_EVERYTHING);
 
+    // Read the next frame from the cameras while this one is processed
+    MagicMotion_SetSensorPrefetchDepth(1);
     MagicMotion_Initialize();
     unsigned int num_cameras = MagicMotion_GetNumCameras();
     printf("%u cameras initialized\n", num_cameras);
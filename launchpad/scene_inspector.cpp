@@ -511,8 +511,8 @@ namespace inspector
 
         if(UI.render_voxel_bounds)
         {
-            RenderWireCube((V3){ 0, 0, 0 },
-                           (V3){ BOUNDING_BOX_X, BOUNDING_BOX_Y, BOUNDING_BOX_Z });
+            const MagicMotionVoxelGrid *grid = MagicMotion_GetVoxelGrid();
+            RenderWireCube(AddV3(grid->origin, ScaleV3(grid->size, 0.5f)), grid->size);
         }
 
         if(UI.render_point_cloud)
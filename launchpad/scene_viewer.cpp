@@ -599,33 +599,29 @@ namespace viewer
         if(UI.render_voxels)
         {
             Voxel *voxels = MagicMotion_GetVoxels();
+            const uint32_t *occupied_voxels = MagicMotion_GetOccupiedVoxels();
+            const unsigned int num_occupied_voxels = MagicMotion_GetNumOccupiedVoxels();
             V3 voxel_centers[256];
             V3 voxel_colors[256];
             int voxel_index = 0;
-            for(int z=0; z<NUM_VOXELS_Z; ++z)
+            for(unsigned int j=0; j<num_occupied_voxels; ++j)
             {
-                for(int y=0; y<NUM_VOXELS_Y; ++y)
+                const int i = occupied_voxels[j];
+                if(voxels[i].point_count > 8)
                 {
-                    for(int x=0; x<NUM_VOXELS_X; ++x)
+                    ColorPixel c = voxels[i].color;
+                    voxel_colors[voxel_index] = (V3){
+                        c.r / 255.0f,
+                        c.g / 255.0f,
+                        c.b / 255.0f
+                    };
+
+                    voxel_centers[voxel_index++] = MagicMotion_VoxelCenter(MagicMotion_GetVoxelGrid(), i);
+
+                    if(voxel_index >= 256)
                     {
-                        const int i = VOXEL_INDEX(x, y, z);
-                        if(voxels[i].point_count > 8)
-                        {
-                            ColorPixel c = voxels[i].color;
-                            voxel_colors[voxel_index] = (V3){
-                                c.r / 255.0f,
-                                c.g / 255.0f,
-                                c.b / 255.0f
-                            };
-
-                            voxel_centers[voxel_index++] = VOXEL_TO_WORLD(i);
-
-                            if(voxel_index >= 256)
-                            {
-                                RenderCubes(voxel_centers, voxel_colors, 256);
-                                voxel_index = 0;
-                            }
-                        }
+                        RenderCubes(voxel_centers, voxel_colors, 256);
+                        voxel_index = 0;
                     }
                 }
             }
@@ -642,8 +638,8 @@ namespace viewer
 
         if(UI.render_voxel_bounds)
         {
-            RenderWireCube((V3){ 0, 0, 0 },
-                           (V3){ BOUNDING_BOX_X, BOUNDING_BOX_Y, BOUNDING_BOX_Z });
+            const MagicMotionVoxelGrid *grid = MagicMotion_GetVoxelGrid();
+            RenderWireCube(AddV3(grid->origin, ScaleV3(grid->size, 0.5f)), grid->size);
         }
 
         for(int i=0; i<num_active_sensors; ++i)
@@ -116,36 +116,18 @@ ReceivePacket(int socket_handle, Packet *packet, sockaddr_in *from)
 
 // Returns the number of points inside the AABB
 static int
-CheckAABBAgainstVoxelGrid(Voxel *voxels, V3 min, V3 max)
+CheckAABBAgainstVoxelGrid(V3 min, V3 max)
 {
-    int result = 0;
-
-    int start = WORLD_TO_VOXEL(min);
-
-    int x_span = (max.x - min.x) / VOXEL_SIZE;
-    int y_span = (max.y - min.y) / VOXEL_SIZE;
-    int z_span = (max.z - min.z) / VOXEL_SIZE;
-
-    for(int z=0; z<z_span; ++z)
-    for(int y=0; y<y_span; ++y)
-    for(int x=0; x<x_span; ++x)
-    {
-        int voxel = start +
-                    x +
-                    y * NUM_VOXELS_X +
-                    z * NUM_VOXELS_X * NUM_VOXELS_Y;
-
-        int point_count = voxels[voxel].point_count;
-        result += point_count;
-    }
-
-    return result;
+    // Constant time, however big the box is
+    MagicMotionAABBCounts counts = MagicMotion_QueryAABB(min, max);
+    return counts.point_count;
 }
 
 int
 main(int num_args, char *args[])
 {
     MagicMotion_Initialize();
+    MagicMotion_SetAABBQueries(true);
     unsigned int num_cameras = MagicMotion_GetNumCameras();
     printf("Magic Motion initialized with %u camera(s)\n", num_cameras);
 
@@ -157,7 +139,6 @@ main(int num_args, char *args[])
     while(global_running)
     {
         MagicMotion_CaptureFrame();
-        Voxel *voxels = MagicMotion_GetVoxels();
 
         Packet packet = {};
         sockaddr_in from = {};
@@ -183,7 +164,7 @@ main(int num_args, char *args[])
                 V3 *aabb = (V3 *)&packet.data;
                 V3 min = aabb[0];
                 V3 max = aabb[1];
-                bool collides = CheckAABBAgainstVoxelGrid(voxels, min, max);
+                bool collides = CheckAABBAgainstVoxelGrid(min, max);
 
                 Packet response = {};
                 response.type = PACKET_QUERY;
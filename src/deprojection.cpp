@@ -0,0 +1,205 @@
+
+#include "deprojection.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEPROJECTION_X86 1
+#include <immintrin.h>
+#else
+#define DEPROJECTION_X86 0
+#endif
+
+DeprojectRowFunc DeprojectRow = &DeprojectRowScalar;
+
+size_t
+DeprojectRowScalar(const DepthPixel *depths, const ColorPixel *colors, const float *mask,
+                   const float *rays_x, float ray_y, unsigned int width,
+                   const Mat4 *transform, MagicMotionTag tag,
+                   V3 *out_positions, ColorPixel *out_colors, MagicMotionTag *out_tags)
+{
+    size_t count = 0;
+
+    for(unsigned int x=0; x<width; ++x)
+    {
+        float depth = depths[x];
+        if(depth > 0.0f && (!mask || mask[x] > 0.0f))
+        {
+            out_positions[count] = MulMat4Vec3(*transform,
+                                               (V3){ rays_x[x] * depth,
+                                                     ray_y * depth,
+                                                     depth / 100.0f });
+            if(colors) out_colors[count] = colors[x];
+            out_tags[count] = tag;
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+#if DEPROJECTION_X86
+
+// For each 8 bit mask of valid pixels: the lane indices of the valid
+// pixels, packed to the front
+static uint32_t _compaction_table[256][8];
+static uint8_t _compaction_counts[256];
+
+static void
+_BuildCompactionTable(void)
+{
+    for(int mask=0; mask<256; ++mask)
+    {
+        int count = 0;
+        for(int lane=0; lane<8; ++lane)
+        {
+            if(mask & (1 << lane))
+            {
+                _compaction_table[mask][count++] = lane;
+            }
+        }
+
+        for(int lane=count; lane<8; ++lane)
+        {
+            _compaction_table[mask][lane] = 0;
+        }
+
+        _compaction_counts[mask] = (uint8_t)count;
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t
+_DeprojectRowAVX2(const DepthPixel *depths, const ColorPixel *colors, const float *mask,
+                  const float *rays_x, float ray_y, unsigned int width,
+                  const Mat4 *transform, MagicMotionTag tag,
+                  V3 *out_positions, ColorPixel *out_colors, MagicMotionTag *out_tags)
+{
+    const __m256 m00 = _mm256_set1_ps(transform->f00);
+    const __m256 m01 = _mm256_set1_ps(transform->f01);
+    const __m256 m02 = _mm256_set1_ps(transform->f02);
+    const __m256 m10 = _mm256_set1_ps(transform->f10);
+    const __m256 m11 = _mm256_set1_ps(transform->f11);
+    const __m256 m12 = _mm256_set1_ps(transform->f12);
+    const __m256 m20 = _mm256_set1_ps(transform->f20);
+    const __m256 m21 = _mm256_set1_ps(transform->f21);
+    const __m256 m22 = _mm256_set1_ps(transform->f22);
+    const __m256 m30 = _mm256_set1_ps(transform->f30);
+    const __m256 m31 = _mm256_set1_ps(transform->f31);
+    const __m256 m32 = _mm256_set1_ps(transform->f32);
+
+    const __m256 ray_y8 = _mm256_set1_ps(ray_y);
+    const __m256 hundred = _mm256_set1_ps(100.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i tags = _mm256_set1_epi32((int)tag);
+
+    // Lane sources for interleaving 8 packed XYZ triplets into three vectors
+    const __m256i interleave0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+    const __m256i interleave1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+    const __m256i interleave2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+    const __m256i lanes0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lanes1 = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+    const __m256i lanes2 = _mm256_setr_epi32(16, 17, 18, 19, 20, 21, 22, 23);
+
+    size_t count = 0;
+    unsigned int x = 0;
+
+    for(; x+8<=width; x+=8)
+    {
+        const __m256 depth = _mm256_loadu_ps(depths + x);
+        __m256 valid = _mm256_cmp_ps(depth, zero, _CMP_GT_OQ);
+        if(mask)
+        {
+            valid = _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_loadu_ps(mask + x), zero, _CMP_GT_OQ));
+        }
+
+        const int valid_lanes = _mm256_movemask_ps(valid);
+        if(valid_lanes == 0) continue;
+
+        // In the order of DeprojectRowScalar/MulMat4Vec3 (see simd_kernels.h)
+        const __m256 px = _mm256_mul_ps(_mm256_loadu_ps(rays_x + x), depth);
+        const __m256 py = _mm256_mul_ps(ray_y8, depth);
+        const __m256 pz = _mm256_div_ps(depth, hundred);
+
+        __m256 wx = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m00, px),
+                                                              _mm256_mul_ps(m10, py)),
+                                                _mm256_mul_ps(m20, pz)),
+                                  m30);
+        __m256 wy = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m01, px),
+                                                              _mm256_mul_ps(m11, py)),
+                                                _mm256_mul_ps(m21, pz)),
+                                  m31);
+        __m256 wz = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m02, px),
+                                                              _mm256_mul_ps(m12, py)),
+                                                _mm256_mul_ps(m22, pz)),
+                                  m32);
+
+        // Pack the valid points to the front
+        const uint32_t *lane_indices = _compaction_table[valid_lanes];
+        const int n = _compaction_counts[valid_lanes];
+        const __m256i compaction = _mm256_loadu_si256((const __m256i *)lane_indices);
+        wx = _mm256_permutevar8x32_ps(wx, compaction);
+        wy = _mm256_permutevar8x32_ps(wy, compaction);
+        wz = _mm256_permutevar8x32_ps(wz, compaction);
+
+        // Interleave into x0 y0 z0 x1 y1 z1 ...
+        __m256 xyz0 = _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(wx, interleave0),
+                                                      _mm256_permutevar8x32_ps(wy, interleave0), 0x92),
+                                      _mm256_permutevar8x32_ps(wz, interleave0), 0x24);
+        __m256 xyz1 = _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(wx, interleave1),
+                                                      _mm256_permutevar8x32_ps(wy, interleave1), 0x24),
+                                      _mm256_permutevar8x32_ps(wz, interleave1), 0x49);
+        __m256 xyz2 = _mm256_blend_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(wx, interleave2),
+                                                      _mm256_permutevar8x32_ps(wy, interleave2), 0x49),
+                                      _mm256_permutevar8x32_ps(wz, interleave2), 0x92);
+
+        // Masked stores, so we never write past the points we own
+        const __m256i num_floats = _mm256_set1_epi32(n*3);
+        float *out = (float *)(out_positions + count);
+        _mm256_maskstore_ps(out,      _mm256_cmpgt_epi32(num_floats, lanes0), xyz0);
+        _mm256_maskstore_ps(out + 8,  _mm256_cmpgt_epi32(num_floats, lanes1), xyz1);
+        _mm256_maskstore_ps(out + 16, _mm256_cmpgt_epi32(num_floats, lanes2), xyz2);
+
+        _mm256_maskstore_epi32((int *)(out_tags + count),
+                               _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes0),
+                               tags);
+
+        if(colors)
+        {
+            for(int i=0; i<n; ++i)
+            {
+                out_colors[count+i] = colors[x + lane_indices[i]];
+            }
+        }
+
+        count += n;
+    }
+
+    // The last few pixels of the row
+    count += DeprojectRowScalar(depths + x, colors ? colors + x : NULL, mask ? mask + x : NULL,
+                                rays_x + x, ray_y, width - x,
+                                transform, tag,
+                                out_positions + count, out_colors + count, out_tags + count);
+
+    return count;
+}
+
+#endif
+
+void
+InitializeDeprojection(void)
+{
+    DeprojectRow = &DeprojectRowScalar;
+
+#if DEPROJECTION_X86
+    static_assert(sizeof(MagicMotionTag) == sizeof(int), "The AVX2 kernel stores tags as 32 bit ints");
+    static_assert(sizeof(V3) == 3*sizeof(float), "The AVX2 kernel stores positions as packed floats");
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        _BuildCompactionTable();
+        DeprojectRow = &_DeprojectRowAVX2;
+        puts("Using AVX2 deprojection");
+    }
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef DEPROJECTION_H_
+#define DEPROJECTION_H_
+
+#include "magic_math.h"
+#include "sensor_interface.h"
+#include "magic_motion.h"
+
+// Deproject one row of a depth frame into the point cloud.
+// Pixels with a depth of 0 are skipped, the rest are transformed by
+// transform and written, tightly packed, to the output arrays.
+// If mask is not NULL, pixels with a mask of 0 are skipped too.
+// If colors is NULL, out_colors is not written.
+// rays_x is the per column ray table, ray_y the ray of this row. Both are
+// expected to convert from mm to dm.
+// Returns the number of points written.
+typedef size_t (*DeprojectRowFunc)(const DepthPixel *depths,
+                                   const ColorPixel *colors,
+                                   const float *mask,
+                                   const float *rays_x, float ray_y,
+                                   unsigned int width,
+                                   const Mat4 *transform,
+                                   MagicMotionTag tag,
+                                   V3 *out_positions,
+                                   ColorPixel *out_colors,
+                                   MagicMotionTag *out_tags);
+
+// Picks the fastest kernel the CPU supports. All kernels give
+// bit-identical output.
+void InitializeDeprojection(void);
+
+// Set by InitializeDeprojection
+extern DeprojectRowFunc DeprojectRow;
+
+// Reference implementation, always available
+size_t DeprojectRowScalar(const DepthPixel *depths, const ColorPixel *colors, const float *mask,
+                          const float *rays_x, float ray_y, unsigned int width,
+                          const Mat4 *transform, MagicMotionTag tag,
+                          V3 *out_positions, ColorPixel *out_colors, MagicMotionTag *out_tags);
+
+#endif /* end of include guard: DEPROJECTION_H_ */
@@ -0,0 +1,249 @@
+
+#include "depth_background.h"
+
+#include "simd_kernels.h"
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEPTH_BACKGROUND_X86 1
+#include <immintrin.h>
+#else
+#define DEPTH_BACKGROUND_X86 0
+#endif
+
+// How fast the model adapts, for pixels that look like background and
+// for pixels that look like foreground. The latter is slower, so people
+// standing still are not part of the background right away. The variance
+// only adapts to background pixels, or it would grow to cover anything.
+#define DEPTH_BACKGROUND_LEARNING_RATE 0.02f
+#define DEPTH_BACKGROUND_FOREGROUND_LEARNING_RATE 0.002f
+
+// Pixels closer to the mean than the lower distance (in squared standard
+// deviations) are certain background, pixels further away than the upper
+// are certain foreground
+#define DEPTH_BACKGROUND_LOWER_DISTANCE (2.0f*2.0f)
+#define DEPTH_BACKGROUND_UPPER_DISTANCE (4.0f*4.0f)
+
+// Depth noise grows with the distance. The deviation starts out at a
+// fraction of the depth, and never gets below a (smaller) fraction plus
+// 5 mm.
+#define DEPTH_BACKGROUND_INITIAL_DEVIATION 0.05f
+#define DEPTH_BACKGROUND_MIN_DEVIATION 0.01f
+#define DEPTH_BACKGROUND_MIN_VARIANCE (5.0f*5.0f)
+
+// The luminance has a fixed deviation, in levels of 0-255
+#define DEPTH_BACKGROUND_LUMA_VARIANCE (20.0f*20.0f)
+
+// How much the color counts. 0 is only depth, 1 is only color
+#define DEPTH_BACKGROUND_COLOR_WEIGHT 0.2f
+
+typedef void (*UpdateDepthBackgroundRowFunc)(const DepthPixel *depths, const float *lumas,
+                                             unsigned int width,
+                                             float *depth_means, float *depth_variances,
+                                             float *luma_means, float *mask);
+
+static UpdateDepthBackgroundRowFunc _update_row;
+
+static void
+_UpdateDepthBackgroundRowScalar(const DepthPixel *depths, const float *lumas,
+                                unsigned int width,
+                                float *depth_means, float *depth_variances,
+                                float *luma_means, float *mask)
+{
+    for(unsigned int x=0; x<width; ++x)
+    {
+        const float depth = depths[x];
+        if(!(depth > 0.0f))
+        {
+            mask[x] = 1.0f;
+            continue;
+        }
+
+        const float luma = lumas[x];
+        float depth_mean = depth_means[x];
+        float depth_variance = depth_variances[x];
+        float luma_mean = luma_means[x];
+
+        if(depth_mean == 0.0f)
+        {
+            // The first valid depth of this pixel
+            const float deviation = depth * DEPTH_BACKGROUND_INITIAL_DEVIATION;
+            depth_mean = depth;
+            depth_variance = deviation*deviation;
+            luma_mean = luma;
+        }
+
+        const float dd = depth - depth_mean;
+        const float dl = luma - luma_mean;
+        const float depth_distance = dd*dd / depth_variance;
+        const float luma_distance = dl*dl * (1.0f / DEPTH_BACKGROUND_LUMA_VARIANCE);
+
+        const float scale = 1.0f / (DEPTH_BACKGROUND_UPPER_DISTANCE - DEPTH_BACKGROUND_LOWER_DISTANCE);
+        const float depth_foreground = KernelClamp((depth_distance - DEPTH_BACKGROUND_LOWER_DISTANCE) * scale, 0.0f, 1.0f);
+        const float luma_foreground = KernelClamp((luma_distance - DEPTH_BACKGROUND_LOWER_DISTANCE) * scale, 0.0f, 1.0f);
+        mask[x] = depth_foreground + DEPTH_BACKGROUND_COLOR_WEIGHT * (luma_foreground - depth_foreground);
+
+        const float rate = DEPTH_BACKGROUND_LEARNING_RATE +
+                           (DEPTH_BACKGROUND_FOREGROUND_LEARNING_RATE - DEPTH_BACKGROUND_LEARNING_RATE) * depth_foreground;
+
+        depth_mean = depth_mean + rate * dd;
+        const float new_dd = depth - depth_mean;
+        const float variance_rate = rate * (1.0f - depth_foreground);
+        depth_variance = depth_variance + variance_rate * (new_dd*new_dd - depth_variance);
+        const float min_deviation = depth_mean * DEPTH_BACKGROUND_MIN_DEVIATION;
+        const float min_variance = min_deviation*min_deviation + DEPTH_BACKGROUND_MIN_VARIANCE;
+        luma_mean = luma_mean + rate * dl;
+
+        depth_means[x] = depth_mean;
+        depth_variances[x] = (depth_variance > min_variance) ? depth_variance : min_variance;
+        luma_means[x] = luma_mean;
+    }
+}
+
+#if DEPTH_BACKGROUND_X86
+
+// Same as _UpdateDepthBackgroundRowScalar, 8 pixels at a time, with the
+// same rounding (see simd_kernels.h)
+__attribute__((target("avx2")))
+static void
+_UpdateDepthBackgroundRowAVX2(const DepthPixel *depths, const float *lumas,
+                              unsigned int width,
+                              float *depth_means, float *depth_variances,
+                              float *luma_means, float *mask)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 initial_deviation = _mm256_set1_ps(DEPTH_BACKGROUND_INITIAL_DEVIATION);
+    const __m256 inverse_luma_variance = _mm256_set1_ps(1.0f / DEPTH_BACKGROUND_LUMA_VARIANCE);
+    const __m256 lower_distance = _mm256_set1_ps(DEPTH_BACKGROUND_LOWER_DISTANCE);
+    const __m256 scale = _mm256_set1_ps(1.0f / (DEPTH_BACKGROUND_UPPER_DISTANCE - DEPTH_BACKGROUND_LOWER_DISTANCE));
+    const __m256 color_weight = _mm256_set1_ps(DEPTH_BACKGROUND_COLOR_WEIGHT);
+    const __m256 learning_rate = _mm256_set1_ps(DEPTH_BACKGROUND_LEARNING_RATE);
+    const __m256 rate_difference = _mm256_set1_ps(DEPTH_BACKGROUND_FOREGROUND_LEARNING_RATE - DEPTH_BACKGROUND_LEARNING_RATE);
+    const __m256 min_deviation_scale = _mm256_set1_ps(DEPTH_BACKGROUND_MIN_DEVIATION);
+    const __m256 min_variance_offset = _mm256_set1_ps(DEPTH_BACKGROUND_MIN_VARIANCE);
+
+    unsigned int x = 0;
+    for(; x+8<=width; x+=8)
+    {
+        const __m256 depth = _mm256_loadu_ps(depths + x);
+        const __m256 valid = _mm256_cmp_ps(depth, zero, _CMP_GT_OQ);
+        if(_mm256_movemask_ps(valid) == 0)
+        {
+            _mm256_storeu_ps(mask + x, one);
+            continue;
+        }
+
+        const __m256 luma = _mm256_loadu_ps(lumas + x);
+        const __m256 old_depth_mean = _mm256_loadu_ps(depth_means + x);
+        const __m256 old_depth_variance = _mm256_loadu_ps(depth_variances + x);
+        const __m256 old_luma_mean = _mm256_loadu_ps(luma_means + x);
+
+        // The first valid depth of these pixels
+        const __m256 first = _mm256_cmp_ps(old_depth_mean, zero, _CMP_EQ_OQ);
+        const __m256 deviation = _mm256_mul_ps(depth, initial_deviation);
+        __m256 depth_mean = _mm256_blendv_ps(old_depth_mean, depth, first);
+        __m256 depth_variance = _mm256_blendv_ps(old_depth_variance, _mm256_mul_ps(deviation, deviation), first);
+        __m256 luma_mean = _mm256_blendv_ps(old_luma_mean, luma, first);
+
+        const __m256 dd = _mm256_sub_ps(depth, depth_mean);
+        const __m256 dl = _mm256_sub_ps(luma, luma_mean);
+        const __m256 depth_distance = _mm256_div_ps(_mm256_mul_ps(dd, dd), depth_variance);
+        const __m256 luma_distance = _mm256_mul_ps(_mm256_mul_ps(dl, dl), inverse_luma_variance);
+
+        const __m256 depth_foreground = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(depth_distance, lower_distance), scale), zero), one);
+        const __m256 luma_foreground = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(luma_distance, lower_distance), scale), zero), one);
+        const __m256 foreground = _mm256_add_ps(depth_foreground,
+                                                _mm256_mul_ps(color_weight, _mm256_sub_ps(luma_foreground, depth_foreground)));
+        _mm256_storeu_ps(mask + x, _mm256_blendv_ps(one, foreground, valid));
+
+        const __m256 rate = _mm256_add_ps(learning_rate, _mm256_mul_ps(rate_difference, depth_foreground));
+
+        depth_mean = _mm256_add_ps(depth_mean, _mm256_mul_ps(rate, dd));
+        const __m256 new_dd = _mm256_sub_ps(depth, depth_mean);
+        const __m256 variance_rate = _mm256_mul_ps(rate, _mm256_sub_ps(one, depth_foreground));
+        depth_variance = _mm256_add_ps(depth_variance,
+                                       _mm256_mul_ps(variance_rate, _mm256_sub_ps(_mm256_mul_ps(new_dd, new_dd), depth_variance)));
+        const __m256 min_deviation = _mm256_mul_ps(depth_mean, min_deviation_scale);
+        const __m256 min_variance = _mm256_add_ps(_mm256_mul_ps(min_deviation, min_deviation), min_variance_offset);
+        depth_variance = _mm256_max_ps(depth_variance, min_variance);
+        luma_mean = _mm256_add_ps(luma_mean, _mm256_mul_ps(rate, dl));
+
+        // Pixels without depth keep their model
+        _mm256_storeu_ps(depth_means + x, _mm256_blendv_ps(old_depth_mean, depth_mean, valid));
+        _mm256_storeu_ps(depth_variances + x, _mm256_blendv_ps(old_depth_variance, depth_variance, valid));
+        _mm256_storeu_ps(luma_means + x, _mm256_blendv_ps(old_luma_mean, luma_mean, valid));
+    }
+
+    // The last few pixels of the row
+    _UpdateDepthBackgroundRowScalar(depths + x, lumas + x, width - x,
+                                    depth_means + x, depth_variances + x, luma_means + x,
+                                    mask + x);
+}
+
+#endif
+
+void
+InitializeDepthBackground(DepthBackground *background, unsigned int width, unsigned int height)
+{
+    const size_t num_pixels = width * height;
+
+    background->width = width;
+    background->height = height;
+    background->depth_means = (float *)calloc(num_pixels, sizeof(float));
+    background->depth_variances = (float *)calloc(num_pixels, sizeof(float));
+    background->luma_means = (float *)calloc(num_pixels, sizeof(float));
+    background->lumas = (float *)calloc(num_pixels, sizeof(float));
+    assert(background->depth_means && background->depth_variances &&
+           background->luma_means && background->lumas);
+
+    _update_row = &_UpdateDepthBackgroundRowScalar;
+
+#if DEPTH_BACKGROUND_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        _update_row = &_UpdateDepthBackgroundRowAVX2;
+    }
+#endif
+}
+
+void
+FinalizeDepthBackground(DepthBackground *background)
+{
+    free(background->depth_means);
+    free(background->depth_variances);
+    free(background->luma_means);
+    free(background->lumas);
+}
+
+void
+UpdateDepthBackground(DepthBackground *background,
+                      const DepthPixel *depths, const ColorPixel *colors,
+                      unsigned int color_width, unsigned int color_height,
+                      unsigned int first_row, unsigned int end_row,
+                      float *mask)
+{
+    const unsigned int w = background->width;
+    const unsigned int h = background->height;
+
+    for(unsigned int y=first_row; y<end_row; ++y)
+    {
+        const ColorPixel *color_row = colors + (color_width/2-w/2)+(color_height/2-h/2+y)*color_width;
+        float *lumas = &background->lumas[y*w];
+        for(unsigned int x=0; x<w; ++x)
+        {
+            const ColorPixel c = color_row[x];
+            lumas[x] = c.r * 0.2126f + c.g * 0.7152f + c.b * 0.0722f;
+        }
+
+        _update_row(&depths[y*w], lumas, w,
+                    &background->depth_means[y*w],
+                    &background->depth_variances[y*w],
+                    &background->luma_means[y*w],
+                    &mask[y*w]);
+    }
+}
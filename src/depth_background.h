@@ -0,0 +1,40 @@
+#ifndef DEPTH_BACKGROUND_H_
+#define DEPTH_BACKGROUND_H_
+
+#include "sensor_interface.h"
+
+// A per-pixel background model of one depth stream: a running mean and
+// variance of the depth, and a running mean of the luminance of the
+// matching color pixel. Pixels that are far from their mean, in standard
+// deviations, are foreground. The depth counts the most, as color changes
+// with the lighting.
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+
+    // 0 until the pixel has had a valid depth
+    float *depth_means;
+    float *depth_variances;
+    float *luma_means;
+
+    // The luminance of the current frame, so the rows can be processed 8
+    // pixels at a time
+    float *lumas;
+} DepthBackground;
+
+// Picks the fastest kernel the CPU supports. All kernels give
+// bit-identical output.
+void InitializeDepthBackground(DepthBackground *background, unsigned int width, unsigned int height);
+void FinalizeDepthBackground(DepthBackground *background);
+
+// Update rows [first_row, end_row). The color frame is cropped around its
+// center to the depth resolution, like in the deprojection. Different rows
+// can be updated on different threads.
+void UpdateDepthBackground(DepthBackground *background,
+                           const DepthPixel *depths, const ColorPixel *colors,
+                           unsigned int color_width, unsigned int color_height,
+                           unsigned int first_row, unsigned int end_row,
+                           float *mask);
+
+#endif /* end of include guard: DEPTH_BACKGROUND_H_ */
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <limits.h>
 #include <unistd.h>
 #include <algorithm>
 
@@ -22,6 +23,16 @@
 #include "sensor_serialization.cpp"
 
 #include "magic_motion.h"
+#include "deprojection.cpp"
+#include "voxel_bricks.cpp"
+#include "trilinear.cpp"
+#include "worker_pool.cpp"
+#include "sensor_prefetch.cpp"
+#include "voxel_mog.cpp"
+#include "depth_background.cpp"
+#include "summed_volume.cpp"
+#include "morton.cpp"
+#include "octree.cpp"
 
 #ifdef __cplusplus
 extern "C" {
@@ -37,223 +48,1766 @@ extern "C" {
 
 #define BACKGROUND_PROBABILITY_TRESHOLD 0.25
 
-// The 3D classifiers create a voxel grid
-// background model each point in the cloud
-// can get it's background probability from
-// using trilinear interpolation.
-enum Classifier3D
-{
-    CLASSIFIER_3D_NONE,
-    CLASSIFIER_3D_CALIBRATION_NAIVE,
-    CLASSIFIER_3D_SIMPLE_MOG,
-    CLASSIFIER_3D_DL // Not implemented yet
-};
+// The classifiers set by MagicMotion_Initialize. They can be replaced at
+// runtime with MagicMotion_SetClassifiers.
+static const Classifier3D default_classifier3D = CLASSIFIER_3D_NONE;
+static const Classifier2D default_classifier2D = CLASSIFIER_2D_NONE;
 
-// The 2D classifiers create a mask per sensor
-// containing white pixels for foreground and
-// black pixels for background
-enum Classifier2D
-{
-    CLASSIFIER_2D_NONE,
-    CLASSIFIER_2D_OPENCV
-};
+// With a 2D classifier, the background probability of a point is a blend
+// of the 3D model and the mask of its pixel, or only the mask without a
+// 3D classifier. 0 is only the 3D model, 1 is only the sensor masks.
+// Pixels with a mask of 0 are certain background, and are not deprojected
+// at all, so they are not part of the cloud.
+// Atomic. Set with MagicMotion_SetSensorMaskMix
+static float sensor_mask_mix = 0.2f;
 
-static const Classifier3D classifier3D = CLASSIFIER_3D_NONE;
-static const Classifier2D classifier2D = CLASSIFIER_2D_NONE;
+// The number of frames read from the sensors ahead of the one being
+// processed, on a separate thread. 0 reads the sensors in CaptureFrame.
+// Set with MagicMotion_SetSensorPrefetchDepth before initializing
+static unsigned int sensor_prefetch_depth = 0;
 
 struct ClassifierData3D
 {
-    bool is_calibrating; // For the calibration classifier
+    const MagicMotionClassifier *classifier; // NULL if none
+    void *state;
+    bool is_calibrating; // Atomic. For the calibration classifier
     bool running;
+    int cpu; // The CPU core the thread is pinned to, or -1
     pthread_t thread_handle;
     pthread_mutex_t mutex_handle;
 };
 
 struct ClassifierData2D
 {
+    Classifier2D classifier;
     bool running;
+    int cpu; // The CPU core the thread is pinned to, or -1
     pthread_t thread_handle;
     pthread_mutex_t mutex_handle;
 };
 
+// The sums of the colors of the points in a voxel.
+// Divided by the point count once per frame to get Voxel::color
+struct VoxelColorSum
+{
+    uint32_t r, g, b;
+};
+
+// The number of tasks the points are split into when classifying them
+#define POINT_CHUNKS 64
+
+// The voxels are dealt out to buckets in blocks of VOXEL_BRICK_VOXELS
+// consecutive voxels, so the points of a scene spread over all the
+// buckets wherever they are in the grid. The points are binned by the
+// bucket of their voxel as they are classified.
+#define NUM_VOXEL_BUCKETS 256
+
+// The voxel grid is split into slabs of whole buckets, with about the same
+// number of points each, so the points can be added to the voxels in
+// parallel without any two threads writing to the same voxel.
+#define MAX_VOXEL_SLABS (MAX_WORKER_THREADS+1)
+
+struct VoxelSlab
+{
+    unsigned int first_bucket;
+    unsigned int end_bucket;        // One past the last bucket
+    uint32_t *occupied_voxels;      // The occupied voxels in this slab
+    unsigned int num_occupied_voxels;
+    uint32_t chunk_first_hits[POINT_CHUNKS]; // The number of the occupied voxels first hit in each point chunk
+};
+
+// Marks points that are outside the voxel grid
+#define NO_VOXEL UINT32_MAX
+
+// The noise filter moves the foreground points of voxels with fewer points
+// than this to the background
+#define NOISE_FILTER_MIN_POINTS 8
+
+// The summed volume table is built in this many tasks per step
+#define SUMMED_VOLUME_TASKS 16
+
+// The frames are (up to) triple buffered, so while one frame is computed,
+// readers, like the classifier threads, can hold on to the latest complete
+// frame, and the one before it. Buffers are allocated when first needed.
+#define NUM_FRAME_BUFFERS 3
+
 struct SensorFrame
 {
     ColorPixel *color_frame;
     float *depth_frame;
 };
 
+// Unit depth ray directions for each column and row of a depth stream.
+// The deprojection of a pixel then becomes a multiplication per axis,
+// instead of a tanf per axis per pixel. The tables are scaled from mm to
+// dm, so the depth value can be used directly.
+struct RayTable
+{
+    float *x; // One entry per column
+    float *y; // One entry per row
+
+    // The stream info the tables were built from
+    int width;
+    int height;
+    float fov;
+    float aspect;
+};
+
+// The cloud is computed in tiles of rows of a depth frame, so the
+// sensors, and the rows within a sensor, can be processed in parallel.
+#define CLOUD_TILES_PER_SENSOR 16
+
+// The points are binned in the ranges they are classified in, the cloud tiles
+#define MAX_POINT_RANGES (MAX_SENSORS*CLOUD_TILES_PER_SENSOR)
+
+struct CloudTile
+{
+    unsigned int sensor_index;
+    unsigned int first_row;
+    unsigned int end_row;      // One past the last row
+    unsigned int point_offset; // Index of the first point of this tile in the cloud
+    unsigned int point_count;  // The number of valid depth pixels in this tile
+};
+
 static struct
 {
     // Per sensor data:
     SensorInfo  sensors[MAX_SENSORS];
     SensorFrame sensor_frames[MAX_SENSORS];
     float      *sensor_masks[MAX_SENSORS];
+    RayTable    sensor_rays[MAX_SENSORS];
     Frustum     sensor_frustums[MAX_SENSORS];
     unsigned int num_active_sensors;
+    SensorPrefetch sensor_prefetch;
+
+    float *background_model;     // A per-voxel array of the background model
+
+    unsigned int frame_count;    // The frame count increments at every call to CaptureFrame
+
+    // The classifier threads sleep on frame_condition until a new frame is complete
+    unsigned int completed_frame_count; // Protected by frame_mutex
+    pthread_mutex_t frame_mutex;
+    pthread_cond_t frame_condition;
+
+    // The buffers of the frame currently being computed. They point into
+    // frame_buffers[back_frame]
+    V3 *spatial_cloud;           // XYZ components of the point cloud
+    ColorPixel *color_cloud;          // RGB components of the point cloud
+    MagicMotionTag *tag_cloud;   // 32 bit tags for each point in the cloud
+    unsigned int cloud_size;     // The number of points currently in the cloud
+    unsigned int cloud_capacity; // The maximum number of points in the cloud
+
+    MagicMotionFrame frame_buffers[NUM_FRAME_BUFFERS];
+    unsigned int frame_refcounts[NUM_FRAME_BUFFERS]; // Readers holding each frame. Atomic
+    unsigned int latest_frame;   // The latest complete frame. Atomic
+    unsigned int back_frame;     // The frame being computed
+
+    pthread_t capture_thread_handle;
+    bool capture_thread_running; // Atomic
+
+    CloudTile cloud_tiles[MAX_SENSORS*CLOUD_TILES_PER_SENSOR];
+    unsigned int num_cloud_tiles;
+
+    WorkerPool workers;          // Used to parallelize the per frame work
+
+    MagicMotionVoxelGrid grid;   // Set once, at initialization
+    uint32_t voxel_capacity;     // grid.num_voxels rounded up to whole MOG blocks. The length of the per-voxel arrays
+    VoxelBrickMap bricks;        // The storage of the voxel grid, if it is sparse
+
+    Voxel *voxels;               // The voxel grid, with the lastest information
+    uint32_t *occupied_voxels;   // Indices of the voxels with at least one point, in the order they were first hit
+    unsigned int num_occupied_voxels;
+    VoxelColorSum *voxel_color_sums; // Per-voxel color accumulators, only valid for the occupied voxels
+    VoxelColorSum *voxel_level_color_sums; // The same for the voxels of level 1 and up
+    uint32_t *voxel_foreground_counts; // Per-voxel foreground point counts, only valid for the occupied voxels
+
+    uint32_t *point_voxels;      // The voxel index of each point in the cloud, or NO_VOXEL
+    uint32_t *point_bins;        // The points of each range of the cloud, in that range, by voxel bucket
+    uint32_t point_bin_starts[MAX_POINT_RANGES][NUM_VOXEL_BUCKETS+1]; // Where each bucket of each range starts in point_bins
+    unsigned int num_point_ranges;
+    uint8_t *point_first_hits;   // 1 for the points that were the first in their voxel, until the voxels are listed
+    uint32_t chunk_voxel_counts[POINT_CHUNKS]; // Where the voxels listed from each point chunk start
+    VoxelSlab voxel_slabs[MAX_VOXEL_SLABS];
+    unsigned int num_voxel_slabs;
+    uint32_t *slab_occupied_voxels; // Storage for the per-slab lists, one entry per point
+
+    // Thread userdata
+    ClassifierData3D classifier_thread_3D;
+    ClassifierData2D classifier_thread_2D;
+
+    // How the points of the frame being computed are classified. Set at the
+    // start of each frame, so the classifiers can be replaced between frames.
+    MagicMotionClassifyBatchFunc classify_batch; // NULL without a 3D classifier
+    void *classifier_state;
+    float mask_mix; // sensor_mask_mix, for the frame being captured
+    bool frame_is_calibrating[NUM_FRAME_BUFFERS]; // If calibrating when the frame in the buffer was captured
+
+    bool skip_colors; // Atomic. Set by MagicMotion_SetColorSampling
+
+    // For MagicMotion_QueryAABB, per frame buffer. Allocated when first needed
+    bool build_summed_volumes; // Atomic
+    VoxelCountSum *summed_volumes[NUM_FRAME_BUFFERS];
+    bool has_summed_volume[NUM_FRAME_BUFFERS]; // If the summed volume is of the current frame in the buffer
+
+    // For sparse grids, summed_volumes has a table per brick, only built
+    // for the bricks with points in the frame. The summed volume functions
+    // work on a brick as the dense grid of VOXEL_BRICK_SIZE^3 voxels it is
+    // laid out like, brick_grid.
+    MagicMotionVoxelGrid brick_grid;
+    uint32_t *summed_brick_frames[NUM_FRAME_BUFFERS]; // The frame number each brick's table is of
+    uint32_t *summed_bricks[NUM_FRAME_BUFFERS];       // The bricks with points in the frame
+    unsigned int num_summed_bricks[NUM_FRAME_BUFFERS];
+
+    // For the neighbour queries, per frame buffer. The trees keep their
+    // memory between frames
+    bool build_spatial_indices; // Atomic
+    Octree spatial_indices[NUM_FRAME_BUFFERS];
+    bool has_spatial_index[NUM_FRAME_BUFFERS]; // If the tree is of the current frame in the buffer
+
+    // For MagicMotion_SetMortonOrder. Allocated when first needed
+    bool morton_order; // Atomic
+    uint32_t *point_morton_codes;  // The Morton code of the voxel of each point within the grid
+    uint32_t *point_numbers;       // The index in the cloud of each of them, to sort along with the codes
+    uint32_t chunk_grid_points[POINT_CHUNKS]; // Where the points within the grid of each point chunk start
+    uint32_t num_grid_points;
+    uint32_t *sorted_morton_codes;
+    uint32_t *point_order;         // The index each sorted point had in the cloud
+    MortonSortBuffers morton_sort_buffers;
+    V3 *sorted_positions;          // Swapped with the buffers of the frame after sorting
+    ColorPixel *sorted_colors;
+    MagicMotionTag *sorted_tags;
+    MagicMotionVoxelPoints *voxel_points[NUM_FRAME_BUFFERS];
+} magic_motion;
+
+// (Re)build the ray table of a sensor if the depth stream info
+// has changed since the last time it was built
+static void
+_UpdateRayTable(RayTable *rays, const SensorInfo *sensor)
+{
+    const int w = sensor->depth_stream_info.width;
+    const int h = sensor->depth_stream_info.height;
+    const float fov = sensor->depth_stream_info.fov;
+    const float aspect = sensor->depth_stream_info.aspect_ratio;
+
+    if(rays->x && rays->y &&
+       rays->width == w && rays->height == h &&
+       rays->fov == fov && rays->aspect == aspect)
+    {
+        return;
+    }
+
+    free(rays->x);
+    free(rays->y);
+    rays->x = (float *)malloc(w * sizeof(float));
+    rays->y = (float *)malloc(h * sizeof(float));
+    assert(rays->x && rays->y);
+
+    for(int x=0; x<w; ++x)
+    {
+        rays->x[x] = tanf((((float)x/(float)w)-0.5f)*fov) / 100.0f;
+    }
+
+    for(int y=0; y<h; ++y)
+    {
+        rays->y[y] = tanf((0.5f-((float)y/(float)h))*(fov/aspect)) / 100.0f;
+    }
+
+    rays->width = w;
+    rays->height = h;
+    rays->fov = fov;
+    rays->aspect = aspect;
+}
+
+// The templates can't have C linkage
+extern "C++" {
+
+// The options a frame is processed with. The per-point code is a template
+// over them, and each frame runs the instantiation for its options, so the
+// options that are off cost nothing per point. The grid addressing is one
+// field of three values rather than two flags, as a sparse grid is never
+// addressed as a power of two grid.
+enum PipelineOption
+{
+    PIPELINE_CLASSIFY     = 1 << 0, // Without it, every point in the grid is foreground
+    PIPELINE_SENSOR_MASKS = 1 << 1, // Skip masked out pixels, and blend the masks into the classification
+    PIPELINE_FILTER_NOISE = 1 << 2, // Move foreground points in sparse voxels to the background
+    PIPELINE_COLORS       = 1 << 3, // Sample the colors of the points and voxels
+    PIPELINE_SUMMED_VOLUME= 1 << 4, // Build the summed volume table for MagicMotion_QueryAABB
+
+    PIPELINE_DENSE_GRID   = 0 << 5, // The voxel grid is indexed x, then y, then z
+    PIPELINE_POW2_GRID    = 1 << 5, // All voxel grid dimensions are powers of two
+    PIPELINE_SPARSE_GRID  = 2 << 5, // The voxel grid is stored in bricks
+    PIPELINE_GRID_MASK    = 3 << 5,
+
+    NUM_PIPELINE_VARIANTS = 3 << 5
+};
+
+// The background probabilities are looked up for this many points at a time
+#define CLASSIFY_BATCH_SIZE 64
+
+// The voxel index of voxel coordinates within the grid. Sparse grids give
+// the brick of the voxel storage if it has none, and NO_VOXEL when all the
+// bricks are in use.
+template<unsigned int options>
+static inline uint32_t
+_GridVoxelIndex(uint32_t x, uint32_t y, uint32_t z)
+{
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    if((options & PIPELINE_GRID_MASK) == PIPELINE_SPARSE_GRID) return AddBrickVoxel(&magic_motion.bricks, x, y, z);
+    if((options & PIPELINE_GRID_MASK) == PIPELINE_POW2_GRID) return x | (y << grid->shift_y) | (z << grid->shift_z);
+    return x + (y + z*grid->num_voxels_y)*grid->num_voxels_x;
+}
+
+// Classify point i of the cloud, and find its voxel. background_probability
+// is only used with PIPELINE_CLASSIFY.
+template<unsigned int options>
+static inline void
+_ClassifyPoint(unsigned int i, float background_probability)
+{
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    V3 point = magic_motion.spatial_cloud[i];
+    int tag = (int)magic_motion.tag_cloud[i];
+    uint32_t voxel_index = NO_VOXEL;
+
+    // The position of the point in voxels from the corner of the grid
+    const float u = (point.x - grid->origin.x) * grid->voxels_per_unit;
+    const float v = (point.y - grid->origin.y) * grid->voxels_per_unit;
+    const float w = (point.z - grid->origin.z) * grid->voxels_per_unit;
+
+    // Check if the point is within the voxel grid
+    if(u >= 0.0f && u < (float)grid->num_voxels_x &&
+       v >= 0.0f && v < (float)grid->num_voxels_y &&
+       w >= 0.0f && w < (float)grid->num_voxels_z)
+    {
+        voxel_index = _GridVoxelIndex<options>((uint32_t)u, (uint32_t)v, (uint32_t)w);
+        assert(voxel_index < grid->num_voxels || voxel_index == NO_VOXEL);
+    }
+
+    if(voxel_index != NO_VOXEL)
+    {
+        // Determine if the point is background or foreground
+        if(!(options & PIPELINE_CLASSIFY))
+        {
+            // If we are not using any classifiers, we just set every tag to foreground.
+            // Some applications don't use MM for background subtraction, and shouldn't
+            // have to pay for it.
+            tag |= TAG_FOREGROUND;
+        }
+        else if(background_probability < BACKGROUND_PROBABILITY_TRESHOLD)
+        {
+            tag |= TAG_FOREGROUND;
+        }
+        else
+        {
+            tag |= TAG_BACKGROUND;
+        }
+    }
+
+    magic_motion.tag_cloud[i] = (MagicMotionTag)tag;
+    magic_motion.point_voxels[i] = voxel_index;
+}
+
+// Blend the background probabilities from the 3D classifier with the 2D
+// foreground probabilities of the pixels of the points. Without a 3D
+// classifier, the background probabilities are only from the masks.
+static inline void
+_BlendSensorMasks(float *background_probabilities, const float *sensor_masks, unsigned int count,
+                  bool has_classifier_3D, float mix)
+{
+    for(unsigned int j=0; j<count; ++j)
+    {
+        const float mask_probability = 1.0f - sensor_masks[j];
+        background_probabilities[j] = has_classifier_3D ?
+                                      LERP(background_probabilities[j], mask_probability, mix) :
+                                      mask_probability;
+    }
+}
+
+// Classify count <= CLASSIFY_BATCH_SIZE points of the cloud from start.
+// sensor_masks is the 2D foreground probability of the pixel of each
+// point, with PIPELINE_SENSOR_MASKS.
+template<unsigned int options>
+static void
+_ClassifyPointBatch(unsigned int start, unsigned int count, const float *sensor_masks)
+{
+    float background_probabilities[CLASSIFY_BATCH_SIZE];
+    assert(count <= CLASSIFY_BATCH_SIZE);
+
+    if(options & PIPELINE_CLASSIFY)
+    {
+        // Without a 3D classifier, every point is foreground as far as the
+        // 3D model is concerned
+        if(magic_motion.classify_batch)
+        {
+            // The classifiers are cheaper for all the points at once, even
+            // if some of them are outside the grid. Those get results we
+            // ignore.
+            magic_motion.classify_batch(magic_motion.classifier_state,
+                                        &magic_motion.spatial_cloud[start], count,
+                                        background_probabilities);
+        }
+        else
+        {
+            memset(background_probabilities, 0, count*sizeof(float));
+        }
+
+        if(options & PIPELINE_SENSOR_MASKS)
+        {
+            _BlendSensorMasks(background_probabilities, sensor_masks, count,
+                              magic_motion.classify_batch != NULL, magic_motion.mask_mix);
+        }
+    }
+
+    for(unsigned int j=0; j<count; ++j)
+    {
+        _ClassifyPoint<options>(start+j, background_probabilities[j]);
+    }
+}
+
+// Classify the points in [start, end) of the cloud, and find the voxel of each point
+template<unsigned int options>
+static void
+_ClassifyPointRange(unsigned int start, unsigned int end)
+{
+    for(unsigned int i=start; i<end; i+=CLASSIFY_BATCH_SIZE)
+    {
+        _ClassifyPointBatch<options & ~PIPELINE_SENSOR_MASKS>(i, MIN(end-i, CLASSIFY_BATCH_SIZE), NULL);
+    }
+}
+
+// Classify the points in [start, end) of the cloud, which were deprojected
+// from a row of depths with the given mask
+template<unsigned int options>
+static void
+_ClassifyRowPoints(unsigned int start, unsigned int end,
+                   const DepthPixel *depths, const float *mask)
+{
+    float sensor_masks[CLASSIFY_BATCH_SIZE];
+    unsigned int batch_start = start;
+    unsigned int batch_count = 0;
+
+    unsigned int x = 0;
+    for(unsigned int i=start; i<end; ++i, ++x)
+    {
+        // Find the pixel of the point, the same way DeprojectRow does
+        while(!(depths[x] > 0.0f && mask[x] > 0.0f)) ++x;
+
+        sensor_masks[batch_count++] = mask[x];
+        if(batch_count == CLASSIFY_BATCH_SIZE)
+        {
+            _ClassifyPointBatch<options>(batch_start, batch_count, sensor_masks);
+            batch_start += batch_count;
+            batch_count = 0;
+        }
+    }
+
+    if(batch_count > 0)
+    {
+        _ClassifyPointBatch<options>(batch_start, batch_count, sensor_masks);
+    }
+}
+
+static inline void
+_GetPointChunk(unsigned int chunk_index, unsigned int *start, unsigned int *end)
+{
+    const unsigned int chunk_size = (magic_motion.cloud_size + POINT_CHUNKS-1) / POINT_CHUNKS;
+    *start = MIN(chunk_index * chunk_size, magic_motion.cloud_size);
+    *end = MIN(*start + chunk_size, magic_motion.cloud_size);
+}
+
+static inline unsigned int
+_VoxelBucket(uint32_t voxel_index)
+{
+    return (voxel_index / VOXEL_BRICK_VOXELS) % NUM_VOXEL_BUCKETS;
+}
+
+// Bin the classified points in [start, end) of the cloud by the bucket of
+// their voxel, into the same range of point_bins. The points of a bucket
+// stay in cloud order, and the points outside the grid are left out.
+static void
+_BinPointRange(unsigned int range_index, unsigned int start, unsigned int end)
+{
+    const uint32_t *point_voxels = magic_motion.point_voxels;
+    uint32_t *bin_starts = magic_motion.point_bin_starts[range_index];
+
+    uint32_t counts[NUM_VOXEL_BUCKETS] = {};
+    for(unsigned int i=start; i<end; ++i)
+    {
+        if(point_voxels[i] != NO_VOXEL) ++counts[_VoxelBucket(point_voxels[i])];
+    }
+
+    uint32_t offset = start;
+    for(unsigned int i=0; i<NUM_VOXEL_BUCKETS; ++i)
+    {
+        bin_starts[i] = offset;
+        offset += counts[i];
+        counts[i] = bin_starts[i]; // Now the next free entry of the bucket
+    }
+    bin_starts[NUM_VOXEL_BUCKETS] = offset;
+
+    for(unsigned int i=start; i<end; ++i)
+    {
+        if(point_voxels[i] != NO_VOXEL) magic_motion.point_bins[counts[_VoxelBucket(point_voxels[i])]++] = i;
+    }
+}
+
+// Worker task: count the points a cloud tile will produce
+template<unsigned int options>
+static void
+_CountCloudTilePoints(void *userdata, unsigned int tile_index)
+{
+    CloudTile *tile = &magic_motion.cloud_tiles[tile_index];
+    const SensorInfo *sensor = &magic_motion.sensors[tile->sensor_index];
+    const DepthPixel *depths = magic_motion.sensor_frames[tile->sensor_index].depth_frame;
+    const size_t w = sensor->depth_stream_info.width;
+
+    unsigned int count = 0;
+    if(options & PIPELINE_SENSOR_MASKS)
+    {
+        const float *mask = magic_motion.sensor_masks[tile->sensor_index];
+        for(size_t i=tile->first_row*w; i<tile->end_row*w; ++i)
+        {
+            count += (depths[i] > 0.0f && mask[i] > 0.0f);
+        }
+    }
+    else
+    {
+        for(size_t i=tile->first_row*w; i<tile->end_row*w; ++i)
+        {
+            count += (depths[i] > 0.0f);
+        }
+    }
+
+    tile->point_count = count;
+}
+
+// Worker task: deproject a cloud tile into its reserved range of the cloud
+template<unsigned int options>
+static void
+_DeprojectCloudTile(void *userdata, unsigned int tile_index)
+{
+    const CloudTile *tile = &magic_motion.cloud_tiles[tile_index];
+    const unsigned int i = tile->sensor_index;
+    const SensorInfo *sensor = &magic_motion.sensors[i];
+    const ColorPixel *colors = magic_motion.sensor_frames[i].color_frame;
+    const DepthPixel *depths = magic_motion.sensor_frames[i].depth_frame;
+    const float *masks = (options & PIPELINE_SENSOR_MASKS) ? magic_motion.sensor_masks[i] : NULL;
+    const RayTable *rays = &magic_motion.sensor_rays[i];
+    const Mat4 camera_transform = magic_motion.sensor_frustums[i].transform;
+    const MagicMotionTag tag = (MagicMotionTag)(TAG_CAMERA_0 + i);
+
+    const unsigned int w = sensor->depth_stream_info.width;
+    const unsigned int h = sensor->depth_stream_info.height;
+    const unsigned int color_w = sensor->color_stream_info.width;
+    const unsigned int color_h = sensor->color_stream_info.height;
+
+    unsigned int index = tile->point_offset;
+    for(uint32_t y=tile->first_row; y<tile->end_row; ++y)
+    {
+        const ColorPixel *color_row = (options & PIPELINE_COLORS) ?
+                                      colors + (color_w/2-w/2)+(color_h/2-h/2+y)*color_w :
+                                      NULL;
+        const float *mask_row = masks ? &masks[y*w] : NULL;
+
+        const unsigned int count = DeprojectRow(&depths[y*w], color_row, mask_row,
+                                                rays->x, rays->y[y], w,
+                                                &camera_transform, tag,
+                                                &magic_motion.spatial_cloud[index],
+                                                &magic_motion.color_cloud[index],
+                                                &magic_motion.tag_cloud[index]);
+
+        // The mask of each point is only known here, so we classify the
+        // row right away instead of keeping the masks of the points around
+        if(options & PIPELINE_SENSOR_MASKS)
+        {
+            _ClassifyRowPoints<options>(index, index+count, &depths[y*w], mask_row);
+        }
+
+        index += count;
+    }
+
+    assert(index == tile->point_offset + tile->point_count);
+
+    // Each tile is classified, and its points binned by the bucket of their
+    // voxels, right after it is deprojected, while its points are still in
+    // cache. With a 2D classifier, the rows were classified above.
+    if(!(options & PIPELINE_SENSOR_MASKS)) _ClassifyPointRange<options>(tile->point_offset, index);
+    _BinPointRange(tile_index, tile->point_offset, index);
+}
+
+// Split the voxel buckets into one slab per thread, with about the same
+// number of points in each slab
+static void
+_SplitVoxelSlabs(void)
+{
+    uint32_t bucket_points[NUM_VOXEL_BUCKETS] = {};
+    uint32_t total_points = 0;
+    for(unsigned int i=0; i<magic_motion.num_point_ranges; ++i)
+    {
+        const uint32_t *bin_starts = magic_motion.point_bin_starts[i];
+        for(unsigned int j=0; j<NUM_VOXEL_BUCKETS; ++j)
+        {
+            bucket_points[j] += bin_starts[j+1] - bin_starts[j];
+        }
+        total_points += bin_starts[NUM_VOXEL_BUCKETS] - bin_starts[0];
+    }
+
+    magic_motion.num_voxel_slabs = magic_motion.workers.num_threads+1;
+    unsigned int bucket = 0;
+    uint32_t points = 0;
+    for(unsigned int i=0; i<magic_motion.num_voxel_slabs; ++i)
+    {
+        VoxelSlab *slab = &magic_motion.voxel_slabs[i];
+        const bool last = (i+1 == magic_motion.num_voxel_slabs);
+        const uint32_t end_points = (uint32_t)(((uint64_t)(i+1) * total_points) / magic_motion.num_voxel_slabs);
+
+        // A slab has no more occupied voxels than points, so its list gets
+        // the entries of its points
+        slab->occupied_voxels = &magic_motion.slab_occupied_voxels[points];
+        slab->first_bucket = bucket;
+        while(bucket < NUM_VOXEL_BUCKETS && (last || points < end_points))
+        {
+            points += bucket_points[bucket++];
+        }
+        slab->end_bucket = bucket;
+        slab->num_occupied_voxels = 0;
+    }
+}
+
+// Worker task: add the points of a slab of the voxel grid to their voxels
+template<unsigned int options>
+static void
+_AccumulateVoxelSlab(void *userdata, unsigned int slab_index)
+{
+    VoxelSlab *slab = &magic_motion.voxel_slabs[slab_index];
+    const uint32_t *point_voxels = magic_motion.point_voxels;
+    const unsigned int chunk_size = (magic_motion.cloud_size + POINT_CHUNKS-1) / POINT_CHUNKS;
+
+    slab->num_occupied_voxels = 0;
+    memset(slab->chunk_first_hits, 0, sizeof(slab->chunk_first_hits));
+
+    // The ranges are in cloud order, and so are the points of each bucket
+    // within a range, so each voxel sees its points in cloud order
+    for(unsigned int r=0; r<magic_motion.num_point_ranges; ++r)
+    {
+        const uint32_t *bin_starts = magic_motion.point_bin_starts[r];
+        for(uint32_t j=bin_starts[slab->first_bucket]; j<bin_starts[slab->end_bucket]; ++j)
+        {
+            const uint32_t i = magic_motion.point_bins[j];
+            const uint32_t voxel_index = point_voxels[i];
+
+            Voxel *v = &magic_motion.voxels[voxel_index];
+            if(v->point_count == 0)
+            {
+                slab->occupied_voxels[slab->num_occupied_voxels++] = voxel_index;
+                magic_motion.point_first_hits[i] = 1;
+                ++slab->chunk_first_hits[i / chunk_size];
+            }
+
+            if(options & PIPELINE_SUMMED_VOLUME)
+            {
+                magic_motion.voxel_foreground_counts[voxel_index] += ((magic_motion.tag_cloud[i] & TAG_FOREGROUND) != 0);
+            }
+
+            // The average color is resolved after all points are added
+            if(options & PIPELINE_COLORS)
+            {
+                const ColorPixel color = magic_motion.color_cloud[i];
+                VoxelColorSum *sum = &magic_motion.voxel_color_sums[voxel_index];
+                sum->r += color.r;
+                sum->g += color.g;
+                sum->b += color.b;
+            }
+
+            ++v->point_count;
+        }
+    }
+
+    // The naive classifier needs some help with noise. Once all the points
+    // of the slab are added, the foreground points in its sparse voxels are
+    // moved to the background.
+    if(options & PIPELINE_FILTER_NOISE)
+    {
+        for(unsigned int r=0; r<magic_motion.num_point_ranges; ++r)
+        {
+            const uint32_t *bin_starts = magic_motion.point_bin_starts[r];
+            for(uint32_t j=bin_starts[slab->first_bucket]; j<bin_starts[slab->end_bucket]; ++j)
+            {
+                const uint32_t i = magic_motion.point_bins[j];
+                uint32_t tag = magic_motion.tag_cloud[i];
+                if((tag & TAG_FOREGROUND) &&
+                   magic_motion.voxels[point_voxels[i]].point_count < NOISE_FILTER_MIN_POINTS)
+                {
+                    tag |= TAG_BACKGROUND;
+                    tag &= ~TAG_FOREGROUND;
+                    magic_motion.tag_cloud[i] = (MagicMotionTag)tag;
+                }
+            }
+        }
+    }
+
+    if(!(options & PIPELINE_COLORS)) return;
+
+    for(unsigned int i=0; i<slab->num_occupied_voxels; ++i)
+    {
+        const uint32_t voxel_index = slab->occupied_voxels[i];
+        Voxel *v = &magic_motion.voxels[voxel_index];
+        const VoxelColorSum sum = magic_motion.voxel_color_sums[voxel_index];
+        const uint32_t half = v->point_count / 2; // Round to nearest
+
+        v->color.r = (uint8_t)((sum.r + half) / v->point_count);
+        v->color.g = (uint8_t)((sum.g + half) / v->point_count);
+        v->color.b = (uint8_t)((sum.b + half) / v->point_count);
+
+        // Ready for the next frame
+        magic_motion.voxel_color_sums[voxel_index] = (VoxelColorSum){};
+    }
+}
+
+// Worker task: list the occupied voxels first hit in a chunk of the cloud,
+// from the chunk's offset in chunk_voxel_counts
+static void
+_ListOccupiedVoxels(void *userdata, unsigned int chunk_index)
+{
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+
+    uint32_t index = magic_motion.chunk_voxel_counts[chunk_index];
+    for(unsigned int i=start; i<end; ++i)
+    {
+        if(!magic_motion.point_first_hits[i]) continue;
+
+        magic_motion.point_first_hits[i] = 0; // Ready for the next frame
+        magic_motion.occupied_voxels[index++] = magic_motion.point_voxels[i];
+    }
+}
+
+// Merge the occupied voxels of all slabs into one list, ordered by the
+// first point that hit them. This is the order one thread adding all the
+// points in sequence would have found them in.
+static void
+_MergeOccupiedVoxels(void)
+{
+    uint32_t offset = 0;
+    for(unsigned int i=0; i<POINT_CHUNKS; ++i)
+    {
+        magic_motion.chunk_voxel_counts[i] = offset;
+        for(unsigned int j=0; j<magic_motion.num_voxel_slabs; ++j)
+        {
+            offset += magic_motion.voxel_slabs[j].chunk_first_hits[i];
+        }
+    }
+
+    RunWorkerTasks(&magic_motion.workers, &_ListOccupiedVoxels, NULL, POINT_CHUNKS);
+    magic_motion.num_occupied_voxels = offset;
+}
+
+// Worker task: sum a range of voxel planes of the summed volume table
+static void
+_SumVoxelPlanes(void *userdata, unsigned int task_index)
+{
+    const uint32_t min_foreground_points = *(const uint32_t *)userdata;
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    SumVoxelPlanes(magic_motion.summed_volumes[magic_motion.back_frame], grid,
+                   magic_motion.voxels, magic_motion.voxel_foreground_counts,
+                   min_foreground_points,
+                   (task_index * grid->num_voxels_z) / SUMMED_VOLUME_TASKS,
+                   ((task_index+1) * grid->num_voxels_z) / SUMMED_VOLUME_TASKS);
+}
+
+// Worker task: sum a range of rows of the summed volume table along z
+static void
+_SumVolumeRows(void *userdata, unsigned int task_index)
+{
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    SumVolumeRows(magic_motion.summed_volumes[magic_motion.back_frame], grid,
+                  (task_index * SUMMED_VOLUME_Y(grid)) / SUMMED_VOLUME_TASKS,
+                  ((task_index+1) * SUMMED_VOLUME_Y(grid)) / SUMMED_VOLUME_TASKS);
+}
+
+// Worker task: build the summed volume tables of a range of the bricks with
+// points in the frame
+static void
+_SumBrickVolumes(void *userdata, unsigned int task_index)
+{
+    const uint32_t min_foreground_points = *(const uint32_t *)userdata;
+    const MagicMotionVoxelGrid *brick_grid = &magic_motion.brick_grid;
+    const unsigned int num_bricks = magic_motion.num_summed_bricks[magic_motion.back_frame];
+    const unsigned int start = (task_index * num_bricks) / SUMMED_VOLUME_TASKS;
+    const unsigned int end = ((task_index+1) * num_bricks) / SUMMED_VOLUME_TASKS;
+    for(unsigned int i=start; i<end; ++i)
+    {
+        const uint32_t brick = magic_motion.summed_bricks[magic_motion.back_frame][i];
+        const uint32_t first_voxel = brick * VOXEL_BRICK_VOXELS;
+        VoxelCountSum *volume = &magic_motion.summed_volumes[magic_motion.back_frame][brick * SUMMED_VOLUME_SIZE(brick_grid)];
+
+        SumVoxelPlanes(volume, brick_grid,
+                       &magic_motion.voxels[first_voxel], &magic_motion.voxel_foreground_counts[first_voxel],
+                       min_foreground_points, 0, VOXEL_BRICK_SIZE);
+        SumVolumeRows(volume, brick_grid, 0, SUMMED_VOLUME_Y(brick_grid));
+    }
+}
+
+// The summed volume tables of a sparse grid are per brick, and only the
+// bricks with points in the frame get new tables
+static void
+_BuildBrickVolumes(uint32_t min_foreground_points)
+{
+    const unsigned int frame_index = magic_motion.back_frame;
+    const uint32_t max_bricks = magic_motion.grid.max_bricks;
+    if(!magic_motion.summed_volumes[frame_index])
+    {
+        magic_motion.summed_volumes[frame_index] = (VoxelCountSum *)malloc(max_bricks * SUMMED_VOLUME_SIZE(&magic_motion.brick_grid) *
+                                                                           sizeof(VoxelCountSum));
+        magic_motion.summed_brick_frames[frame_index] = (uint32_t *)calloc(max_bricks, sizeof(uint32_t));
+        magic_motion.summed_bricks[frame_index] = (uint32_t *)malloc(max_bricks * sizeof(uint32_t));
+        assert(magic_motion.summed_volumes[frame_index] && magic_motion.summed_brick_frames[frame_index] &&
+               magic_motion.summed_bricks[frame_index]);
+    }
+
+    // Each brick once. The tables of the other bricks are left as they
+    // are, and their frame numbers tell they are old.
+    uint32_t *brick_frames = magic_motion.summed_brick_frames[frame_index];
+    uint32_t *bricks = magic_motion.summed_bricks[frame_index];
+    unsigned int num_bricks = 0;
+    for(unsigned int i=0; i<magic_motion.num_occupied_voxels; ++i)
+    {
+        const uint32_t brick = magic_motion.occupied_voxels[i] / VOXEL_BRICK_VOXELS;
+        if(brick_frames[brick] == magic_motion.frame_count) continue;
+
+        brick_frames[brick] = magic_motion.frame_count;
+        bricks[num_bricks++] = brick;
+    }
+    magic_motion.num_summed_bricks[frame_index] = num_bricks;
+
+    RunWorkerTasks(&magic_motion.workers, &_SumBrickVolumes, &min_foreground_points, SUMMED_VOLUME_TASKS);
+}
+
+// Build the summed volume table of the frame from its voxels, and the
+// foreground counts of the voxels
+static void
+_BuildSummedVolume(uint32_t min_foreground_points)
+{
+    VoxelCountSum **volume = &magic_motion.summed_volumes[magic_motion.back_frame];
+    if(magic_motion.grid.sparse)
+    {
+        _BuildBrickVolumes(min_foreground_points);
+    }
+    else
+    {
+        if(!*volume)
+        {
+            *volume = (VoxelCountSum *)malloc(SUMMED_VOLUME_SIZE(&magic_motion.grid) * sizeof(VoxelCountSum));
+            assert(*volume);
+        }
+
+        RunWorkerTasks(&magic_motion.workers, &_SumVoxelPlanes, &min_foreground_points, SUMMED_VOLUME_TASKS);
+        RunWorkerTasks(&magic_motion.workers, &_SumVolumeRows, NULL, SUMMED_VOLUME_TASKS);
+    }
+
+    // Ready for the next frame
+    for(unsigned int i=0; i<magic_motion.num_occupied_voxels; ++i)
+    {
+        magic_motion.voxel_foreground_counts[magic_motion.occupied_voxels[i]] = 0;
+    }
+
+    magic_motion.has_summed_volume[magic_motion.back_frame] = true;
+}
+
+// Worker task: count the points of a chunk of the cloud that are within
+// the grid
+static void
+_CountGridPoints(void *userdata, unsigned int chunk_index)
+{
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+
+    uint32_t count = 0;
+    for(unsigned int i=start; i<end; ++i)
+    {
+        count += (magic_motion.point_voxels[i] != NO_VOXEL);
+    }
+
+    magic_motion.chunk_grid_points[chunk_index] = count;
+}
+
+// Worker task: compute the Morton codes of the voxels of the points of a
+// chunk of the cloud that are within the grid, from the chunk's offset in
+// chunk_grid_points. Every code is a voxel, so the points outside the grid
+// are not sorted, and go straight after the sorted points in point_order.
+static void
+_EncodeMortonCodes(void *userdata, unsigned int chunk_index)
+{
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+
+    uint32_t index = magic_motion.chunk_grid_points[chunk_index];
+    uint32_t outside_index = magic_motion.num_grid_points + start - index;
+    for(unsigned int i=start; i<end; ++i)
+    {
+        const uint32_t voxel_index = magic_motion.point_voxels[i];
+        if(voxel_index == NO_VOXEL)
+        {
+            magic_motion.point_order[outside_index++] = i;
+            continue;
+        }
+
+        uint32_t x, y, z;
+        MagicMotion_VoxelCoords(&magic_motion.grid, voxel_index, &x, &y, &z);
+        magic_motion.point_morton_codes[index] = MortonEncode(x, y, z);
+        magic_motion.point_numbers[index] = i;
+        ++index;
+    }
+}
+
+// Worker task: copy a chunk of the points to their sorted places
+static void
+_GatherSortedPoints(void *userdata, unsigned int chunk_index)
+{
+    const bool colors = *(const bool *)userdata;
+
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+    for(unsigned int i=start; i<end; ++i)
+    {
+        const uint32_t point = magic_motion.point_order[i];
+        magic_motion.sorted_positions[i] = magic_motion.spatial_cloud[point];
+        magic_motion.sorted_tags[i] = magic_motion.tag_cloud[point];
+    }
+
+    if(!colors) return;
+
+    for(unsigned int i=start; i<end; ++i)
+    {
+        magic_motion.sorted_colors[i] = magic_motion.color_cloud[magic_motion.point_order[i]];
+    }
+}
+
+// A chunk of the sorted cloud starts a voxel at each point within the grid
+// with another code than the one before it
+static inline bool
+_StartsSortedVoxel(unsigned int i)
+{
+    if(i >= magic_motion.num_grid_points) return false;
+
+    const uint32_t code = magic_motion.sorted_morton_codes[i];
+    return i == 0 || code != magic_motion.sorted_morton_codes[i-1];
+}
+
+// Worker task: count the voxels that start in a chunk of the sorted cloud
+static void
+_CountSortedVoxels(void *userdata, unsigned int chunk_index)
+{
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+
+    uint32_t count = 0;
+    for(unsigned int i=start; i<end; ++i)
+    {
+        count += _StartsSortedVoxel(i);
+    }
+
+    magic_motion.chunk_voxel_counts[chunk_index] = count;
+}
+
+// Worker task: list the voxels that start in a chunk of the sorted cloud,
+// with their points
+static void
+_ListSortedVoxels(void *userdata, unsigned int chunk_index)
+{
+    MagicMotionVoxelPoints *voxel_points = (MagicMotionVoxelPoints *)userdata;
+
+    unsigned int start, end;
+    _GetPointChunk(chunk_index, &start, &end);
+
+    uint32_t index = magic_motion.chunk_voxel_counts[chunk_index];
+    for(unsigned int i=start; i<end; ++i)
+    {
+        if(!_StartsSortedVoxel(i)) continue;
+
+        const uint32_t voxel_index = magic_motion.point_voxels[magic_motion.point_order[i]];
+        magic_motion.occupied_voxels[index] = voxel_index;
+        voxel_points[index].first_point = i;
+        voxel_points[index].point_count = magic_motion.voxels[voxel_index].point_count;
+        ++index;
+    }
+}
+
+// Reorder the cloud by the Morton codes of the voxels of the points, and
+// the occupied voxels to match. The points outside the grid go last.
+// point_voxels is left in the order of the deprojection.
+static void
+_SortCloud(bool colors)
+{
+    if(!magic_motion.point_morton_codes)
+    {
+        const size_t n = magic_motion.cloud_capacity;
+        magic_motion.point_morton_codes = (uint32_t *)malloc(n * sizeof(uint32_t));
+        magic_motion.point_numbers = (uint32_t *)malloc(n * sizeof(uint32_t));
+        magic_motion.sorted_morton_codes = (uint32_t *)malloc(n * sizeof(uint32_t));
+        magic_motion.point_order = (uint32_t *)malloc(n * sizeof(uint32_t));
+        magic_motion.sorted_positions = (V3 *)calloc(n, sizeof(V3));
+        magic_motion.sorted_colors = (ColorPixel *)calloc(n, sizeof(ColorPixel));
+        magic_motion.sorted_tags = (MagicMotionTag *)calloc(n, sizeof(MagicMotionTag));
+        assert(magic_motion.point_morton_codes && magic_motion.point_numbers &&
+               magic_motion.sorted_morton_codes && magic_motion.point_order &&
+               magic_motion.sorted_positions && magic_motion.sorted_colors && magic_motion.sorted_tags);
+    }
+
+    MagicMotionVoxelPoints **voxel_points = &magic_motion.voxel_points[magic_motion.back_frame];
+    if(!*voxel_points)
+    {
+        *voxel_points = (MagicMotionVoxelPoints *)malloc(MIN(magic_motion.cloud_capacity, magic_motion.grid.num_voxels) *
+                                                         sizeof(MagicMotionVoxelPoints));
+        assert(*voxel_points);
+    }
+
+    RunWorkerTasks(&magic_motion.workers, &_CountGridPoints, NULL, POINT_CHUNKS);
+
+    uint32_t num_grid_points = 0;
+    for(unsigned int i=0; i<POINT_CHUNKS; ++i)
+    {
+        const uint32_t count = magic_motion.chunk_grid_points[i];
+        magic_motion.chunk_grid_points[i] = num_grid_points;
+        num_grid_points += count;
+    }
+    magic_motion.num_grid_points = num_grid_points;
+
+    RunWorkerTasks(&magic_motion.workers, &_EncodeMortonCodes, NULL, POINT_CHUNKS);
+    SortMortonCodes(magic_motion.point_morton_codes, magic_motion.point_numbers, num_grid_points,
+                    magic_motion.sorted_morton_codes, magic_motion.point_order,
+                    &magic_motion.morton_sort_buffers, &magic_motion.workers);
+    RunWorkerTasks(&magic_motion.workers, &_GatherSortedPoints, &colors, POINT_CHUNKS);
+
+    // The sorted points become the points of the frame, and the old buffers
+    // of the frame are used for the next sort
+    MagicMotionFrame *frame = &magic_motion.frame_buffers[magic_motion.back_frame];
+    std::swap(frame->positions, magic_motion.sorted_positions);
+    std::swap(frame->colors, magic_motion.sorted_colors);
+    std::swap(frame->tags, magic_motion.sorted_tags);
+    magic_motion.spatial_cloud = frame->positions;
+    magic_motion.color_cloud = frame->colors;
+    magic_motion.tag_cloud = frame->tags;
+
+    RunWorkerTasks(&magic_motion.workers, &_CountSortedVoxels, NULL, POINT_CHUNKS);
+
+    uint32_t offset = 0;
+    for(unsigned int i=0; i<POINT_CHUNKS; ++i)
+    {
+        const uint32_t count = magic_motion.chunk_voxel_counts[i];
+        magic_motion.chunk_voxel_counts[i] = offset;
+        offset += count;
+    }
+    assert(offset == magic_motion.num_occupied_voxels);
+
+    RunWorkerTasks(&magic_motion.workers, &_ListSortedVoxels, *voxel_points, POINT_CHUNKS);
+    frame->voxel_points = *voxel_points;
+}
+
+// Compute the cloud and the voxels of the frame from the sensor frames, the
+// cloud tiles and the classifiers of the frame
+template<unsigned int options>
+static void
+_ProcessFrame(void)
+{
+    Timinginfo cloud_timing = StartTiming();
+
+    // Count the points of each tile first, so every tile gets its own range
+    // of the cloud. This keeps the point order the same as if the sensors
+    // were processed one after another.
+    RunWorkerTasks(&magic_motion.workers, &_CountCloudTilePoints<options>, NULL, magic_motion.num_cloud_tiles);
+
+    for(unsigned int i=0; i<magic_motion.num_cloud_tiles; ++i)
+    {
+        CloudTile *tile = &magic_motion.cloud_tiles[i];
+        tile->point_offset = magic_motion.cloud_size;
+        magic_motion.cloud_size += tile->point_count;
+    }
+
+    RunWorkerTasks(&magic_motion.workers, &_DeprojectCloudTile<options>, NULL, magic_motion.num_cloud_tiles);
+
+    EndTimingAndPrint(&cloud_timing, "Cloud computation");
+
+    Timinginfo timing = StartTiming();
+
+    // The points were classified and binned with their tiles. The voxel
+    // slabs add the points of their buckets to the voxels.
+    magic_motion.num_point_ranges = magic_motion.num_cloud_tiles;
+
+    _SplitVoxelSlabs();
+    RunWorkerTasks(&magic_motion.workers, &_AccumulateVoxelSlab<options>, NULL, magic_motion.num_voxel_slabs);
+    _MergeOccupiedVoxels();
+
+    EndTimingAndPrint(&timing, "Voxel computation");
+
+    if(options & PIPELINE_SUMMED_VOLUME)
+    {
+        _BuildSummedVolume((options & PIPELINE_FILTER_NOISE) ? NOISE_FILTER_MIN_POINTS : 0);
+    }
+}
+
+typedef void (*ProcessFrameFunc)(void);
+
+#define PROCESS_FRAME_4(n) &_ProcessFrame<(n)>, &_ProcessFrame<(n)+1>, &_ProcessFrame<(n)+2>, &_ProcessFrame<(n)+3>
+#define PROCESS_FRAME_16(n) PROCESS_FRAME_4(n), PROCESS_FRAME_4((n)+4), PROCESS_FRAME_4((n)+8), PROCESS_FRAME_4((n)+12)
+#define PROCESS_FRAME_64(n) PROCESS_FRAME_16(n), PROCESS_FRAME_16((n)+16), PROCESS_FRAME_16((n)+32), PROCESS_FRAME_16((n)+48)
+
+// Indexed by the options of the frame
+static const ProcessFrameFunc process_frame_variants[NUM_PIPELINE_VARIANTS] = {
+    PROCESS_FRAME_64(0), PROCESS_FRAME_16(64), PROCESS_FRAME_16(80)
+};
+
+#undef PROCESS_FRAME_64
+#undef PROCESS_FRAME_16
+#undef PROCESS_FRAME_4
+
+} // extern "C++"
+
+static void
+_AllocateFrame(MagicMotionFrame *frame)
+{
+    frame->frame_number = 0;
+    frame->cloud_size = 0;
+    frame->num_occupied_voxels = 0;
+
+    frame->positions = (V3 *)calloc(magic_motion.cloud_capacity, sizeof(V3));
+    frame->colors = (ColorPixel *)calloc(magic_motion.cloud_capacity, sizeof(ColorPixel));
+    frame->tags = (MagicMotionTag *)calloc(magic_motion.cloud_capacity, sizeof(MagicMotionTag));
+    frame->voxels = (Voxel *)calloc(magic_motion.voxel_capacity, sizeof(Voxel));
+
+    // There can never be more occupied voxels than points
+    frame->occupied_voxels = (uint32_t *)calloc(MIN(magic_motion.cloud_capacity, magic_motion.grid.num_voxels),
+                                                sizeof(uint32_t));
+
+    assert(frame->positions && frame->colors && frame->tags &&
+           frame->voxels && frame->occupied_voxels);
+
+    // Level 0 is the full grid
+    MagicMotionVoxelLevel *full_grid = &frame->voxel_levels[0];
+    full_grid->num_voxels_x = magic_motion.grid.num_voxels_x;
+    full_grid->num_voxels_y = magic_motion.grid.num_voxels_y;
+    full_grid->num_voxels_z = magic_motion.grid.num_voxels_z;
+    full_grid->voxel_size = magic_motion.grid.voxel_size;
+    full_grid->voxels = frame->voxels;
+    full_grid->occupied_voxels = frame->occupied_voxels;
+    full_grid->num_occupied_voxels = 0;
+
+    for(unsigned int i=1; i<NUM_VOXEL_LEVELS; ++i)
+    {
+        const MagicMotionVoxelLevel *below = &frame->voxel_levels[i-1];
+        MagicMotionVoxelLevel *level = &frame->voxel_levels[i];
+        level->num_voxels_x = (below->num_voxels_x + 1) / 2;
+        level->num_voxels_y = (below->num_voxels_y + 1) / 2;
+        level->num_voxels_z = (below->num_voxels_z + 1) / 2;
+        level->voxel_size = below->voxel_size * 2.0f;
+
+        level->voxels = NULL;
+        level->occupied_voxels = NULL;
+        level->num_occupied_voxels = 0;
+
+        // The levels of sparse grids can be far larger than the brick pool
+        const size_t num_voxels = (size_t)level->num_voxels_x * level->num_voxels_y * level->num_voxels_z;
+        if(num_voxels > magic_motion.grid.num_voxels) continue;
+
+        level->voxels = (Voxel *)calloc(num_voxels, sizeof(Voxel));
+        level->occupied_voxels = (uint32_t *)calloc(MIN(magic_motion.cloud_capacity, num_voxels),
+                                                    sizeof(uint32_t));
+        assert(level->voxels && level->occupied_voxels);
+    }
+}
+
+static void
+_FreeFrame(MagicMotionFrame *frame)
+{
+    free(frame->positions);
+    free(frame->colors);
+    free(frame->tags);
+    free(frame->voxels);
+    free(frame->occupied_voxels);
+    for(unsigned int i=1; i<NUM_VOXEL_LEVELS; ++i)
+    {
+        free(frame->voxel_levels[i].voxels);
+        free(frame->voxel_levels[i].occupied_voxels);
+    }
+    *frame = (MagicMotionFrame){};
+}
+
+// Sum the occupied voxels of each level of the frame into the level above
+// it. Like the full grid, only the voxels that were occupied the last time
+// are cleared. The first level a sparse grid keeps is summed from the full
+// grid.
+static void
+_BuildVoxelLevels(MagicMotionFrame *frame, bool colors)
+{
+    frame->voxel_levels[0].num_occupied_voxels = frame->num_occupied_voxels;
+
+    unsigned int below_level = 0;
+    for(unsigned int i=1; i<NUM_VOXEL_LEVELS; ++i)
+    {
+        const MagicMotionVoxelLevel *below = &frame->voxel_levels[below_level];
+        MagicMotionVoxelLevel *level = &frame->voxel_levels[i];
+        if(!level->voxels) continue;
+
+        const unsigned int shift = i - below_level;
+        below_level = i;
+
+        for(unsigned int j=0; j<level->num_occupied_voxels; ++j)
+        {
+            level->voxels[level->occupied_voxels[j]] = (Voxel){};
+        }
+        level->num_occupied_voxels = 0;
+
+        for(unsigned int j=0; j<below->num_occupied_voxels; ++j)
+        {
+            const uint32_t below_index = below->occupied_voxels[j];
+            uint32_t x, y, z;
+            if(below == &frame->voxel_levels[0])
+            {
+                MagicMotion_VoxelCoords(&magic_motion.grid, below_index, &x, &y, &z);
+            }
+            else
+            {
+                x = below_index % below->num_voxels_x;
+                y = (below_index / below->num_voxels_x) % below->num_voxels_y;
+                z = below_index / (below->num_voxels_x * below->num_voxels_y);
+            }
+            const uint32_t index = (x >> shift) + (y >> shift)*level->num_voxels_x +
+                                   (z >> shift)*level->num_voxels_x*level->num_voxels_y;
+
+            const Voxel *v = &below->voxels[below_index];
+            Voxel *sum = &level->voxels[index];
+            if(sum->point_count == 0)
+            {
+                level->occupied_voxels[level->num_occupied_voxels++] = index;
+            }
+            sum->point_count += v->point_count;
 
-    float *background_model;     // A per-voxel array of the background model
+            // Weighted by the point counts, so the color is the average of
+            // the points, like in the full grid
+            if(colors)
+            {
+                VoxelColorSum *color_sum = &magic_motion.voxel_level_color_sums[index];
+                color_sum->r += v->color.r * v->point_count;
+                color_sum->g += v->color.g * v->point_count;
+                color_sum->b += v->color.b * v->point_count;
+            }
+        }
 
-    unsigned int frame_count;    // The frame count increments at every call to CaptureFrame
+        if(!colors) continue;
 
-    V3 *spatial_cloud;           // XYZ components of the point cloud
-    ColorPixel *color_cloud;          // RGB components of the point cloud
-    MagicMotionTag *tag_cloud;   // 32 bit tags for each point in the cloud
-    unsigned int cloud_size;     // The number of points currently in the cloud
-    unsigned int cloud_capacity; // The maximum number of points in the cloud
+        for(unsigned int j=0; j<level->num_occupied_voxels; ++j)
+        {
+            const uint32_t index = level->occupied_voxels[j];
+            Voxel *v = &level->voxels[index];
+            const VoxelColorSum sum = magic_motion.voxel_level_color_sums[index];
+            const uint32_t half = v->point_count / 2;
 
-    Voxel voxels[NUM_VOXELS];    // The voxel grid, with the lastest information
+            v->color.r = (uint8_t)((sum.r + half) / v->point_count);
+            v->color.g = (uint8_t)((sum.g + half) / v->point_count);
+            v->color.b = (uint8_t)((sum.b + half) / v->point_count);
 
-    // Thread userdata
-    ClassifierData3D classifier_thread_3D;
-    ClassifierData2D classifier_thread_2D;
-} magic_motion;
+            magic_motion.voxel_level_color_sums[index] = (VoxelColorSum){};
+        }
+    }
+}
 
-typedef struct
+// Point the current frame buffers to frame
+static void
+_BindFrame(MagicMotionFrame *frame)
 {
-    int indices[8];
-} Neighbours;
+    magic_motion.spatial_cloud = frame->positions;
+    magic_motion.color_cloud = frame->colors;
+    magic_motion.tag_cloud = frame->tags;
+    magic_motion.cloud_size = frame->cloud_size;
+    magic_motion.voxels = frame->voxels;
+    magic_motion.occupied_voxels = frame->occupied_voxels;
+    magic_motion.num_occupied_voxels = frame->num_occupied_voxels;
+}
 
-// Get the indices of the 8 nearest neighbours of point
-static inline Neighbours
-_GetNeighbours(V3 point)
+// Block until a frame newer than *last_frame is complete, or until
+// *running is cleared, and set *last_frame to the number of the latest
+// complete frame. Returns *running, as read under the frame mutex, so the
+// caller never reads it unlocked.
+static bool
+_WaitForNewFrame(unsigned int *last_frame, const bool *running)
 {
-    // Get voxel index
-    int i = WORLD_TO_VOXEL(point);
-    // Get center position of that voxel
-    V3 v = VOXEL_TO_WORLD(i);
-    // Calc the offset from the point to the
-    // center of the containing voxel
-    V3 offset = SubV3(point, v);
+    pthread_mutex_lock(&magic_motion.frame_mutex);
 
-    // Get voxel space coordinates for the voxel
-    // (inverse of VOXEL_INDEX)
-    int x0 = i % NUM_VOXELS_X;
-    int y0 = (i / NUM_VOXELS_X) % NUM_VOXELS_Y;
-    int z0 = i / (NUM_VOXELS_X * NUM_VOXELS_Y);
+    while(*running && magic_motion.completed_frame_count == *last_frame)
+    {
+        pthread_cond_wait(&magic_motion.frame_condition, &magic_motion.frame_mutex);
+    }
 
-    if(offset.x < 0) --x0;
-    if(offset.y < 0) --y0;
-    if(offset.z < 0) --z0;
+    *last_frame = magic_motion.completed_frame_count;
+    const bool still_running = *running;
+    pthread_mutex_unlock(&magic_motion.frame_mutex);
 
-    x0 = MAX(x0, 0);
-    y0 = MAX(y0, 0);
-    z0 = MAX(z0, 0);
+    return still_running;
+}
 
-    int x1 = MIN(x0+1, NUM_VOXELS_X-1);
-    int y1 = MIN(y0+1, NUM_VOXELS_Y-1);
-    int z1 = MIN(z0+1, NUM_VOXELS_Z-1);
+// Stop a classifier thread that may be waiting in _WaitForNewFrame
+static void
+_StopClassifierThread(bool *running, pthread_t thread_handle)
+{
+    pthread_mutex_lock(&magic_motion.frame_mutex);
+    *running = false;
+    pthread_cond_broadcast(&magic_motion.frame_condition);
+    pthread_mutex_unlock(&magic_motion.frame_mutex);
 
-    return (Neighbours){{
-        VOXEL_INDEX(x0, y0, z0),
-        VOXEL_INDEX(x0, y0, z1),
-        VOXEL_INDEX(x0, y1, z0),
-        VOXEL_INDEX(x0, y1, z1),
-        VOXEL_INDEX(x1, y0, z0),
-        VOXEL_INDEX(x1, y0, z1),
-        VOXEL_INDEX(x1, y1, z0),
-        VOXEL_INDEX(x1, y1, z1)
-    }};
+    pthread_join(thread_handle, NULL);
 }
 
-// Get the probability of point being part of the background by interpolating
-// the probabilities of the 8 nearest neighbours
-float
-_TrilinearlyInterpolate(V3 point, float *background)
+static void
+_PinThread(pthread_t thread_handle, int cpu)
 {
-    float probability = 0;
-    Neighbours n = _GetNeighbours(point);
-
-    for(int i=0; i<8; ++i)
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int rc = pthread_setaffinity_np(thread_handle, sizeof(cpu_set_t), &cpus);
+    if(rc)
     {
-        const int index = n.indices[i];
-        V3 voxel = VOXEL_TO_WORLD(index);
-        float weight = (1.0f - (fabs(point.x - voxel.x) / VOXEL_SIZE)) *
-                       (1.0f - (fabs(point.y - voxel.y) / VOXEL_SIZE)) *
-                       (1.0f - (fabs(point.z - voxel.z) / VOXEL_SIZE));
-
-        probability += weight * background[index];
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
     }
-
-    return probability;
+#else
+    fprintf(stderr, "Thread pinning is not supported on this platform\n");
+#endif
 }
 
 // Prototype of the functions that will run in a background thread and
 // compute the background model.
 // The implementation is at the bottom of this file
-static void *_ComputeBackgroundModelNaiveCalibration(void *userdata);
-static void *_ComputeBackgroundModelSimpleMOG(void *userdata);
-static void *_ComputeBackgroundModelDL(void *userdata);
+static void *_RunClassifier3D(void *userdata);
+static void *_ComputeBackgroundModelDepth(void *userdata);
 static void *_ComputeBackgroundModelOpenCV(void *userdata);
 
+// Also used by the tests in MagicMotion_Initialize
+static MagicMotionAABBCounts _QueryAABB(unsigned int frame_index, V3 min, V3 max);
+
+// Stop the classifier threads, and shut the classifiers down. Their
+// background is forgotten.
+static void
+_StopClassifiers(void)
+{
+    if(magic_motion.classifier_thread_3D.running)
+    {
+        _StopClassifierThread(&magic_motion.classifier_thread_3D.running,
+                              magic_motion.classifier_thread_3D.thread_handle);
+    }
+
+    if(magic_motion.classifier_thread_2D.running)
+    {
+        _StopClassifierThread(&magic_motion.classifier_thread_2D.running,
+                              magic_motion.classifier_thread_2D.thread_handle);
+    }
+
+    // Wait for the frame being captured, if any
+    pthread_mutex_lock(&magic_motion.classifier_thread_2D.mutex_handle);
+    pthread_mutex_lock(&magic_motion.classifier_thread_3D.mutex_handle);
+
+    ClassifierData3D *data_3D = &magic_motion.classifier_thread_3D;
+    if(data_3D->classifier)
+    {
+        data_3D->classifier->shutdown(data_3D->state);
+        data_3D->classifier = NULL;
+        data_3D->state = NULL;
+    }
+    magic_motion.classifier_thread_2D.classifier = CLASSIFIER_2D_NONE;
+
+    memset(magic_motion.background_model, 0, magic_motion.voxel_capacity*sizeof(float));
+    for(int i=0; i<magic_motion.num_active_sensors; ++i)
+    {
+        const SensorInfo *sensor = &magic_motion.sensors[i];
+        std::fill_n(magic_motion.sensor_masks[i],
+                    sensor->depth_stream_info.width*sensor->depth_stream_info.height,
+                    1.0f);
+    }
+
+    pthread_mutex_unlock(&magic_motion.classifier_thread_3D.mutex_handle);
+    pthread_mutex_unlock(&magic_motion.classifier_thread_2D.mutex_handle);
+}
+
 void
 MagicMotion_Initialize(void)
+{
+    const float size_x = DEFAULT_NUM_VOXELS_X * DEFAULT_VOXEL_SIZE;
+    const float size_y = DEFAULT_NUM_VOXELS_Y * DEFAULT_VOXEL_SIZE;
+    const float size_z = DEFAULT_NUM_VOXELS_Z * DEFAULT_VOXEL_SIZE;
+    MagicMotion_InitializeWithGrid(DEFAULT_NUM_VOXELS_X, DEFAULT_NUM_VOXELS_Y, DEFAULT_NUM_VOXELS_Z,
+                                   DEFAULT_VOXEL_SIZE, MakeV3(size_x/-2.0f, size_y/-2.0f, size_z/-2.0f));
+}
+
+// max_bricks is 0 for dense grids
+static void
+_Initialize(unsigned int num_voxels_x, unsigned int num_voxels_y, unsigned int num_voxels_z,
+            float voxel_size, V3 origin, unsigned int max_bricks)
 {
     MM_TRACE("Initializing");
 
+    // The voxel coordinates must fit in the Morton codes
+    assert(num_voxels_x > 1 && num_voxels_x <= MORTON_CELLS);
+    assert(num_voxels_y > 1 && num_voxels_y <= MORTON_CELLS);
+    assert(num_voxels_z > 1 && num_voxels_z <= MORTON_CELLS);
+    assert(voxel_size > 0.0f);
+
+    MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    grid->num_voxels_x = num_voxels_x;
+    grid->num_voxels_y = num_voxels_y;
+    grid->num_voxels_z = num_voxels_z;
+    grid->voxel_size = voxel_size;
+    grid->origin = origin;
+    grid->size = MakeV3(num_voxels_x * voxel_size, num_voxels_y * voxel_size, num_voxels_z * voxel_size);
+    grid->voxels_per_unit = 1.0f / voxel_size;
+    grid->sparse = (max_bricks > 0);
+    if(grid->sparse)
+    {
+        // The voxel indices are in the brick pool
+        InitializeVoxelBrickMap(&magic_motion.bricks, max_bricks);
+        grid->num_voxels = max_bricks * VOXEL_BRICK_VOXELS;
+        grid->power_of_two = false;
+        grid->shift_y = 0;
+        grid->shift_z = 0;
+        grid->max_bricks = max_bricks;
+        grid->brick_keys = magic_motion.bricks.brick_keys;
+
+        MagicMotionVoxelGrid *brick_grid = &magic_motion.brick_grid;
+        brick_grid->num_voxels_x = VOXEL_BRICK_SIZE;
+        brick_grid->num_voxels_y = VOXEL_BRICK_SIZE;
+        brick_grid->num_voxels_z = VOXEL_BRICK_SIZE;
+        brick_grid->voxel_size = 1.0f;
+        brick_grid->origin = MakeV3(0.0f, 0.0f, 0.0f);
+        brick_grid->num_voxels = VOXEL_BRICK_VOXELS;
+        brick_grid->size = MakeV3(VOXEL_BRICK_SIZE, VOXEL_BRICK_SIZE, VOXEL_BRICK_SIZE);
+        brick_grid->voxels_per_unit = 1.0f;
+        brick_grid->power_of_two = true;
+        brick_grid->shift_y = VOXEL_BRICK_SHIFT;
+        brick_grid->shift_z = 2*VOXEL_BRICK_SHIFT;
+        brick_grid->sparse = false;
+        brick_grid->max_bricks = 0;
+        brick_grid->brick_keys = NULL;
+    }
+    else
+    {
+        grid->num_voxels = num_voxels_x * num_voxels_y * num_voxels_z;
+        grid->power_of_two = !(num_voxels_x & (num_voxels_x-1)) &&
+                             !(num_voxels_y & (num_voxels_y-1)) &&
+                             !(num_voxels_z & (num_voxels_z-1));
+        grid->shift_y = grid->power_of_two ? __builtin_ctz(num_voxels_x) : 0;
+        grid->shift_z = grid->power_of_two ? __builtin_ctz(num_voxels_x*num_voxels_y) : 0;
+        grid->max_bricks = 0;
+        grid->brick_keys = NULL;
+    }
+    magic_motion.voxel_capacity = MOG_NUM_BLOCKS(grid->num_voxels) * MOG_BLOCK_SIZE;
+
     // Simple tests to aid in debugging and development.
     // Replace this with a proper testing framework
 #if RUN_TESTS
     puts("Running tests");
 
+    // The voxel indices of sparse grids are tested on a small grid below
+    if(!grid->sparse)
     {
-        V3 v0 = VOXEL_TO_WORLD(0);
+        const uint32_t middle = MagicMotion_VoxelIndex(grid, num_voxels_x/2, num_voxels_y/2, num_voxels_z/2);
+        V3 v0 = MagicMotion_VoxelCenter(grid, 0);
         printf("First voxel has position (%f, %f, %f)\n", v0.x, v0.y, v0.z);
-        V3 v1 = VOXEL_TO_WORLD(VOXEL_INDEX(NUM_VOXELS_X/2, NUM_VOXELS_Y/2, NUM_VOXELS_Z/2));
+        V3 v1 = MagicMotion_VoxelCenter(grid, middle);
         printf("Middle voxel has position (%f, %f, %f)\n", v1.x, v1.y, v1.z);
-        V3 v2 = VOXEL_TO_WORLD(NUM_VOXELS-1);
+        V3 v2 = MagicMotion_VoxelCenter(grid, grid->num_voxels-1);
         printf("Last voxel has position (%f, %f, %f)\n", v2.x, v2.y, v2.z);
+
+        for(uint32_t i=0; i<grid->num_voxels; i += 997)
+        {
+            uint32_t x, y, z;
+            MagicMotion_VoxelCoords(grid, i, &x, &y, &z);
+            assert(MagicMotion_VoxelIndex(grid, x, y, z) == i);
+        }
     }
 
+    if(!grid->sparse)
     {
-        Neighbours n = _GetNeighbours((V3){ 0, 0, 0 });
-        printf("Neighbours of point (0, 0, 0) are %d, %d, %d, %d, %d, %d, %d, %d\n",
-               n.indices[0], n.indices[1], n.indices[2], n.indices[3],
-               n.indices[4], n.indices[5], n.indices[6], n.indices[7]);
+        InitializeTrilinear(grid, NULL);
+
+        float *bg = (float *)malloc(grid->num_voxels * sizeof(float));
+        for(size_t i=0; i<grid->num_voxels; ++i) bg[i] = (float)(i % 7) / 6.0f;
+
+        // Voxel centers, points between them, the edges of the grid and outside it
+        V3 points[] = {
+            MagicMotion_VoxelCenter(grid, 0),
+            MagicMotion_VoxelCenter(grid, MagicMotion_VoxelIndex(grid, num_voxels_x/2, num_voxels_y/2, num_voxels_z/2)),
+            MagicMotion_VoxelCenter(grid, grid->num_voxels-1),
+            { 0, 0, 0 },
+            { 0.1f, -0.2f, 0.3f },
+            grid->origin,
+            AddV3(grid->origin, grid->size),
+            { 1000, -1000, 1000 },
+            { 1.3f, 2.7f, -4.1f }
+        };
+        const unsigned int num_points = sizeof(points)/sizeof(points[0]);
+        float expected[num_points];
+        float probabilities[num_points];
+        TrilinearlyInterpolateScalar(points, num_points, bg, expected);
+        TrilinearlyInterpolate(points, num_points, bg, probabilities);
+
+        for(unsigned int i=0; i<num_points; ++i)
+        {
+            printf("Interpolated (%f, %f, %f) to %f\n", points[i].x, points[i].y, points[i].z, probabilities[i]);
+            assert(probabilities[i] == expected[i]);
+        }
+
+        // Exact for voxel sizes that are exact in binary, like the default
+        assert(fabsf(expected[0] - bg[0]) < 1e-4f);
+        assert(fabsf(expected[2] - bg[grid->num_voxels-1]) < 1e-4f);
+
+        free(bg);
     }
 
     {
-        float *bg = (float *)malloc(NUM_VOXELS * sizeof(float));
-        for(size_t i=0; i<NUM_VOXELS; ++i) bg[i] = 1.0f;
-        V3 p = { 0, 0, 0 };
-        puts("Interpolating point");
+        // A fractional mask makes points background on its own without a 3D
+        // classifier, and is blended with the 3D classifier with one
+        const float masks[] = { 1.0f, 0.5f, 0.1f };
+        float probabilities[] = { 0.0f, 0.0f, 0.0f };
+        _BlendSensorMasks(probabilities, masks, 3, false, 0.2f);
+        assert(probabilities[0] < BACKGROUND_PROBABILITY_TRESHOLD);
+        assert(probabilities[1] >= BACKGROUND_PROBABILITY_TRESHOLD);
+        assert(probabilities[2] >= BACKGROUND_PROBABILITY_TRESHOLD);
+
+        float blended[] = { 0.0f, 0.0f, 1.0f };
+        _BlendSensorMasks(blended, masks, 3, true, 0.2f);
+        assert(blended[0] == 0.0f);
+        assert(fabsf(blended[1] - 0.1f) < 1e-6f);
+        assert(fabsf(blended[2] - 0.98f) < 1e-6f);
+    }
 
-        float probability = 0;
-        Neighbours n = _GetNeighbours(p);
-        printf("Neighbours are %d, %d, %d, %d, %d, %d, %d, %d\n",
-               n.indices[0], n.indices[1], n.indices[2], n.indices[3],
-               n.indices[4], n.indices[5], n.indices[6], n.indices[7]);
+    if(!grid->sparse)
+    {
+        // AABB queries are clamped to the grid, whatever the coordinates.
+        // Every voxel has a point.
+        Voxel *voxels = (Voxel *)calloc(grid->num_voxels, sizeof(Voxel));
+        uint32_t *foreground_counts = (uint32_t *)calloc(grid->num_voxels, sizeof(uint32_t));
+        for(uint32_t i=0; i<grid->num_voxels; ++i) voxels[i].point_count = 1;
+
+        magic_motion.summed_volumes[0] = (VoxelCountSum *)malloc(SUMMED_VOLUME_SIZE(grid) * sizeof(VoxelCountSum));
+        SumVoxelPlanes(magic_motion.summed_volumes[0], grid, voxels, foreground_counts, 0, 0, num_voxels_z);
+        SumVolumeRows(magic_motion.summed_volumes[0], grid, 0, SUMMED_VOLUME_Y(grid));
+        magic_motion.has_summed_volume[0] = true;
+
+        const V3 grid_max = AddV3(grid->origin, grid->size);
+        const V3 huge = MakeV3(1e10f, 1e10f, 1e10f);
+        const V3 infinite = MakeV3(INFINITY, INFINITY, INFINITY);
+        const float nan = nanf("");
+        assert(_QueryAABB(0, grid->origin, grid_max).point_count == grid->num_voxels);
+        assert(_QueryAABB(0, ScaleV3(huge, -1.0f), huge).point_count == grid->num_voxels);
+        assert(_QueryAABB(0, ScaleV3(infinite, -1.0f), infinite).point_count == grid->num_voxels);
+        assert(_QueryAABB(0, ScaleV3(huge, -1.0f), grid->origin).point_count == 1);
+        assert(_QueryAABB(0, AddV3(grid_max, MakeV3(1.0f, 1.0f, 1.0f)), huge).point_count == 0);
+        assert(_QueryAABB(0, huge, ScaleV3(huge, -1.0f)).point_count == 0);
+        assert(_QueryAABB(0, MakeV3(nan, 0.0f, 0.0f), huge).point_count == 0);
+        assert(_QueryAABB(0, ScaleV3(huge, -1.0f), MakeV3(0.0f, 0.0f, nan)).point_count == 0);
+
+        free(magic_motion.summed_volumes[0]);
+        magic_motion.summed_volumes[0] = NULL;
+        magic_motion.has_summed_volume[0] = false;
+        free(foreground_counts);
+        free(voxels);
+    }
 
-        for(int i=0; i<8; ++i)
+    {
+        // Bricks against a dense grid with the same values. The grid is not
+        // whole bricks, and every other brick along x has no storage.
+        MagicMotionVoxelGrid dense = {};
+        dense.num_voxels_x = 20;
+        dense.num_voxels_y = 12;
+        dense.num_voxels_z = 17;
+        dense.voxel_size = 0.5f;
+        dense.origin = MakeV3(-5.0f, -3.0f, -4.0f);
+        dense.num_voxels = dense.num_voxels_x * dense.num_voxels_y * dense.num_voxels_z;
+        dense.size = MakeV3(10.0f, 6.0f, 8.5f);
+        dense.voxels_per_unit = 2.0f;
+
+        // Exactly the bricks that get storage
+        const uint32_t max_bricks = 2*2*3;
+        VoxelBrickMap bricks;
+        InitializeVoxelBrickMap(&bricks, max_bricks);
+        MagicMotionVoxelGrid sparse = dense;
+        sparse.num_voxels = max_bricks * VOXEL_BRICK_VOXELS;
+        sparse.sparse = true;
+        sparse.max_bricks = max_bricks;
+        sparse.brick_keys = bricks.brick_keys;
+
+        float *dense_values = (float *)calloc(dense.num_voxels, sizeof(float));
+        float *sparse_values = (float *)calloc(sparse.num_voxels, sizeof(float));
+        srand(7);
+        for(uint32_t i=0; i<dense.num_voxels; ++i)
         {
-            const int index = n.indices[i];
-            V3 voxel = VOXEL_TO_WORLD(index);
-            float a = (1.0f - (fabs(p.x - voxel.x) / VOXEL_SIZE));
-            float b = (1.0f - (fabs(p.y - voxel.y) / VOXEL_SIZE));
-            float c = (1.0f - (fabs(p.z - voxel.z) / VOXEL_SIZE));
-            float weight = a * b * c;
+            uint32_t x, y, z;
+            MagicMotion_VoxelCoords(&dense, i, &x, &y, &z);
+            if((x >> VOXEL_BRICK_SHIFT) % 2) continue;
 
-            printf("Weight for neighbour %d (%f, %f, %f) = a=%f * b=%f * c=%f = %f\n",
-                   i, voxel.x, voxel.y, voxel.z, a, b, c, weight);
+            const uint32_t voxel = AddBrickVoxel(&bricks, x, y, z);
+            assert(voxel < sparse.num_voxels && FindBrickVoxel(&bricks, x, y, z) == voxel);
 
-            probability += weight * bg[index];
+            uint32_t sparse_x, sparse_y, sparse_z;
+            MagicMotion_VoxelCoords(&sparse, voxel, &sparse_x, &sparse_y, &sparse_z);
+            assert(sparse_x == x && sparse_y == y && sparse_z == z);
+
+            dense_values[i] = sparse_values[voxel] = (float)rand() / RAND_MAX;
         }
 
-        printf("Calculated probability: %f\n", probability);
+        assert(bricks.num_bricks == max_bricks);
+        assert(FindBrickVoxel(&bricks, 8, 0, 0) == NO_BRICK_VOXEL);
+        assert(AddBrickVoxel(&bricks, 8, 0, 0) == NO_BRICK_VOXEL);
 
-        free(bg);
+        const unsigned int num_points = 1000;
+        V3 points[num_points];
+        for(unsigned int i=0; i<num_points; ++i)
+        {
+            points[i] = MakeV3(dense.origin.x - 1.0f + (float)rand() / RAND_MAX * (dense.size.x + 2.0f),
+                               dense.origin.y - 1.0f + (float)rand() / RAND_MAX * (dense.size.y + 2.0f),
+                               dense.origin.z - 1.0f + (float)rand() / RAND_MAX * (dense.size.z + 2.0f));
+        }
+
+        float expected[num_points];
+        float values[num_points];
+        InitializeTrilinear(&dense, NULL);
+        TrilinearlyInterpolateScalar(points, num_points, dense_values, expected);
+        InitializeTrilinear(&sparse, &bricks);
+        TrilinearlyInterpolate(points, num_points, sparse_values, values);
+        for(unsigned int i=0; i<num_points; ++i)
+        {
+            assert(values[i] == expected[i]);
+        }
+
+        free(sparse_values);
+        free(dense_values);
+        FinalizeVoxelBrickMap(&bricks);
     }
 
     {
-        V3 p = { 0, 0, 0 };
-        V3 v = VOXEL_TO_WORLD(WORLD_TO_VOXEL(p));
-        float a = (1.0f - (fabs(p.x - v.x) / VOXEL_SIZE));
-        float b = (1.0f - (fabs(p.y - v.y) / VOXEL_SIZE));
-        float c = (1.0f - (fabs(p.z - v.z) / VOXEL_SIZE));
+        // Octree queries against brute force, on a frame sized cloud with
+        // some points outside the tree
+        WorkerPool workers;
+        InitializeWorkerPool(&workers, 0);
+
+        const size_t num_points = 1000000;
+        const float tree_size = DEFAULT_NUM_VOXELS_X * DEFAULT_VOXEL_SIZE;
+        const V3 tree_min = MakeV3(tree_size/-2.0f, tree_size/-2.0f, tree_size/-2.0f);
+        const V3 tree_max = MakeV3(tree_size/2.0f, tree_size/2.0f, tree_size/2.0f);
+        const float extent = tree_size * 0.6f;
+        V3 *points = (V3 *)malloc(num_points * sizeof(V3));
+        srand(42);
+        for(size_t i=0; i<num_points; ++i)
+        {
+            points[i] = MakeV3(((float)rand() / RAND_MAX * 2.0f - 1.0f) * extent,
+                               ((float)rand() / RAND_MAX * 2.0f - 1.0f) * extent,
+                               ((float)rand() / RAND_MAX * 2.0f - 1.0f) * extent);
+        }
+
+        Octree tree = {};
+        BuildOctree(&tree, points, num_points, tree_min, tree_max, &workers);
+        Timinginfo build_timing = StartTiming();
+        BuildOctree(&tree, points, num_points, tree_min, tree_max, &workers);
+        EndTimingAndPrint(&build_timing, "Octree build");
+        printf("Octree has %lu points in %lu nodes\n", tree.num_points, tree.nodes.count);
+
+        const int num_queries = 200;
+        V3 box_mins[num_queries], box_maxs[num_queries], centers[num_queries];
+        float radii[num_queries];
+        for(int i=0; i<num_queries; ++i)
+        {
+            centers[i] = points[rand() % num_points];
+            radii[i] = (float)rand() / RAND_MAX * tree_size * 0.1f;
+            box_mins[i] = SubV3(centers[i], MakeV3(radii[i], radii[i]*0.5f, radii[i]*2.0f));
+            box_maxs[i] = AddV3(centers[i], MakeV3(radii[i], radii[i]*0.5f, radii[i]*2.0f));
+        }
+
+        size_t box_counts[num_queries], sphere_counts[num_queries];
+        Timinginfo brute_force_timing = StartTiming();
+        for(int i=0; i<num_queries; ++i)
+        {
+            const float half_size = tree_size/2.0f;
+            size_t box_count = 0, sphere_count = 0;
+            for(size_t j=0; j<num_points; ++j)
+            {
+                const V3 p = points[j];
+                if(fabsf(p.x) > half_size || fabsf(p.y) > half_size || fabsf(p.z) > half_size) continue;
+
+                box_count += (p.x >= box_mins[i].x && p.x <= box_maxs[i].x &&
+                              p.y >= box_mins[i].y && p.y <= box_maxs[i].y &&
+                              p.z >= box_mins[i].z && p.z <= box_maxs[i].z);
+                sphere_count += MagnitudeSquaredV3(SubV3(p, centers[i])) <= radii[i]*radii[i];
+            }
 
-        printf("p: (%f, %f, %f), v: (%f, %f, %f)\na=%f * b=%f * c=%f = %f\n",
-                p.x, p.y, p.z,
-                v.x, v.y, v.z,
-                a, b, c, a*b*c);
+            box_counts[i] = box_count;
+            sphere_counts[i] = sphere_count;
+        }
+        EndTimingAndPrint(&brute_force_timing, "Brute force box and sphere counts");
+
+        Timinginfo octree_timing = StartTiming();
+        for(int i=0; i<num_queries; ++i)
+        {
+            assert(CountPointsInBox(&tree, box_mins[i], box_maxs[i]) == box_counts[i]);
+            assert(CountPointsInSphere(&tree, centers[i], radii[i]) == sphere_counts[i]);
+        }
+        EndTimingAndPrint(&octree_timing, "Octree box and sphere counts");
+
+        uint32_t *indices = (uint32_t *)malloc(num_points * sizeof(uint32_t));
+        for(int i=0; i<num_queries; ++i)
+        {
+            const size_t count = FindPointsInSphere(&tree, centers[i], radii[i], indices, num_points);
+            assert(count == sphere_counts[i]);
+            for(size_t j=0; j<count; ++j)
+            {
+                assert(MagnitudeSquaredV3(SubV3(points[indices[j]], centers[i])) <= radii[i]*radii[i]);
+            }
+        }
+
+        // The nearest points, against a brute force sort of the distances
+        const unsigned int k = 16;
+        float *distances = (float *)malloc(num_points * sizeof(float));
+        for(int i=0; i<num_queries; ++i)
+        {
+            const float half_size = tree_size/2.0f;
+            size_t num_candidates = 0;
+            for(size_t j=0; j<num_points; ++j)
+            {
+                const V3 p = points[j];
+                if(fabsf(p.x) > half_size || fabsf(p.y) > half_size || fabsf(p.z) > half_size) continue;
+
+                const float distance = MagnitudeSquaredV3(SubV3(points[j], centers[i]));
+                if(distance <= radii[i]*radii[i]) distances[num_candidates++] = distance;
+            }
+            std::sort(distances, distances+num_candidates);
+
+            uint32_t nearest[k];
+            float nearest_distances[k];
+            const unsigned int count = FindNearestPoints(&tree, centers[i], k, radii[i], nearest, nearest_distances);
+            assert(count == MIN(num_candidates, (size_t)k));
+            for(unsigned int j=0; j<count; ++j)
+            {
+                assert(nearest_distances[j] == distances[j]);
+                assert(MagnitudeSquaredV3(SubV3(points[nearest[j]], centers[i])) == distances[j]);
+            }
+        }
+
+        // A box that is not a cube only indexes the points within it
+        const V3 flat_max = MakeV3(tree_max.x, 0.0f, tree_max.z);
+        BuildOctree(&tree, points, num_points, tree_min, flat_max, &workers);
+        size_t flat_count = 0;
+        for(size_t j=0; j<num_points; ++j)
+        {
+            const V3 p = points[j];
+            flat_count += (p.x >= tree_min.x && p.x <= flat_max.x &&
+                           p.y >= tree_min.y && p.y <= flat_max.y &&
+                           p.z >= tree_min.z && p.z <= flat_max.z);
+        }
+        assert(tree.num_points == flat_count);
+        assert(CountPointsInBox(&tree, tree_min, tree_max) == flat_count);
+
+        free(distances);
+        free(indices);
+        FinalizeOctree(&tree);
+        free(points);
+        FinalizeWorkerPool(&workers);
     }
 
     puts("End of testing.");
@@ -261,6 +1815,9 @@ MagicMotion_Initialize(void)
 #endif
 
     InitializeSensorInterface();
+    InitializeDeprojection();
+    InitializeTrilinear(grid, grid->sparse ? &magic_motion.bricks : NULL);
+    InitializeWorkerPool(&magic_motion.workers, 0);
 
     SerializedSensor serialized_sensors[MAX_SENSORS];
     int num_serialized_sensors = LoadSensors(serialized_sensors, MAX_SENSORS);
@@ -300,6 +1857,8 @@ MagicMotion_Initialize(void)
                     sensor->depth_stream_info.width*sensor->depth_stream_info.height,
                     1.0f);
 
+        _UpdateRayTable(&magic_motion.sensor_rays[i], sensor);
+
         size_t point_cloud_size = sensor->depth_stream_info.width * sensor->depth_stream_info.height;
         magic_motion.cloud_capacity += point_cloud_size;
 
@@ -322,108 +1881,162 @@ MagicMotion_Initialize(void)
 
     MM_TRACE("Sensors initialized");
 
-    magic_motion.spatial_cloud = (V3 *)calloc(magic_motion.cloud_capacity,
-                                              sizeof(V3));
-    assert(magic_motion.spatial_cloud);
-
-    magic_motion.tag_cloud = (MagicMotionTag *)calloc(magic_motion.cloud_capacity,
-                                                      sizeof(MagicMotionTag));
-    assert(magic_motion.tag_cloud);
+    if(sensor_prefetch_depth > 0 && magic_motion.num_active_sensors > 0)
+    {
+        StartSensorPrefetch(&magic_motion.sensor_prefetch,
+                            magic_motion.sensors, magic_motion.num_active_sensors,
+                            sensor_prefetch_depth);
+    }
 
-    magic_motion.color_cloud = (ColorPixel *)calloc(magic_motion.cloud_capacity,
-                                                    sizeof(ColorPixel));
-    assert(magic_motion.color_cloud);
+    // An empty frame, for readers asking before the first frame is captured
+    _AllocateFrame(&magic_motion.frame_buffers[0]);
+    magic_motion.latest_frame = 0;
+    magic_motion.back_frame = 0;
+    _BindFrame(&magic_motion.frame_buffers[0]);
 
-    magic_motion.background_model = (float *)calloc(NUM_VOXELS,
+    magic_motion.background_model = (float *)calloc(magic_motion.voxel_capacity,
                                                     sizeof(float));
     assert(magic_motion.background_model);
 
-    MM_TRACE("Global buffers allocated");
+    magic_motion.voxel_color_sums = (VoxelColorSum *)calloc(grid->num_voxels,
+                                                            sizeof(VoxelColorSum));
+    assert(magic_motion.voxel_color_sums);
 
-    pthread_attr_t thread_attributes;
-    pthread_attr_init(&thread_attributes); // Set default attributes
-    // pthread_attr_setdetachstate(&thread_attributes, PTHREAD_CREATE_DETACHED);
+    // Level 1 has the most voxels of the levels above the full grid. Sparse
+    // grids only keep the levels with no more voxels than the full grid.
+    const uint32_t level_voxels = ((num_voxels_x+1)/2) * ((num_voxels_y+1)/2) * ((num_voxels_z+1)/2);
+    magic_motion.voxel_level_color_sums = (VoxelColorSum *)calloc(MIN(level_voxels, grid->num_voxels),
+                                                                  sizeof(VoxelColorSum));
+    assert(magic_motion.voxel_level_color_sums);
 
-    void *(*thread_3D)(void *);
-    switch(classifier3D)
-    {
-        case CLASSIFIER_3D_CALIBRATION_NAIVE:
-            thread_3D = &_ComputeBackgroundModelNaiveCalibration;
-            break;
-        case CLASSIFIER_3D_SIMPLE_MOG:
-            thread_3D = &_ComputeBackgroundModelSimpleMOG;
-            break;
-        case CLASSIFIER_3D_DL:
-            thread_3D = &_ComputeBackgroundModelDL;
-            break;
-        default:
-            thread_3D = NULL;
-            break;
-    }
+    magic_motion.voxel_foreground_counts = (uint32_t *)calloc(grid->num_voxels, sizeof(uint32_t));
+    assert(magic_motion.voxel_foreground_counts);
 
-    void *(*thread_2D)(void *);
-    switch(classifier2D)
-    {
-        case CLASSIFIER_2D_OPENCV:
-            thread_2D = &_ComputeBackgroundModelOpenCV;
-            break;
-        default:
-            thread_2D = NULL;
-            break;
-    }
+    magic_motion.point_voxels = (uint32_t *)calloc(magic_motion.cloud_capacity,
+                                                   sizeof(uint32_t));
+    assert(magic_motion.point_voxels);
 
-    if(thread_3D)
-    {
-        magic_motion.classifier_thread_3D.running = true;
-        pthread_create(&magic_motion.classifier_thread_3D.thread_handle, &thread_attributes,
-                       thread_3D, &magic_motion.classifier_thread_3D);
-    }
+    magic_motion.point_bins = (uint32_t *)calloc(magic_motion.cloud_capacity, sizeof(uint32_t));
+    magic_motion.point_first_hits = (uint8_t *)calloc(magic_motion.cloud_capacity, sizeof(uint8_t));
+    magic_motion.slab_occupied_voxels = (uint32_t *)calloc(magic_motion.cloud_capacity, sizeof(uint32_t));
+    assert(magic_motion.point_bins && magic_motion.point_first_hits && magic_motion.slab_occupied_voxels);
 
-    if(thread_2D)
-    {
-        magic_motion.classifier_thread_2D.running = true;
-        pthread_create(&magic_motion.classifier_thread_2D.thread_handle, &thread_attributes,
-                       thread_2D, &magic_motion.classifier_thread_2D);
-    }
+    MM_TRACE("Global buffers allocated");
 
-    pthread_attr_destroy(&thread_attributes);
+    pthread_mutex_init(&magic_motion.frame_mutex, NULL);
+    pthread_cond_init(&magic_motion.frame_condition, NULL);
+    magic_motion.completed_frame_count = 0;
+
+    // Unpinned until MagicMotion_PinClassifierThreads
+    magic_motion.classifier_thread_3D.cpu = -1;
+    magic_motion.classifier_thread_2D.cpu = -1;
+    MagicMotion_SetClassifiers(MagicMotion_GetClassifier3D(default_classifier3D), default_classifier2D);
 
     MM_TRACE("Background thread(s) started");
 
-    printf("MagicMotion initialized with %u active sensors. Point cloud size: %u. %u voxels.\n",
-           magic_motion.num_active_sensors, magic_motion.cloud_capacity, NUM_VOXELS);
+    printf("MagicMotion initialized with %u active sensors. Point cloud size: %u. %u voxels (%ux%ux%u, %f units each).\n",
+           magic_motion.num_active_sensors, magic_motion.cloud_capacity, grid->num_voxels,
+           num_voxels_x, num_voxels_y, num_voxels_z, voxel_size);
+}
+
+void
+MagicMotion_InitializeWithGrid(unsigned int num_voxels_x, unsigned int num_voxels_y,
+                               unsigned int num_voxels_z, float voxel_size, V3 origin)
+{
+    _Initialize(num_voxels_x, num_voxels_y, num_voxels_z, voxel_size, origin, 0);
+}
+
+void
+MagicMotion_InitializeSparseGrid(unsigned int num_voxels_x, unsigned int num_voxels_y,
+                                 unsigned int num_voxels_z, float voxel_size, V3 origin,
+                                 unsigned int max_bricks)
+{
+    assert(max_bricks > 0);
+    _Initialize(num_voxels_x, num_voxels_y, num_voxels_z, voxel_size, origin, max_bricks);
+}
+
+const MagicMotionVoxelGrid *
+MagicMotion_GetVoxelGrid(void)
+{
+    return &magic_motion.grid;
+}
+
+uint32_t
+MagicMotion_FindVoxel(uint32_t x, uint32_t y, uint32_t z)
+{
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    if(x >= grid->num_voxels_x || y >= grid->num_voxels_y || z >= grid->num_voxels_z) return UINT32_MAX;
+    if(grid->sparse) return FindBrickVoxel(&magic_motion.bricks, x, y, z);
+    return MagicMotion_VoxelIndex(grid, x, y, z);
 }
 
 void
 MagicMotion_Finalize(void)
 {
     MM_TRACE("Finalizing");
-    if(magic_motion.classifier_thread_3D.running)
+    MagicMotion_StopCaptureThread();
+
+    _StopClassifiers();
+    MM_TRACE("Ended classifier threads");
+
+    pthread_cond_destroy(&magic_motion.frame_condition);
+    pthread_mutex_destroy(&magic_motion.frame_mutex);
+
+
+    FinalizeWorkerPool(&magic_motion.workers);
+
+    free(magic_motion.slab_occupied_voxels);
+    free(magic_motion.point_first_hits);
+    free(magic_motion.point_bins);
+    free(magic_motion.point_voxels);
+    free(magic_motion.voxel_foreground_counts);
+    free(magic_motion.voxel_color_sums);
+    free(magic_motion.voxel_level_color_sums);
+    free(magic_motion.background_model);
+
+    free(magic_motion.point_morton_codes);
+    free(magic_motion.point_numbers);
+    free(magic_motion.sorted_morton_codes);
+    free(magic_motion.point_order);
+    free(magic_motion.sorted_positions);
+    free(magic_motion.sorted_colors);
+    free(magic_motion.sorted_tags);
+    FreeMortonSortBuffers(&magic_motion.morton_sort_buffers);
+    magic_motion.point_morton_codes = NULL;
+
+    for(int i=0; i<NUM_FRAME_BUFFERS; ++i)
     {
-        magic_motion.classifier_thread_3D.running = false;
-        pthread_join(magic_motion.classifier_thread_3D.thread_handle, NULL);
-        MM_TRACE("Ended 3D classifier thread");
+        _FreeFrame(&magic_motion.frame_buffers[i]);
+        free(magic_motion.summed_volumes[i]);
+        magic_motion.summed_volumes[i] = NULL;
+        free(magic_motion.summed_brick_frames[i]);
+        magic_motion.summed_brick_frames[i] = NULL;
+        free(magic_motion.summed_bricks[i]);
+        magic_motion.summed_bricks[i] = NULL;
+        magic_motion.has_summed_volume[i] = false;
+        FinalizeOctree(&magic_motion.spatial_indices[i]);
+        magic_motion.has_spatial_index[i] = false;
+        free(magic_motion.voxel_points[i]);
+        magic_motion.voxel_points[i] = NULL;
     }
 
-    if(magic_motion.classifier_thread_2D.running)
+    if(magic_motion.grid.sparse)
     {
-        magic_motion.classifier_thread_2D.running = false;
-        pthread_join(magic_motion.classifier_thread_2D.thread_handle, NULL);
-        MM_TRACE("Ended 2D classifier thread");
+        FinalizeVoxelBrickMap(&magic_motion.bricks);
+        magic_motion.grid.brick_keys = NULL;
     }
-
-
-    free(magic_motion.background_model);
-    free(magic_motion.color_cloud);
-    free(magic_motion.tag_cloud);
-    free(magic_motion.spatial_cloud);
     MM_TRACE("Freed global buffers");
 
+    StopSensorPrefetch(&magic_motion.sensor_prefetch);
+
     for(int i=0; i<magic_motion.num_active_sensors; ++i)
     {
         SaveSensor(magic_motion.sensors[i].serial, &magic_motion.sensor_frustums[i]);
         SensorFinalize(&magic_motion.sensors[i]);
         free(magic_motion.sensor_masks[i]);
+        free(magic_motion.sensor_rays[i].x);
+        free(magic_motion.sensor_rays[i].y);
+        magic_motion.sensor_rays[i] = (RayTable){};
     }
     MM_TRACE("Closed all sensors");
 
@@ -478,8 +2091,9 @@ MagicMotion_SetCameraTransform(unsigned int camera_index, Mat4 transform)
     magic_motion.sensor_frustums[camera_index].transform = transform;
 }
 
-void
-MagicMotion_CaptureFrame(void)
+// Capture and process a frame into frame_buffers[back_frame]
+static void
+_CaptureFrame(void)
 {
     MM_TRACE("Starting frame capture");
 
@@ -492,28 +2106,80 @@ MagicMotion_CaptureFrame(void)
     pthread_mutex_lock(&magic_motion.classifier_thread_2D.mutex_handle);
     MM_TRACE("Got the 2D mutex");
 
-    for(size_t i=0; i<magic_motion.num_active_sensors; ++i)
+    if(magic_motion.sensor_prefetch.running)
     {
-        SensorInfo *sensor = &magic_motion.sensors[i];
-        MM_TRACE("Got color frame");
-        magic_motion.sensor_frames[i].color_frame = GetSensorColorFrame(sensor);
-        magic_motion.sensor_frames[i].depth_frame = GetSensorDepthFrame(sensor);
-        MM_TRACE("Got depth frame");
+        ColorPixel *color_frames[MAX_SENSORS];
+        DepthPixel *depth_frames[MAX_SENSORS];
+        GetPrefetchedSensorFrames(&magic_motion.sensor_prefetch, color_frames, depth_frames);
+
+        for(size_t i=0; i<magic_motion.num_active_sensors; ++i)
+        {
+            magic_motion.sensor_frames[i].color_frame = color_frames[i];
+            magic_motion.sensor_frames[i].depth_frame = depth_frames[i];
+        }
+        MM_TRACE("Got prefetched frames");
+    }
+    else
+    {
+        for(size_t i=0; i<magic_motion.num_active_sensors; ++i)
+        {
+            SensorInfo *sensor = &magic_motion.sensors[i];
+            MM_TRACE("Got color frame");
+            magic_motion.sensor_frames[i].color_frame = GetSensorColorFrame(sensor);
+            magic_motion.sensor_frames[i].depth_frame = GetSensorDepthFrame(sensor);
+            MM_TRACE("Got depth frame");
+        }
     }
 
     pthread_mutex_lock(&magic_motion.classifier_thread_3D.mutex_handle);
     MM_TRACE("Got 3D mutex");
 
+    // The classifiers only change while both mutexes are held
+    const ClassifierData3D *data_3D = &magic_motion.classifier_thread_3D;
+    const bool use_sensor_masks = (magic_motion.classifier_thread_2D.classifier != CLASSIFIER_2D_NONE);
+    magic_motion.classify_batch = data_3D->classifier ? data_3D->classifier->classify_batch : NULL;
+    magic_motion.classifier_state = data_3D->state;
+    __atomic_load(&sensor_mask_mix, &magic_motion.mask_mix, __ATOMIC_SEQ_CST);
+
+    // While calibrating, every point is foreground. The calibration
+    // classifier reads the state the frame was captured with
+    const bool is_calibrating = __atomic_load_n(&data_3D->is_calibrating, __ATOMIC_SEQ_CST);
+    magic_motion.frame_is_calibrating[magic_motion.back_frame] = is_calibrating;
+
+    unsigned int options = 0;
+    if((data_3D->classifier || use_sensor_masks) && !is_calibrating) options |= PIPELINE_CLASSIFY;
+    if(use_sensor_masks) options |= PIPELINE_SENSOR_MASKS;
+    if(data_3D->classifier && data_3D->classifier->filter_noise) options |= PIPELINE_FILTER_NOISE;
+    if(!__atomic_load_n(&magic_motion.skip_colors, __ATOMIC_SEQ_CST)) options |= PIPELINE_COLORS;
+    if(__atomic_load_n(&magic_motion.build_summed_volumes, __ATOMIC_SEQ_CST)) options |= PIPELINE_SUMMED_VOLUME;
+    if(magic_motion.grid.sparse) options |= PIPELINE_SPARSE_GRID;
+    else if(magic_motion.grid.power_of_two) options |= PIPELINE_POW2_GRID;
+
+    // The steps after the pipeline are read with the options, so the whole
+    // frame is processed with the same settings
+    const bool morton_order = __atomic_load_n(&magic_motion.morton_order, __ATOMIC_SEQ_CST);
+    const bool build_spatial_index = __atomic_load_n(&magic_motion.build_spatial_indices, __ATOMIC_SEQ_CST);
+
+    MagicMotionFrame *frame = &magic_motion.frame_buffers[magic_motion.back_frame];
+    _BindFrame(frame);
+    magic_motion.has_summed_volume[magic_motion.back_frame] = false;
+    magic_motion.has_spatial_index[magic_motion.back_frame] = false;
+    frame->voxel_points = NULL;
+
+    // Only the voxels that got points the last time this frame buffer was
+    // used need clearing
+    for(unsigned int i=0; i<magic_motion.num_occupied_voxels; ++i)
+    {
+        magic_motion.voxels[magic_motion.occupied_voxels[i]] = (Voxel){};
+    }
+    magic_motion.num_occupied_voxels = 0;
     magic_motion.cloud_size = 0;
-    memset(magic_motion.voxels, 0, NUM_VOXELS*sizeof(Voxel));
     ++magic_motion.frame_count;
 
+    magic_motion.num_cloud_tiles = 0;
     for(unsigned int i=0; i<magic_motion.num_active_sensors; ++i)
     {
-        MM_TRACE("Starting computation on sensor");
         SensorInfo *sensor = &magic_motion.sensors[i];
-        ColorPixel *colors = magic_motion.sensor_frames[i].color_frame;
-        DepthPixel *depths = magic_motion.sensor_frames[i].depth_frame;
 
         // NOTE(istarnion): The color and depth streams does often
         // NOT have the same resolution, especially with image
@@ -522,152 +2188,192 @@ MagicMotion_CaptureFrame(void)
         assert(sensor->depth_stream_info.width <= sensor->color_stream_info.width);
         assert(sensor->depth_stream_info.height <= sensor->color_stream_info.height);
 
-        const unsigned int w = sensor->depth_stream_info.width;
+        // Cheap when the stream info is unchanged, which is almost always
+        _UpdateRayTable(&magic_motion.sensor_rays[i], sensor);
+
         const unsigned int h = sensor->depth_stream_info.height;
-        const unsigned int color_w = sensor->color_stream_info.width;
-        const unsigned int color_h = sensor->color_stream_info.height;
+        const unsigned int rows_per_tile = (h + CLOUD_TILES_PER_SENSOR-1) / CLOUD_TILES_PER_SENSOR;
+        for(unsigned int y=0; y<h; y+=rows_per_tile)
+        {
+            CloudTile *tile = &magic_motion.cloud_tiles[magic_motion.num_cloud_tiles++];
+            tile->sensor_index = i;
+            tile->first_row = y;
+            tile->end_row = MIN(y+rows_per_tile, h);
+        }
+    }
 
-        const float fov = sensor->depth_stream_info.fov;
-        const float aspect = sensor->depth_stream_info.aspect_ratio;
+    process_frame_variants[options]();
 
-        const Frustum f = magic_motion.sensor_frustums[i];
-        const Mat4 camera_transform = f.transform;
+    if(morton_order)
+    {
+        Timinginfo timing = StartTiming();
+        _SortCloud((options & PIPELINE_COLORS) != 0);
+        EndTimingAndPrint(&timing, "Morton order");
+    }
 
+    if(build_spatial_index)
+    {
         Timinginfo timing = StartTiming();
 
-        for(uint32_t y=0; y<h; ++y)
-        {
-            for(uint32_t x=0; x<w; ++x)
-            {
-                float depth = depths[x+y*w];
-                // float mask = magic_motion.sensor_masks[i][x+y*w];
-                if(depth > 0.0f)
-                {
-                    float pos_x = tanf((((float)x/(float)w)-0.5f)*fov) * depth;
-                    float pos_y = tanf((0.5f-((float)y / (float)h))*(fov/aspect)) * depth;
+        // Only the points within the voxel grid are indexed
+        BuildOctree(&magic_motion.spatial_indices[magic_motion.back_frame],
+                    magic_motion.spatial_cloud, magic_motion.cloud_size,
+                    magic_motion.grid.origin, AddV3(magic_motion.grid.origin, magic_motion.grid.size),
+                    &magic_motion.workers);
+        magic_motion.has_spatial_index[magic_motion.back_frame] = true;
 
-                    // Convert from mm to dm as we create the point
-                    V3 point = MulMat4Vec3(camera_transform,
-                                           (V3){ pos_x / 100.0f,
-                                                 pos_y / 100.0f,
-                                                 depth / 100.0f });
+        EndTimingAndPrint(&timing, "Spatial index");
+    }
 
-                    ColorPixel color = colors[(color_w/2-w/2+x)+(color_h/2-h/2+y)*color_w];
+    frame->frame_number = magic_motion.frame_count;
+    frame->cloud_size = magic_motion.cloud_size;
+    frame->num_occupied_voxels = magic_motion.num_occupied_voxels;
 
-                    int tag = (TAG_CAMERA_0 + i);
+    Timinginfo levels_timing = StartTiming();
+    _BuildVoxelLevels(frame, (options & PIPELINE_COLORS) != 0);
+    EndTimingAndPrint(&levels_timing, "Voxel levels");
 
-                    // Add to point clouds
-                    unsigned int index = magic_motion.cloud_size++;
-                    magic_motion.spatial_cloud[index] = point;
-                    magic_motion.color_cloud[index] = color;
-                    magic_motion.tag_cloud[index] = (MagicMotionTag)tag;
-                }
-            }
-        }
+    pthread_mutex_unlock(&magic_motion.classifier_thread_3D.mutex_handle);
+    pthread_mutex_unlock(&magic_motion.classifier_thread_2D.mutex_handle);
 
-        EndTimingAndPrint(&timing, "Cloud computation");
-    }
+    // Wake the classifier threads
+    pthread_mutex_lock(&magic_motion.frame_mutex);
+    magic_motion.completed_frame_count = magic_motion.frame_count;
+    pthread_cond_broadcast(&magic_motion.frame_condition);
+    pthread_mutex_unlock(&magic_motion.frame_mutex);
 
-    Timinginfo timing = StartTiming();
+    MM_TRACE("Finished frame capture");
+}
 
-    for(size_t i=0; i<magic_motion.cloud_size; ++i)
+// Find a frame buffer that is neither the latest frame, nor held by a
+// reader, allocating one if needed. Waits for readers to release a frame if
+// all buffers are in use. Returns -1 if *keep_waiting is cleared while
+// waiting. If keep_waiting is NULL, it waits as long as it takes.
+static int
+_FindFreeFrameBuffer(const bool *keep_waiting)
+{
+    while(!keep_waiting || __atomic_load_n(keep_waiting, __ATOMIC_SEQ_CST))
     {
-        V3 point = magic_motion.spatial_cloud[i];
-        ColorPixel color = magic_motion.color_cloud[i];
-        int tag = (int)magic_motion.tag_cloud[i];
-
-        // Check if the point is within the voxel grid
-        if(fabs(point.x) < BOUNDING_BOX_X/2.0f &&
-           fabs(point.y) < BOUNDING_BOX_Y/2.0f &&
-           fabs(point.z) < BOUNDING_BOX_Z/2.0f)
+        const unsigned int latest = __atomic_load_n(&magic_motion.latest_frame, __ATOMIC_SEQ_CST);
+        for(unsigned int i=0; i<NUM_FRAME_BUFFERS; ++i)
         {
-            // Determine if the point is background or foreground
-            if(classifier3D == CLASSIFIER_3D_NONE && classifier2D == CLASSIFIER_2D_NONE)
+            if(magic_motion.frame_buffers[i].positions && i != latest &&
+               __atomic_load_n(&magic_motion.frame_refcounts[i], __ATOMIC_SEQ_CST) == 0)
             {
-                // If we are not using any classifiers, we just set every tag to foreground.
-                // Some applications don't use MM for background subtraction, and shouldn't
-                // have to pay for it.
-                tag |= TAG_FOREGROUND;
-            }
-            else
-            {
-                #if 1
-                float background_probability = _TrilinearlyInterpolate(point, magic_motion.background_model);
-                #else
-                // Skip trilinear interpolation, and use nearest voxel instead:
-                float background_probability = magic_motion.background_data.background[voxel_index];
-                #endif
-
-                /* mask is computed per point, but we don't store it in a "cloud",
-                 * as it is quite useless on its own. we _could_ store a temp cloud
-                 * on the stack so we can use this again.
-                const float mix = 0.2f; // 0 is only background model, 1 is only sensor mask
-                background_probability = LERP(background_probability, (1.0f - mask), mix);
-                */
-
-                if(background_probability < BACKGROUND_PROBABILITY_TRESHOLD ||
-                   magic_motion.classifier_thread_3D.is_calibrating)
-                {
-                    tag |= TAG_FOREGROUND;
-                }
-                else
-                {
-                    tag |= TAG_BACKGROUND;
-                }
+                return i;
             }
+        }
 
-            uint32_t voxel_index = WORLD_TO_VOXEL(point);
-            if(voxel_index < 0 || voxel_index >= NUM_VOXELS)
+        for(unsigned int i=0; i<NUM_FRAME_BUFFERS; ++i)
+        {
+            if(!magic_motion.frame_buffers[i].positions)
             {
-                // NOTE(istarnion): I think this bug is fixed. Do some testing,
-                // and replace this with an assert
-                printf("WARNING: Point (%f, %f, %f) was transformed to voxel index %d\n",
-                       point.x, point.y, point.z, voxel_index);
-                continue;
+                _AllocateFrame(&magic_motion.frame_buffers[i]);
+                return i;
             }
+        }
 
-            Voxel *v = &magic_motion.voxels[voxel_index];
+        // Readers are holding on to two frames. This should be rare
+        sched_yield();
+    }
+
+    return -1;
+}
 
-            // Add the current points color into the running average
-            v->color.r = (uint8_t)((color.r + v->point_count * v->color.r) /
-                                   (v->point_count+1));
-            v->color.g = (uint8_t)((color.g + v->point_count * v->color.g) /
-                                   (v->point_count+1));
-            v->color.b = (uint8_t)((color.b + v->point_count * v->color.b) /
-                                   (v->point_count+1));
+void
+MagicMotion_CaptureFrame(void)
+{
+    if(__atomic_load_n(&magic_motion.capture_thread_running, __ATOMIC_SEQ_CST))
+    {
+        fprintf(stderr, "MagicMotion_CaptureFrame called while the capture thread is running. Use MagicMotion_AcquireLatestFrame instead.\n");
+        return;
+    }
 
-            ++v->point_count;
-        }
+    magic_motion.back_frame = _FindFreeFrameBuffer(NULL);
+    _CaptureFrame();
+    __atomic_store_n(&magic_motion.latest_frame, magic_motion.back_frame, __ATOMIC_SEQ_CST);
+}
+
+static void *
+_CaptureThread(void *userdata)
+{
+    while(__atomic_load_n(&magic_motion.capture_thread_running, __ATOMIC_SEQ_CST))
+    {
+        int back_frame = _FindFreeFrameBuffer(&magic_motion.capture_thread_running);
+        if(back_frame < 0) break;
+
+        magic_motion.back_frame = back_frame;
+        _CaptureFrame();
+
+        // Publish. Readers that got the previous frame keep it until they release it
+        __atomic_store_n(&magic_motion.latest_frame, magic_motion.back_frame, __ATOMIC_SEQ_CST);
     }
 
-    EndTimingAndPrint(&timing, "Voxel computation");
+    return NULL;
+}
+
+void
+MagicMotion_StartCaptureThread(void)
+{
+    if(__atomic_load_n(&magic_motion.capture_thread_running, __ATOMIC_SEQ_CST)) return;
+
+    __atomic_store_n(&magic_motion.capture_thread_running, true, __ATOMIC_SEQ_CST);
+    int rc = pthread_create(&magic_motion.capture_thread_handle, NULL, &_CaptureThread, NULL);
+    if(rc)
+    {
+        fprintf(stderr, "Failed to start the capture thread\n");
+        __atomic_store_n(&magic_motion.capture_thread_running, false, __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+MagicMotion_StopCaptureThread(void)
+{
+    if(!__atomic_load_n(&magic_motion.capture_thread_running, __ATOMIC_SEQ_CST)) return;
+
+    __atomic_store_n(&magic_motion.capture_thread_running, false, __ATOMIC_SEQ_CST);
+    pthread_join(magic_motion.capture_thread_handle, NULL);
+
+    // Point the MagicMotion_Get* functions to the latest frame,
+    // as they would after a call to MagicMotion_CaptureFrame
+    _BindFrame(&magic_motion.frame_buffers[magic_motion.latest_frame]);
+}
+
+const MagicMotionFrame *
+MagicMotion_AcquireLatestFrame(void)
+{
+    unsigned int frame;
 
-    // The naive classifier needs some help with noise
-    if(classifier3D == CLASSIFIER_3D_CALIBRATION_NAIVE)
+    while(true)
     {
-        for(int i=0; i<magic_motion.cloud_size; ++i)
-        {
-            uint32_t tag = magic_motion.tag_cloud[i];
-            if(tag & TAG_FOREGROUND)
-            {
-                // If it has been tagged as foreground, it will be within the
-                // voxel bounds, so the voxel_index will always be within bounds
-                uint32_t voxel_index = WORLD_TO_VOXEL(magic_motion.spatial_cloud[i]);
-                assert(voxel_index >= 0 && voxel_index < NUM_VOXELS);
-                if(magic_motion.voxels[voxel_index].point_count < 8)
-                {
-                    tag |= TAG_BACKGROUND;
-                    tag &= ~TAG_FOREGROUND;
-                    magic_motion.tag_cloud[i] = (MagicMotionTag)tag;
-                }
-            }
-        }
+        frame = __atomic_load_n(&magic_motion.latest_frame, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&magic_motion.frame_refcounts[frame], 1, __ATOMIC_SEQ_CST);
+
+        // If a newer frame was published in the meantime, the capture
+        // thread may already be writing to the one we got
+        if(__atomic_load_n(&magic_motion.latest_frame, __ATOMIC_SEQ_CST) == frame) break;
+
+        __atomic_sub_fetch(&magic_motion.frame_refcounts[frame], 1, __ATOMIC_SEQ_CST);
     }
 
-    pthread_mutex_unlock(&magic_motion.classifier_thread_3D.mutex_handle);
-    pthread_mutex_unlock(&magic_motion.classifier_thread_2D.mutex_handle);
+    return &magic_motion.frame_buffers[frame];
+}
 
-    MM_TRACE("Finished frame capture");
+// The index of a frame from MagicMotion_AcquireLatestFrame
+static unsigned int
+_FrameIndex(const MagicMotionFrame *frame)
+{
+    const ptrdiff_t index = frame - magic_motion.frame_buffers;
+    assert(index >= 0 && index < NUM_FRAME_BUFFERS);
+    return (unsigned int)index;
+}
+
+void
+MagicMotion_ReleaseFrame(const MagicMotionFrame *frame)
+{
+    const unsigned int index = _FrameIndex(frame);
+    unsigned int refcount = __atomic_sub_fetch(&magic_motion.frame_refcounts[index], 1, __ATOMIC_SEQ_CST);
+    assert(refcount != UINT_MAX);
 }
 
 void
@@ -728,172 +2434,291 @@ MagicMotion_GetVoxels(void)
     return magic_motion.voxels;
 }
 
+unsigned int
+MagicMotion_GetNumOccupiedVoxels(void)
+{
+    return magic_motion.num_occupied_voxels;
+}
+
+const uint32_t *
+MagicMotion_GetOccupiedVoxels(void)
+{
+    return magic_motion.occupied_voxels;
+}
+
+const MagicMotionVoxelLevel *
+MagicMotion_GetVoxelLevel(unsigned int level)
+{
+    if(level >= NUM_VOXEL_LEVELS) return NULL;
+
+    const MagicMotionVoxelLevel *result = &magic_motion.frame_buffers[magic_motion.latest_frame].voxel_levels[level];
+    return result->voxels ? result : NULL;
+}
+
+// The naive calibration classifier records the highest point count of each
+// voxel while calibrating. Voxels that had points during the calibration
+// are background.
+struct NaiveCalibrationClassifier
+{
+    // Only the voxels that have been occupied during calibration are
+    // touched, so each frame costs O(occupied voxels)
+    float *max_point_counts;
+    uint32_t *calibrated_voxels;
+    unsigned int num_calibrated_voxels;
+    bool was_calibrating_last_frame;
+};
+
 static void *
-_ComputeBackgroundModelNaiveCalibration(void *userdata)
+_InitNaiveCalibrationClassifier(void)
 {
-    ClassifierData3D *data = (ClassifierData3D *)userdata;
+    NaiveCalibrationClassifier *classifier = (NaiveCalibrationClassifier *)calloc(1, sizeof(NaiveCalibrationClassifier));
+    classifier->max_point_counts = (float *)calloc(magic_motion.grid.num_voxels, sizeof(float));
+    classifier->calibrated_voxels = (uint32_t *)malloc(magic_motion.grid.num_voxels * sizeof(uint32_t));
+    assert(classifier->max_point_counts && classifier->calibrated_voxels);
 
-    // A place to store a copy of the latest voxel frame
-    Voxel *latest_frame = (Voxel *)malloc(NUM_VOXELS * sizeof(Voxel));
+    return classifier;
+}
 
-    // Buffer to store average point counts per voxel during calibration
-    float *avg_point_counts = (float *)malloc(NUM_VOXELS * sizeof(float));
-    bool was_calibrating_last_frame = false;
-    unsigned int calibration_start_frame = 0;
+static void
+_UpdateNaiveCalibrationClassifier(void *state, const MagicMotionFrame *frame)
+{
+    NaiveCalibrationClassifier *classifier = (NaiveCalibrationClassifier *)state;
+    float *max_point_counts = classifier->max_point_counts;
+    const Voxel *latest_frame = frame->voxels;
 
-    while(data->running)
+    if(magic_motion.frame_is_calibrating[_FrameIndex(frame)])
     {
-        // Get last frame voxel grid.
-        unsigned int frame_count = magic_motion.frame_count;
-        // Consider taking the mutex for this. The main thread might be writing
-        // to the voxel grid while memcpy runs.
-        memcpy(latest_frame, magic_motion.voxels, NUM_VOXELS * sizeof(Voxel));
-
-        if(data->is_calibrating)
+        if(!classifier->was_calibrating_last_frame)
         {
-            if(!was_calibrating_last_frame)
+            // This is the first frame of the calibration.
+            // Forget the previous one.
+            for(unsigned int n=0; n<classifier->num_calibrated_voxels; ++n)
             {
-                // This is the first frame of the calibration
-                calibration_start_frame = frame_count;
-                memset(avg_point_counts, 0, NUM_VOXELS * sizeof(float));
-                memset(magic_motion.background_model, 0, NUM_VOXELS * sizeof(float));
-                was_calibrating_last_frame = true;
+                const uint32_t i = classifier->calibrated_voxels[n];
+                max_point_counts[i] = 0.0f;
+                magic_motion.background_model[i] = 0.0f;
             }
 
-            unsigned int framenum = frame_count - calibration_start_frame;
+            classifier->num_calibrated_voxels = 0;
+            classifier->was_calibrating_last_frame = true;
+        }
 
-            for(uint32_t i=0; i<NUM_VOXELS; ++i)
+        // Empty voxels can't raise the max
+        for(unsigned int n=0; n<frame->num_occupied_voxels; ++n)
+        {
+            const uint32_t i = frame->occupied_voxels[n];
+            if(max_point_counts[i] == 0.0f)
             {
-                float point_count = (float)latest_frame[i].point_count;
-                /* Average: */
-                // avg_point_counts[i] = (avg_point_counts[i] * framenum +
-                //                        point_count) / (framenum+1);
-                /* Max: */
-                avg_point_counts[i] = MAX(avg_point_counts[i], point_count);
+                classifier->calibrated_voxels[classifier->num_calibrated_voxels++] = i;
             }
+
+            float point_count = (float)latest_frame[i].point_count;
+            max_point_counts[i] = MAX(max_point_counts[i], point_count);
         }
-        else
+    }
+    else
+    {
+        if(classifier->was_calibrating_last_frame)
         {
-            if(was_calibrating_last_frame)
+            // This is the first frame after we stop calibrating
+            for(unsigned int n=0; n<classifier->num_calibrated_voxels; ++n)
             {
-                // This is the first frame after we stop calibrating
-                pthread_mutex_lock(&data->mutex_handle);
-
-                for(uint32_t i=0; i<NUM_VOXELS; ++i)
-                {
-                    float background_prob = MIN(1.0f, avg_point_counts[i]);
-                    magic_motion.background_model[i] = background_prob;
-                }
-
-                pthread_mutex_unlock(&data->mutex_handle);
+                const uint32_t i = classifier->calibrated_voxels[n];
+                float background_prob = MIN(1.0f, max_point_counts[i]);
+                magic_motion.background_model[i] = background_prob;
             }
-
-            was_calibrating_last_frame = false;
         }
 
-        sched_yield();
+        classifier->was_calibrating_last_frame = false;
     }
+}
 
-    free(avg_point_counts);
-    free(latest_frame);
-
-    return NULL;
+static void
+_ShutdownNaiveCalibrationClassifier(void *state)
+{
+    NaiveCalibrationClassifier *classifier = (NaiveCalibrationClassifier *)state;
+    free(classifier->calibrated_voxels);
+    free(classifier->max_point_counts);
+    free(classifier);
 }
 
 static void *
-_ComputeBackgroundModelSimpleMOG(void *userdata)
+_InitMOGClassifier(void)
 {
-    ClassifierData3D *data = (ClassifierData3D *)userdata;
+    VoxelMOG *mog = (VoxelMOG *)malloc(sizeof(VoxelMOG));
+    assert(mog);
+    InitializeVoxelMOG(mog, magic_motion.grid.num_voxels);
+
+    return mog;
+}
 
-    // A place to store a copy of the latest voxel frame
-    Voxel *latest_frame = (Voxel *)malloc(NUM_VOXELS * sizeof(Voxel));
+static void
+_UpdateMOGClassifier(void *state, const MagicMotionFrame *frame)
+{
+    // Only the occupied and recently occupied voxels need updating.
+    // The model catches up on the frames a voxel was empty the next
+    // time it is occupied.
+    UpdateVoxelMOG((VoxelMOG *)state, frame->voxels,
+                   frame->occupied_voxels, frame->num_occupied_voxels,
+                   magic_motion.background_model);
+}
+
+static void
+_ShutdownMOGClassifier(void *state)
+{
+    FinalizeVoxelMOG((VoxelMOG *)state);
+    free(state);
+}
 
-    // Buffer to store average point counts per voxel during calibration
-    float *avg_point_counts = (float *)calloc(NUM_VOXELS, sizeof(float));
+static void *
+_InitDLClassifier(void)
+{
+    // TEMP: Set probability for background to
+    // 100% for all voxels. Nothing changes it, so it is only set once.
+    std::fill_n(magic_motion.background_model, magic_motion.grid.num_voxels, 1.0f);
 
-    static const int duration = 30 * 30;
-    static const float treshold = 25.0f;
+    return NULL;
+}
 
-    size_t last_frame_count = 0;
+static void
+_UpdateDLClassifier(void *, const MagicMotionFrame *)
+{
+    // For the DL classifier we might want to feed it 4D data (+time), in
+    // which case we need to keep some of the frames. The model itself
+    // should run on its own thread, as the next frame waits for this.
+}
 
-    while(data->running)
-    {
-        pthread_mutex_lock(&data->mutex_handle);
+static void
+_ShutdownDLClassifier(void *state)
+{
+}
 
-        size_t frame_count = magic_motion.frame_count;
-        if(frame_count == last_frame_count)
-        {
-            pthread_mutex_unlock(&data->mutex_handle);
-            sched_yield();
-            continue;
-        }
+// The built-in 3D classifiers all keep their background in
+// magic_motion.background_model
+static void
+_ClassifyBatchWithBackgroundModel(void *state, const V3 *positions, unsigned int count,
+                                  float *background_probabilities)
+{
+    TrilinearlyInterpolate(positions, count, magic_motion.background_model, background_probabilities);
+}
 
-        last_frame_count = frame_count;
+static const MagicMotionClassifier naive_calibration_classifier = {
+    .name = "Naive calibration",
+    .init = &_InitNaiveCalibrationClassifier,
+    .update = &_UpdateNaiveCalibrationClassifier,
+    .classify_batch = &_ClassifyBatchWithBackgroundModel,
+    .shutdown = &_ShutdownNaiveCalibrationClassifier,
+    .filter_noise = true
+};
 
-        // Get last frame voxel grid.
-        memcpy(latest_frame, magic_motion.voxels, NUM_VOXELS * sizeof(Voxel));
+static const MagicMotionClassifier mog_classifier = {
+    .name = "MOG",
+    .init = &_InitMOGClassifier,
+    .update = &_UpdateMOGClassifier,
+    .classify_batch = &_ClassifyBatchWithBackgroundModel,
+    .shutdown = &_ShutdownMOGClassifier,
+    .filter_noise = false
+};
 
-        size_t framenum = MIN(frame_count, duration-1);
+static const MagicMotionClassifier dl_classifier = {
+    .name = "DL",
+    .init = &_InitDLClassifier,
+    .update = &_UpdateDLClassifier,
+    .classify_batch = &_ClassifyBatchWithBackgroundModel,
+    .shutdown = &_ShutdownDLClassifier,
+    .filter_noise = false
+};
 
-        for(size_t i=0; i<NUM_VOXELS; ++i)
-        {
-            float point_count = (float)latest_frame[i].point_count;
-            avg_point_counts[i] = (avg_point_counts[i] * framenum +
-                                   point_count) / (framenum+1);
+const MagicMotionClassifier *
+MagicMotion_GetClassifier3D(Classifier3D classifier)
+{
+    switch(classifier)
+    {
+        case CLASSIFIER_3D_CALIBRATION_NAIVE: return &naive_calibration_classifier;
+        case CLASSIFIER_3D_MOG: return &mog_classifier;
+        case CLASSIFIER_3D_DL: return &dl_classifier;
+        default: return NULL;
+    }
+}
 
-            float background_prob = (avg_point_counts[i] >= treshold) ? 1 : 0;
-            magic_motion.background_model[i] = background_prob;
+static void *
+_RunClassifier3D(void *userdata)
+{
+    ClassifierData3D *data = (ClassifierData3D *)userdata;
+    unsigned int frame_count = 0;
 
-            // if(point_count > 0) printf("(%d, %f)", (int)point_count, avg_point_counts[i]);
-        }
+    while(true)
+    {
+        if(!_WaitForNewFrame(&frame_count, &data->running)) break;
 
-        // putc('\n', stdout);
+        // Borrow the latest frame. It is not written to until we release it
+        const MagicMotionFrame *frame = MagicMotion_AcquireLatestFrame();
 
+        // No points are classified while we hold the mutex
+        pthread_mutex_lock(&data->mutex_handle);
+        data->classifier->update(data->state, frame);
         pthread_mutex_unlock(&data->mutex_handle);
-        sched_yield();
-    }
 
-    free(avg_point_counts);
-    free(latest_frame);
+        MagicMotion_ReleaseFrame(frame);
+    }
 
     return NULL;
 }
 
-static void *
-_ComputeBackgroundModelDL(void *userdata)
+// Worker task: update the depth background of a tile of rows of a sensor,
+// and its mask
+static void
+_UpdateDepthBackgroundTile(void *userdata, unsigned int tile_index)
 {
-    ClassifierData3D *data = (ClassifierData3D *)userdata;
+    DepthBackground *backgrounds = (DepthBackground *)userdata;
+    const CloudTile *tile = &magic_motion.cloud_tiles[tile_index];
+    const unsigned int i = tile->sensor_index;
+    const SensorInfo *sensor = &magic_motion.sensors[i];
+
+    UpdateDepthBackground(&backgrounds[i],
+                          magic_motion.sensor_frames[i].depth_frame,
+                          magic_motion.sensor_frames[i].color_frame,
+                          sensor->color_stream_info.width,
+                          sensor->color_stream_info.height,
+                          tile->first_row, tile->end_row,
+                          magic_motion.sensor_masks[i]);
+}
 
-    // A place to store a copy of the latest voxel frame
-    Voxel *latest_frame = (Voxel *)malloc(NUM_VOXELS * sizeof(Voxel));
+static void *
+_ComputeBackgroundModelDepth(void *userdata)
+{
+    ClassifierData2D *data = (ClassifierData2D *)userdata;
 
-    while(data->running)
+    DepthBackground backgrounds[MAX_SENSORS];
+    for(int i=0; i<magic_motion.num_active_sensors; ++i)
     {
-        // Get last frame voxel grid.
-        // For the DL classifier we might want to feed it 4D data (+time), in
-        // which case we need to get multiple frames
-        pthread_mutex_lock(&data->mutex_handle);
-        memcpy(latest_frame, magic_motion.voxels, NUM_VOXELS * sizeof(Voxel));
-        pthread_mutex_unlock(&data->mutex_handle);
-
-        // Process
-        sleep(1); // Placeholder
+        SensorInfo *sensor = &magic_motion.sensors[i];
+        InitializeDepthBackground(&backgrounds[i],
+                                  sensor->depth_stream_info.width,
+                                  sensor->depth_stream_info.height);
+    }
 
-        pthread_mutex_lock(&data->mutex_handle);
+    unsigned int frame_count = 0;
 
-        for(uint32_t i=0; i<NUM_VOXELS; ++i)
-        {
-            // TEMP: Set probability for background to
-            // 100% for all voxels
-            magic_motion.background_model[i] = 1.0f;
-        }
+    while(true)
+    {
+        if(!_WaitForNewFrame(&frame_count, &data->running)) break;
 
+        // The frame capture holds the 2D mutex from when it gets new sensor
+        // frames until the frame is done. While we hold it, the sensor
+        // frames are those of the latest frame, and the worker pool is free
+        // for us to use. The cloud tiles split the sensors into rows, so
+        // the sensors are processed in parallel.
+        pthread_mutex_lock(&data->mutex_handle);
+        RunWorkerTasks(&magic_motion.workers, &_UpdateDepthBackgroundTile,
+                       backgrounds, magic_motion.num_cloud_tiles);
         pthread_mutex_unlock(&data->mutex_handle);
-
-        sched_yield();
     }
 
-    free(latest_frame);
+    for(int i=0; i<magic_motion.num_active_sensors; ++i)
+    {
+        FinalizeDepthBackground(&backgrounds[i]);
+    }
 
     return NULL;
 }
@@ -919,8 +2744,12 @@ _ComputeBackgroundModelOpenCV(void *userdata)
                                         sizeof(float));
     }
 
-    while(data->running)
+    unsigned int frame_count = 0;
+
+    while(true)
     {
+        if(!_WaitForNewFrame(&frame_count, &data->running)) break;
+
         for(int i=0; i<magic_motion.num_active_sensors; ++i)
         {
             SensorInfo *sensor = &magic_motion.sensors[i];
@@ -931,9 +2760,17 @@ _ComputeBackgroundModelOpenCV(void *userdata)
             const int dw = sensor->depth_stream_info.width;
             const int dh = sensor->depth_stream_info.height;
 
+            // The sensor frames are only those of the latest frame while
+            // we hold the 2D mutex. With prefetching, the next frame
+            // capture hands them back to be overwritten.
+            pthread_mutex_lock(&data->mutex_handle);
             float *depth_pixels = magic_motion.sensor_frames[i].depth_frame;
             ColorPixel *color_pixels = magic_motion.sensor_frames[i].color_frame;
-            if(!(depth_pixels && color_pixels)) continue;
+            if(!(depth_pixels && color_pixels))
+            {
+                pthread_mutex_unlock(&data->mutex_handle);
+                continue;
+            }
 
             // We feed the subtractor a mix of the depth image signal and
             // the grayscaled color image signal to try to get the
@@ -953,6 +2790,7 @@ _ComputeBackgroundModelOpenCV(void *userdata)
                 // Mix the signals
                 input_imgs[i][j] = LERP(input_imgs[i][j], value, mix);
             }
+            pthread_mutex_unlock(&data->mutex_handle);
 
             frames[i] = cv::Mat(sensor->depth_stream_info.height, // Rows
                                 sensor->depth_stream_info.width,  // Cols
@@ -972,8 +2810,6 @@ _ComputeBackgroundModelOpenCV(void *userdata)
 
             pthread_mutex_unlock(&data->mutex_handle);
         }
-
-        sched_yield();
     }
 
     for(int i=0; i<magic_motion.num_active_sensors; ++i)
@@ -985,22 +2821,356 @@ _ComputeBackgroundModelOpenCV(void *userdata)
     return NULL;
 }
 
+void
+MagicMotion_SetClassifiers(const MagicMotionClassifier *classifier_3D, Classifier2D classifier_2D)
+{
+    static const char *classifier_2D_names[] = { "none", "depth", "OpenCV" };
+    if((unsigned int)classifier_2D >= sizeof(classifier_2D_names)/sizeof(classifier_2D_names[0]))
+    {
+        fprintf(stderr, "Unknown 2D classifier %d. Using none.\n", (int)classifier_2D);
+        classifier_2D = CLASSIFIER_2D_NONE;
+    }
+
+    _StopClassifiers();
+
+    ClassifierData3D *data_3D = &magic_motion.classifier_thread_3D;
+    ClassifierData2D *data_2D = &magic_motion.classifier_thread_2D;
+
+    pthread_mutex_lock(&data_2D->mutex_handle);
+    pthread_mutex_lock(&data_3D->mutex_handle);
+    data_3D->classifier = classifier_3D;
+    data_3D->state = classifier_3D ? classifier_3D->init() : NULL;
+    data_2D->classifier = classifier_2D;
+    pthread_mutex_unlock(&data_3D->mutex_handle);
+    pthread_mutex_unlock(&data_2D->mutex_handle);
+
+    void *(*thread_2D)(void *);
+    switch(classifier_2D)
+    {
+        case CLASSIFIER_2D_DEPTH:
+            thread_2D = &_ComputeBackgroundModelDepth;
+            break;
+        case CLASSIFIER_2D_OPENCV:
+            thread_2D = &_ComputeBackgroundModelOpenCV;
+            break;
+        default:
+            thread_2D = NULL;
+            break;
+    }
+
+    // The new threads keep the pins of the old ones
+    if(classifier_3D)
+    {
+        data_3D->running = true;
+        pthread_create(&data_3D->thread_handle, NULL, &_RunClassifier3D, data_3D);
+        if(data_3D->cpu >= 0) _PinThread(data_3D->thread_handle, data_3D->cpu);
+    }
+
+    if(thread_2D)
+    {
+        data_2D->running = true;
+        pthread_create(&data_2D->thread_handle, NULL, thread_2D, data_2D);
+        if(data_2D->cpu >= 0) _PinThread(data_2D->thread_handle, data_2D->cpu);
+    }
+
+    printf("3D classifier: %s. 2D classifier: %s.\n",
+           classifier_3D ? classifier_3D->name : "none", classifier_2D_names[classifier_2D]);
+}
+
+void
+MagicMotion_SetSensorMaskMix(float mix)
+{
+    mix = MIN(MAX(mix, 0.0f), 1.0f);
+    __atomic_store(&sensor_mask_mix, &mix, __ATOMIC_SEQ_CST);
+}
+
+void
+MagicMotion_SetColorSampling(bool enabled)
+{
+    __atomic_store_n(&magic_motion.skip_colors, !enabled, __ATOMIC_SEQ_CST);
+}
+
+void
+MagicMotion_SetAABBQueries(bool enabled)
+{
+    __atomic_store_n(&magic_motion.build_summed_volumes, enabled, __ATOMIC_SEQ_CST);
+}
+
+// The sums of the voxels in [x0, x1) x [y0, y1) x [z0, z1) within the
+// brick with its min corner at brick_x, brick_y, brick_z, in voxels
+static inline VoxelCountSum
+_SumBrickVolumeInBox(unsigned int frame_index, uint32_t brick,
+                     unsigned int brick_x, unsigned int brick_y, unsigned int brick_z,
+                     unsigned int x0, unsigned int y0, unsigned int z0,
+                     unsigned int x1, unsigned int y1, unsigned int z1)
+{
+    const MagicMotionVoxelGrid *brick_grid = &magic_motion.brick_grid;
+    return SumVolumeBox(&magic_motion.summed_volumes[frame_index][brick * SUMMED_VOLUME_SIZE(brick_grid)],
+                        brick_grid,
+                        MAX(x0, brick_x) - brick_x,
+                        MAX(y0, brick_y) - brick_y,
+                        MAX(z0, brick_z) - brick_z,
+                        MIN(x1, brick_x + VOXEL_BRICK_SIZE) - brick_x,
+                        MIN(y1, brick_y + VOXEL_BRICK_SIZE) - brick_y,
+                        MIN(z1, brick_z + VOXEL_BRICK_SIZE) - brick_z);
+}
+
+// The sums of the voxels in [x0, x1) x [y0, y1) x [z0, z1) of a sparse
+// grid, from the tables of the bricks the box overlaps. Bricks without
+// points in the frame have no table of the frame, and are empty. A box
+// over more bricks than have points in the frame goes through the list of
+// those bricks instead of looking up each brick it overlaps.
+static VoxelCountSum
+_SumBrickVolumesInBox(unsigned int frame_index,
+                      unsigned int x0, unsigned int y0, unsigned int z0,
+                      unsigned int x1, unsigned int y1, unsigned int z1)
+{
+    VoxelCountSum result = {};
+
+    // The bricks the box overlaps, as [bx0, bx1) x [by0, by1) x [bz0, bz1)
+    const unsigned int bx0 = x0 >> VOXEL_BRICK_SHIFT, bx1 = ((x1-1) >> VOXEL_BRICK_SHIFT) + 1;
+    const unsigned int by0 = y0 >> VOXEL_BRICK_SHIFT, by1 = ((y1-1) >> VOXEL_BRICK_SHIFT) + 1;
+    const unsigned int bz0 = z0 >> VOXEL_BRICK_SHIFT, bz1 = ((z1-1) >> VOXEL_BRICK_SHIFT) + 1;
+    const uint64_t box_bricks = (uint64_t)(bx1 - bx0) * (by1 - by0) * (bz1 - bz0);
+
+    const unsigned int num_bricks = magic_motion.num_summed_bricks[frame_index];
+    if(num_bricks < box_bricks)
+    {
+        const uint32_t *bricks = magic_motion.summed_bricks[frame_index];
+        for(unsigned int i=0; i<num_bricks; ++i)
+        {
+            const uint32_t key = magic_motion.bricks.brick_keys[bricks[i]];
+            const unsigned int bx = key & 0x3FF;
+            const unsigned int by = (key >> 10) & 0x3FF;
+            const unsigned int bz = key >> 20;
+            if(bx < bx0 || bx >= bx1 || by < by0 || by >= by1 || bz < bz0 || bz >= bz1) continue;
+
+            const VoxelCountSum sums = _SumBrickVolumeInBox(frame_index, bricks[i],
+                                                            bx << VOXEL_BRICK_SHIFT,
+                                                            by << VOXEL_BRICK_SHIFT,
+                                                            bz << VOXEL_BRICK_SHIFT,
+                                                            x0, y0, z0, x1, y1, z1);
+            result.point_count += sums.point_count;
+            result.foreground_count += sums.foreground_count;
+        }
+        return result;
+    }
+
+    const uint32_t frame_number = magic_motion.frame_buffers[frame_index].frame_number;
+    const uint32_t *brick_frames = magic_motion.summed_brick_frames[frame_index];
+    for(unsigned int bz=bz0; bz<bz1; ++bz)
+    {
+        for(unsigned int by=by0; by<by1; ++by)
+        {
+            for(unsigned int bx=bx0; bx<bx1; ++bx)
+            {
+                const unsigned int min_x = bx << VOXEL_BRICK_SHIFT;
+                const unsigned int min_y = by << VOXEL_BRICK_SHIFT;
+                const unsigned int min_z = bz << VOXEL_BRICK_SHIFT;
+                const uint32_t first_voxel = FindBrickVoxel(&magic_motion.bricks, min_x, min_y, min_z);
+                if(first_voxel == NO_BRICK_VOXEL) continue;
+
+                const uint32_t brick = first_voxel / VOXEL_BRICK_VOXELS;
+                if(brick_frames[brick] != frame_number) continue;
+
+                const VoxelCountSum sums = _SumBrickVolumeInBox(frame_index, brick, min_x, min_y, min_z,
+                                                                x0, y0, z0, x1, y1, z1);
+                result.point_count += sums.point_count;
+                result.foreground_count += sums.foreground_count;
+            }
+        }
+    }
+
+    return result;
+}
+
+static MagicMotionAABBCounts
+_QueryAABB(unsigned int frame_index, V3 min, V3 max)
+{
+    MagicMotionAABBCounts result = {};
+    if(!magic_motion.has_summed_volume[frame_index]) return result;
+
+    // The box in voxels from the grid corner. The boxes can come from the
+    // network, so a box with NaN in it is empty
+    const MagicMotionVoxelGrid *grid = &magic_motion.grid;
+    const float x0 = floorf((min.x - grid->origin.x) * grid->voxels_per_unit);
+    const float y0 = floorf((min.y - grid->origin.y) * grid->voxels_per_unit);
+    const float z0 = floorf((min.z - grid->origin.z) * grid->voxels_per_unit);
+    const float x1 = floorf((max.x - grid->origin.x) * grid->voxels_per_unit) + 1.0f;
+    const float y1 = floorf((max.y - grid->origin.y) * grid->voxels_per_unit) + 1.0f;
+    const float z1 = floorf((max.z - grid->origin.z) * grid->voxels_per_unit) + 1.0f;
+    if(isnan(x0) || isnan(y0) || isnan(z0) || isnan(x1) || isnan(y1) || isnan(z1)) return result;
+
+    // The voxels the box overlaps. Clamped to the grid before the
+    // conversion, as huge and infinite coordinates don't fit in an int
+    const unsigned int clamped_x0 = (unsigned int)MIN(MAX(x0, 0.0f), (float)grid->num_voxels_x);
+    const unsigned int clamped_y0 = (unsigned int)MIN(MAX(y0, 0.0f), (float)grid->num_voxels_y);
+    const unsigned int clamped_z0 = (unsigned int)MIN(MAX(z0, 0.0f), (float)grid->num_voxels_z);
+    const unsigned int clamped_x1 = (unsigned int)MIN(MAX(x1, 0.0f), (float)grid->num_voxels_x);
+    const unsigned int clamped_y1 = (unsigned int)MIN(MAX(y1, 0.0f), (float)grid->num_voxels_y);
+    const unsigned int clamped_z1 = (unsigned int)MIN(MAX(z1, 0.0f), (float)grid->num_voxels_z);
+
+    if(clamped_x0 >= clamped_x1 || clamped_y0 >= clamped_y1 || clamped_z0 >= clamped_z1) return result;
+
+    const VoxelCountSum sums = grid->sparse ?
+        _SumBrickVolumesInBox(frame_index,
+                              clamped_x0, clamped_y0, clamped_z0,
+                              clamped_x1, clamped_y1, clamped_z1) :
+        SumVolumeBox(magic_motion.summed_volumes[frame_index], grid,
+                     clamped_x0, clamped_y0, clamped_z0,
+                     clamped_x1, clamped_y1, clamped_z1);
+    result.point_count = sums.point_count;
+    result.foreground_count = sums.foreground_count;
+    return result;
+}
+
+MagicMotionAABBCounts
+MagicMotion_QueryAABB(V3 min, V3 max)
+{
+    return _QueryAABB(magic_motion.latest_frame, min, max);
+}
+
+MagicMotionAABBCounts
+MagicMotion_QueryFrameAABB(const MagicMotionFrame *frame, V3 min, V3 max)
+{
+    return _QueryAABB(_FrameIndex(frame), min, max);
+}
+
+void
+MagicMotion_SetMortonOrder(bool enabled)
+{
+    __atomic_store_n(&magic_motion.morton_order, enabled, __ATOMIC_SEQ_CST);
+}
+
+const MagicMotionVoxelPoints *
+MagicMotion_GetVoxelPoints(void)
+{
+    return magic_motion.frame_buffers[magic_motion.latest_frame].voxel_points;
+}
+
+void
+MagicMotion_SetNeighbourQueries(bool enabled)
+{
+    __atomic_store_n(&magic_motion.build_spatial_indices, enabled, __ATOMIC_SEQ_CST);
+}
+
+static void
+_FindNeighboursInRadius(unsigned int frame_index, const V3 *points, unsigned int count, float radius,
+                        unsigned int max_neighbours, uint32_t *out_indices, unsigned int *out_counts)
+{
+    const Octree *tree = &magic_motion.spatial_indices[frame_index];
+    const bool has_index = magic_motion.has_spatial_index[frame_index];
+
+    for(unsigned int i=0; i<count; ++i)
+    {
+        out_counts[i] = has_index ? (unsigned int)FindPointsInSphere(tree, points[i], radius,
+                                                                     &out_indices[(size_t)i*max_neighbours],
+                                                                     max_neighbours)
+                                  : 0;
+    }
+}
+
+static void
+_FindNearestNeighbours(unsigned int frame_index, const V3 *points, unsigned int count, unsigned int k,
+                       float max_distance, uint32_t *out_indices, float *out_distances_squared,
+                       unsigned int *out_counts)
+{
+    const Octree *tree = &magic_motion.spatial_indices[frame_index];
+    const bool has_index = magic_motion.has_spatial_index[frame_index];
+
+    for(unsigned int i=0; i<count; ++i)
+    {
+        out_counts[i] = has_index ? FindNearestPoints(tree, points[i], k, max_distance,
+                                                      &out_indices[(size_t)i*k],
+                                                      &out_distances_squared[(size_t)i*k])
+                                  : 0;
+    }
+}
+
+void
+MagicMotion_FindNeighboursInRadius(const V3 *points, unsigned int count, float radius,
+                                   unsigned int max_neighbours, uint32_t *out_indices,
+                                   unsigned int *out_counts)
+{
+    _FindNeighboursInRadius(magic_motion.latest_frame, points, count, radius,
+                            max_neighbours, out_indices, out_counts);
+}
+
+void
+MagicMotion_FindFrameNeighboursInRadius(const MagicMotionFrame *frame, const V3 *points, unsigned int count,
+                                        float radius, unsigned int max_neighbours, uint32_t *out_indices,
+                                        unsigned int *out_counts)
+{
+    _FindNeighboursInRadius(_FrameIndex(frame), points, count, radius,
+                            max_neighbours, out_indices, out_counts);
+}
+
+void
+MagicMotion_FindNearestNeighbours(const V3 *points, unsigned int count, unsigned int k, float max_distance,
+                                  uint32_t *out_indices, float *out_distances_squared,
+                                  unsigned int *out_counts)
+{
+    _FindNearestNeighbours(magic_motion.latest_frame, points, count, k, max_distance,
+                           out_indices, out_distances_squared, out_counts);
+}
+
+void
+MagicMotion_FindFrameNearestNeighbours(const MagicMotionFrame *frame, const V3 *points, unsigned int count,
+                                       unsigned int k, float max_distance, uint32_t *out_indices,
+                                       float *out_distances_squared, unsigned int *out_counts)
+{
+    _FindNearestNeighbours(_FrameIndex(frame), points, count, k, max_distance,
+                           out_indices, out_distances_squared, out_counts);
+}
+
+void
+MagicMotion_PinClassifierThreads(int cpu_3D, int cpu_2D)
+{
+    ClassifierData3D *data_3D = &magic_motion.classifier_thread_3D;
+    ClassifierData2D *data_2D = &magic_motion.classifier_thread_2D;
+
+    // Kept for the threads MagicMotion_SetClassifiers starts later
+    if(cpu_3D >= 0)
+    {
+        data_3D->cpu = cpu_3D;
+        if(data_3D->running) _PinThread(data_3D->thread_handle, cpu_3D);
+    }
+
+    if(cpu_2D >= 0)
+    {
+        data_2D->cpu = cpu_2D;
+        if(data_2D->running) _PinThread(data_2D->thread_handle, cpu_2D);
+    }
+}
+
+void
+MagicMotion_SetSensorPrefetchDepth(unsigned int depth)
+{
+    if(depth > MAX_PREFETCH_DEPTH)
+    {
+        fprintf(stderr, "Can not prefetch %u frames. Using %u.\n", depth, MAX_PREFETCH_DEPTH);
+        depth = MAX_PREFETCH_DEPTH;
+    }
+
+    sensor_prefetch_depth = depth;
+}
+
 void
 MagicMotion_StartCalibration(void)
 {
-    magic_motion.classifier_thread_3D.is_calibrating = true;
+    __atomic_store_n(&magic_motion.classifier_thread_3D.is_calibrating, true, __ATOMIC_SEQ_CST);
 }
 
 void
 MagicMotion_EndCalibration(void)
 {
-    magic_motion.classifier_thread_3D.is_calibrating = false;
+    __atomic_store_n(&magic_motion.classifier_thread_3D.is_calibrating, false, __ATOMIC_SEQ_CST);
 }
 
 bool
 MagicMotion_IsCalibrating(void)
 {
-    return magic_motion.classifier_thread_3D.is_calibrating;
+    return __atomic_load_n(&magic_motion.classifier_thread_3D.is_calibrating, __ATOMIC_SEQ_CST);
 }
 
 #ifdef __cplusplus
@@ -21,30 +21,96 @@ extern "C" {
 // This is quite arbitrary, but kept low to save memory and startup time
 #define MAX_SENSORS 4
 
-// A voxel is a cube of size VOXEL_SIZE in the voxel grid
-#define VOXEL_SIZE 0.5f
+// The voxel grid MagicMotion_Initialize uses. Other grids can be set with
+// MagicMotion_InitializeWithGrid.
+#define DEFAULT_VOXEL_SIZE 0.5f
+#define DEFAULT_NUM_VOXELS_X 100
+#define DEFAULT_NUM_VOXELS_Y 100
+#define DEFAULT_NUM_VOXELS_Z 100
 
-// Dimensions for the voxel space
-#define NUM_VOXELS_X 100
-#define NUM_VOXELS_Y 100
-#define NUM_VOXELS_Z 100
+// Sparse grids store their voxels in bricks of VOXEL_BRICK_SIZE^3 voxels,
+// x first, then y, then z. A voxel index is the slot of its brick in the
+// brick pool times VOXEL_BRICK_VOXELS, plus its offset in the brick.
+#define VOXEL_BRICK_SHIFT 3
+#define VOXEL_BRICK_SIZE (1 << VOXEL_BRICK_SHIFT)
+#define VOXEL_BRICK_VOXELS (VOXEL_BRICK_SIZE*VOXEL_BRICK_SIZE*VOXEL_BRICK_SIZE)
 
-#define BOUNDING_BOX_X (NUM_VOXELS_X * VOXEL_SIZE)
-#define BOUNDING_BOX_Y (NUM_VOXELS_Y * VOXEL_SIZE)
-#define BOUNDING_BOX_Z (NUM_VOXELS_Z * VOXEL_SIZE)
+// Brick coordinates packed in 32 bits, 10 bits per axis
+#define VOXEL_BRICK_KEY(x, y, z) ((x) | ((y) << 10) | ((z) << 20))
 
-#define NUM_VOXELS (NUM_VOXELS_X*NUM_VOXELS_Y*NUM_VOXELS_Z)
+// The voxel grid is num_voxels_x*num_voxels_y*num_voxels_z cubes of size
+// voxel_size, with its min corner at origin. The voxels of dense grids are
+// stored x first, then y, then z. Sparse grids only store the bricks that
+// have had points, see MagicMotion_InitializeSparseGrid.
+typedef struct
+{
+    unsigned int num_voxels_x;
+    unsigned int num_voxels_y;
+    unsigned int num_voxels_z;
+    float voxel_size;
+    V3 origin;
+
+    // Derived from the above
+    uint32_t num_voxels;  // The length of the per-voxel arrays. For sparse grids, max_bricks*VOXEL_BRICK_VOXELS
+    V3 size;              // The size of the grid along each axis
+    float voxels_per_unit; // 1/voxel_size
+    bool power_of_two;    // If all dimensions are powers of two. Indices are then shifts and masks
+    unsigned int shift_y; // log2(num_voxels_x), if power_of_two
+    unsigned int shift_z; // log2(num_voxels_x*num_voxels_y), if power_of_two
+
+    bool sparse;
+    uint32_t max_bricks;         // The size of the brick pool, if sparse
+    const uint32_t *brick_keys;  // The VOXEL_BRICK_KEY of the brick in each slot of the pool, if sparse
+} MagicMotionVoxelGrid;
 
-// Map voxel grid coords (not world space coords!) to voxel array index
-#define VOXEL_INDEX(x, y, z) ((x) + (y)*NUM_VOXELS_X + (z)*NUM_VOXELS_X*NUM_VOXELS_Y)
+// Map voxel grid coords (not world space coords!) to voxel array index.
+// Dense grids only. MagicMotion_FindVoxel works for both.
+static inline uint32_t
+MagicMotion_VoxelIndex(const MagicMotionVoxelGrid *grid, uint32_t x, uint32_t y, uint32_t z)
+{
+    if(grid->power_of_two) return x | (y << grid->shift_y) | (z << grid->shift_z);
+    return x + y*grid->num_voxels_x + z*grid->num_voxels_x*grid->num_voxels_y;
+}
 
-#define WORLD_TO_VOXEL(v) VOXEL_INDEX((int)(((v).x - (BOUNDING_BOX_X/-2.0f))/VOXEL_SIZE),\
-                                      (int)(((v).y - (BOUNDING_BOX_Y/-2.0f))/VOXEL_SIZE),\
-                                      (int)(((v).z - (BOUNDING_BOX_Z/-2.0f))/VOXEL_SIZE))
-#define VOXEL_TO_WORLD(index) (V3){ (float)((BOUNDING_BOX_X/-2.0f) + VOXEL_SIZE*((index)%NUM_VOXELS_X)                + VOXEL_SIZE/2.0),\
-                                    (float)((BOUNDING_BOX_Y/-2.0f) + VOXEL_SIZE*(((index)/NUM_VOXELS_X)%NUM_VOXELS_Y) + VOXEL_SIZE/2.0),\
-                                    (float)((BOUNDING_BOX_Z/-2.0f) + VOXEL_SIZE*((index)/(NUM_VOXELS_X*NUM_VOXELS_Y)) + VOXEL_SIZE/2.0) \
-                                  }
+static inline void
+MagicMotion_VoxelCoords(const MagicMotionVoxelGrid *grid, uint32_t index,
+                        uint32_t *x, uint32_t *y, uint32_t *z)
+{
+    if(grid->sparse)
+    {
+        const uint32_t key = grid->brick_keys[index / VOXEL_BRICK_VOXELS];
+        const uint32_t offset = index % VOXEL_BRICK_VOXELS;
+        *x = ((key & 0x3FF) << VOXEL_BRICK_SHIFT) | (offset & (VOXEL_BRICK_SIZE-1));
+        *y = (((key >> 10) & 0x3FF) << VOXEL_BRICK_SHIFT) | ((offset >> VOXEL_BRICK_SHIFT) & (VOXEL_BRICK_SIZE-1));
+        *z = ((key >> 20) << VOXEL_BRICK_SHIFT) | (offset >> 2*VOXEL_BRICK_SHIFT);
+    }
+    else if(grid->power_of_two)
+    {
+        *x = index & (grid->num_voxels_x-1);
+        *y = (index >> grid->shift_y) & (grid->num_voxels_y-1);
+        *z = index >> grid->shift_z;
+    }
+    else
+    {
+        *x = index % grid->num_voxels_x;
+        *y = (index / grid->num_voxels_x) % grid->num_voxels_y;
+        *z = index / (grid->num_voxels_x*grid->num_voxels_y);
+    }
+}
+
+// The center of a voxel in world space
+static inline V3
+MagicMotion_VoxelCenter(const MagicMotionVoxelGrid *grid, uint32_t index)
+{
+    uint32_t x, y, z;
+    MagicMotion_VoxelCoords(grid, index, &x, &y, &z);
+    V3 result = {
+        grid->origin.x + grid->voxel_size*((float)x + 0.5f),
+        grid->origin.y + grid->voxel_size*((float)y + 0.5f),
+        grid->origin.z + grid->voxel_size*((float)z + 0.5f)
+    };
+    return result;
+}
 
 typedef enum
 {
@@ -63,7 +129,138 @@ typedef struct
     ColorPixel color; // The average color of the points in this voxel
 } Voxel;
 
+// The voxel grid is also kept at lower resolutions. Each level has half as
+// many voxels as the level below it along each axis, rounded up, so a voxel
+// of level n covers 2^n voxels of the full grid along each axis. Level 0 is
+// the full grid. For the default grid, the last level is 2x2x2 voxels.
+#define NUM_VOXEL_LEVELS 7
+
+// The levels share the origin of the full grid. When a level has an odd
+// number of voxels along an axis, the last voxels of the next level reach
+// past the grid. The point count of a voxel is the sum of the voxels it
+// covers, and its color their average color. Level 0 is indexed like the
+// full grid, and the levels above it are always dense. A sparse grid only
+// keeps the levels with no more voxels than its brick pool.
+typedef struct
+{
+    unsigned int num_voxels_x;
+    unsigned int num_voxels_y;
+    unsigned int num_voxels_z;
+    float voxel_size;
+    Voxel *voxels; // x first, then y, then z, like the full grid
+    uint32_t *occupied_voxels;
+    unsigned int num_occupied_voxels;
+} MagicMotionVoxelLevel;
+
+// The points of a voxel, in a cloud sorted in Morton order
+typedef struct
+{
+    uint32_t first_point;
+    uint32_t point_count;
+} MagicMotionVoxelPoints;
+
+// A complete frame, as published by the capture thread
+typedef struct
+{
+    unsigned int frame_number;
+    unsigned int cloud_size;
+    V3 *positions;
+    ColorPixel *colors;
+    MagicMotionTag *tags;
+    Voxel *voxels; // The full voxel grid, MagicMotionVoxelGrid::num_voxels long
+    uint32_t *occupied_voxels;
+    unsigned int num_occupied_voxels;
+    MagicMotionVoxelPoints *voxel_points; // One per occupied voxel. NULL unless in Morton order
+    MagicMotionVoxelLevel voxel_levels[NUM_VOXEL_LEVELS];
+} MagicMotionFrame;
+
+// The built-in 3D classifiers create a voxel grid background model each
+// point in the cloud gets its background probability from, using
+// trilinear interpolation.
+typedef enum
+{
+    CLASSIFIER_3D_NONE,
+    CLASSIFIER_3D_CALIBRATION_NAIVE,
+    CLASSIFIER_3D_MOG, // Mixture of gaussians per voxel
+    CLASSIFIER_3D_DL // Not implemented yet
+} Classifier3D;
+
+// The 2D classifiers create a mask per sensor containing white pixels for
+// foreground and black pixels for background
+typedef enum
+{
+    CLASSIFIER_2D_NONE,
+    CLASSIFIER_2D_DEPTH, // Per-pixel depth and color statistics
+    CLASSIFIER_2D_OPENCV // Only if built with OpenCV
+} Classifier2D;
+
+// Write the background probability, from 0 to 1, of each of count points
+typedef void (*MagicMotionClassifyBatchFunc)(void *state, const V3 *positions, unsigned int count,
+                                            float *background_probabilities);
+
+// A 3D classifier. It learns the background on its own thread, from every
+// new frame, and classifies the points of the frames as they are captured.
+typedef struct
+{
+    const char *name;
+
+    // Called when the classifier is set. Returns the state passed to the
+    // other functions.
+    void *(*init)(void);
+
+    // Called on the classifier thread for each new frame. No points are
+    // classified while it runs, so it can change what classify_batch reads,
+    // but the next frame waits for it.
+    void (*update)(void *state, const MagicMotionFrame *frame);
+
+    // Called for batches of points as a frame is captured, from several
+    // threads at once
+    MagicMotionClassifyBatchFunc classify_batch;
+
+    // Called when the classifier is replaced, or on MagicMotion_Finalize
+    void (*shutdown)(void *state);
+
+    // Move foreground points in sparse voxels to the background.
+    // For classifiers that need some help with noise.
+    bool filter_noise;
+} MagicMotionClassifier;
+
+// Off (0) by default. Up to depth frames are read from the sensors on a
+// separate thread while the previous frame is processed. This hides the
+// time spent waiting for the sensors, but the frames are up to depth frames
+// older when processed, and each is copied once more. Takes effect from
+// the next initialization. Depths above what is supported are clamped.
+void MagicMotion_SetSensorPrefetchDepth(unsigned int depth);
+
+// Initializes with the default classifiers, set in magic_motion.cpp, and the
+// default voxel grid, centered on the origin
 void MagicMotion_Initialize(void);
+
+// The same, with a voxel grid of the given dimensions and voxel size, with
+// its min corner at origin. The memory and the per frame work of the voxel
+// grid grow with the number of voxels. Grids with power of two dimensions
+// have slightly cheaper index math. No dimension can be more than 1024.
+void MagicMotion_InitializeWithGrid(unsigned int num_voxels_x, unsigned int num_voxels_y,
+                                    unsigned int num_voxels_z, float voxel_size, V3 origin);
+
+// The same, with a sparse voxel grid. Only the bricks of the grid that
+// have had points get storage, taken from a pool of max_bricks bricks. The
+// memory of the voxel grid then grows with max_bricks, not with the volume
+// of the grid, and the per frame work with the bricks that have points.
+// Bricks are kept once they have storage, so the background model can
+// learn them. Points in new bricks when the pool is full are left out of
+// the grid, like the points outside it. The levels of the grid with more
+// voxels than the pool are not kept.
+void MagicMotion_InitializeSparseGrid(unsigned int num_voxels_x, unsigned int num_voxels_y,
+                                      unsigned int num_voxels_z, float voxel_size, V3 origin,
+                                      unsigned int max_bricks);
+
+const MagicMotionVoxelGrid *MagicMotion_GetVoxelGrid(void);
+
+// The index of the voxel at the voxel grid coords, or UINT32_MAX if it is
+// outside the grid, or in a brick of a sparse grid without storage
+uint32_t MagicMotion_FindVoxel(uint32_t x, uint32_t y, uint32_t z);
+
 void MagicMotion_Finalize(void);
 
 unsigned int MagicMotion_GetNumCameras(void);
@@ -77,6 +274,20 @@ void MagicMotion_SetCameraTransform(unsigned int camera_index, Mat4 transform);
 
 void MagicMotion_CaptureFrame(void);
 
+// Optionally, let MagicMotion capture and process frames on its own thread.
+// While it runs, use MagicMotion_AcquireLatestFrame to get the cloud and
+// voxels instead of MagicMotion_CaptureFrame and the getters below.
+// An acquired frame stays valid until it is released. Any number of threads
+// can hold frames, but if they hold two frames other than the latest one,
+// the capture thread waits until one of them is released.
+// Frames can also be acquired without the capture thread, e.g. from other
+// threads while the main thread calls MagicMotion_CaptureFrame. The pointers
+// returned by the getters below change from frame to frame.
+void MagicMotion_StartCaptureThread(void);
+void MagicMotion_StopCaptureThread(void);
+const MagicMotionFrame *MagicMotion_AcquireLatestFrame(void);
+void MagicMotion_ReleaseFrame(const MagicMotionFrame *frame);
+
 void MagicMotion_GetColorImageResolution(unsigned int camera_index, int *width, int *height);
 void MagicMotion_GetDepthImageResolution(unsigned int camera_index, int *width, int *height);
 
@@ -89,7 +300,100 @@ V3 *MagicMotion_GetPositions(void);
 ColorPixel *MagicMotion_GetColors(void);
 MagicMotionTag *MagicMotion_GetTags(void);
 
-Voxel *MagicMotion_GetVoxels(void); // Return the full voxel grid as an array of length NUM_VOXELS
+Voxel *MagicMotion_GetVoxels(void); // Return the full voxel grid as an array of length MagicMotionVoxelGrid::num_voxels
+
+// The indices of the voxels that have points this frame, so the empty ones can be skipped
+unsigned int MagicMotion_GetNumOccupiedVoxels(void);
+const uint32_t *MagicMotion_GetOccupiedVoxels(void);
+
+// A level of the voxel grid, from 0 to NUM_VOXEL_LEVELS-1. NULL for other
+// levels, and the levels a sparse grid does not keep
+const MagicMotionVoxelLevel *MagicMotion_GetVoxelLevel(unsigned int level);
+
+// NULL for CLASSIFIER_3D_NONE
+const MagicMotionClassifier *MagicMotion_GetClassifier3D(Classifier3D classifier);
+
+// Replace the classifiers, e.g. to compare them on the same sensors. Pass
+// NULL for no 3D classifier. The new classifiers start without any
+// background, and take effect from the next frame. Their threads keep the
+// pins set with MagicMotion_PinClassifierThreads. Can be called while
+// frames are being captured, but not from several threads at once.
+void MagicMotion_SetClassifiers(const MagicMotionClassifier *classifier_3D, Classifier2D classifier_2D);
+
+// 0.2 by default. With a 2D classifier, how much the sensor masks weigh in
+// the background probability of a point, against the 3D classifier. 0 is
+// only the 3D classifier, 1 is only the sensor masks. Clamped to [0, 1].
+// Takes effect from the next frame.
+void MagicMotion_SetSensorMaskMix(float mix);
+
+// On by default. Without color sampling, the colors of the points and the
+// voxels are not written, which saves some time for applications that only
+// need the geometry. The voxels are black, also to the 3D classifiers.
+// Takes effect from the next frame.
+void MagicMotion_SetColorSampling(bool enabled);
+
+// Off by default. In Morton order, the cloud is sorted by the Morton codes
+// of the voxels of the points, so points in the same voxel are next to each
+// other, and points in nearby voxels tend to be close in memory. The points
+// outside the voxel grid go last. The occupied voxels are listed in the same
+// order, with the range of the cloud each of them has. Takes effect from
+// the next frame.
+void MagicMotion_SetMortonOrder(bool enabled);
+
+// The points of each of the occupied voxels, in the latest frame from
+// MagicMotion_CaptureFrame. NULL unless in Morton order.
+const MagicMotionVoxelPoints *MagicMotion_GetVoxelPoints(void);
+
+typedef struct
+{
+    uint32_t point_count;
+    uint32_t foreground_count;
+} MagicMotionAABBCounts;
+
+// Off by default. With AABB queries, a summed volume table of the voxel grid
+// is built with every frame, so queries take constant time, however big the
+// box. Takes effect from the next frame.
+void MagicMotion_SetAABBQueries(bool enabled);
+
+// The number of points, and of foreground points, in the voxels the box
+// overlaps, in the latest frame from MagicMotion_CaptureFrame, or in an
+// acquired frame. Always 0 for frames captured without AABB queries.
+MagicMotionAABBCounts MagicMotion_QueryAABB(V3 min, V3 max);
+MagicMotionAABBCounts MagicMotion_QueryFrameAABB(const MagicMotionFrame *frame, V3 min, V3 max);
+
+// Off by default. With neighbour queries, a spatial index of the cloud is
+// built with every frame, on the worker threads, for the functions below.
+// Only the points within the bounding box of the voxel grid are indexed.
+// Takes effect from the next frame.
+void MagicMotion_SetNeighbourQueries(bool enabled);
+
+// For each of count points, the indices in the cloud of the points within
+// radius of it. The indices of up to max_neighbours points are written to
+// out_indices[i*max_neighbours], in no particular order, and the number of
+// points within the radius, which may be more, to out_counts[i].
+// The queries run on the calling thread, and allocate nothing. The counts
+// are 0 for frames captured without neighbour queries.
+void MagicMotion_FindNeighboursInRadius(const V3 *points, unsigned int count, float radius,
+                                        unsigned int max_neighbours, uint32_t *out_indices,
+                                        unsigned int *out_counts);
+void MagicMotion_FindFrameNeighboursInRadius(const MagicMotionFrame *frame, const V3 *points, unsigned int count,
+                                             float radius, unsigned int max_neighbours, uint32_t *out_indices,
+                                             unsigned int *out_counts);
+
+// For each of count points, the k points of the cloud nearest to it, and no
+// farther away than max_distance. Their indices and squared distances are
+// written to out_indices[i*k] and out_distances_squared[i*k], nearest
+// first, and how many were found to out_counts[i].
+void MagicMotion_FindNearestNeighbours(const V3 *points, unsigned int count, unsigned int k, float max_distance,
+                                       uint32_t *out_indices, float *out_distances_squared,
+                                       unsigned int *out_counts);
+void MagicMotion_FindFrameNearestNeighbours(const MagicMotionFrame *frame, const V3 *points, unsigned int count,
+                                            unsigned int k, float max_distance, uint32_t *out_indices,
+                                            float *out_distances_squared, unsigned int *out_counts);
+
+// Pin the background classifier threads to the given CPU cores. Pass -1 to leave a thread as it is.
+// The pins also apply to the threads of classifiers set later with MagicMotion_SetClassifiers.
+void MagicMotion_PinClassifierThreads(int cpu_3D, int cpu_2D);
 
 void MagicMotion_StartCalibration(void); // If using the calibration classifier, start calibrating. While calibrating, the the sensors should see only background.
 void MagicMotion_EndCalibration(void);
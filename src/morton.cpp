@@ -0,0 +1,138 @@
+
+#include "morton.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    const uint32_t *in_keys;
+    const uint32_t *in_values;
+    uint32_t *out_keys;
+    uint32_t *out_values;
+    size_t count;
+    unsigned int shift;
+    uint32_t (*offsets)[MORTON_RADIX];
+} MortonSortPass;
+
+static inline void
+_GetSortChunk(const MortonSortPass *pass, unsigned int task_index, size_t *start, size_t *end)
+{
+    *start = (pass->count * task_index) / MORTON_SORT_TASKS;
+    *end = (pass->count * (task_index+1)) / MORTON_SORT_TASKS;
+}
+
+// Worker task: count the digits of a chunk of the keys
+static void
+_CountMortonDigits(void *userdata, unsigned int task_index)
+{
+    MortonSortPass *pass = (MortonSortPass *)userdata;
+    uint32_t *counts = pass->offsets[task_index];
+    memset(counts, 0, MORTON_RADIX*sizeof(uint32_t));
+
+    size_t start, end;
+    _GetSortChunk(pass, task_index, &start, &end);
+    for(size_t i=start; i<end; ++i)
+    {
+        ++counts[(pass->in_keys[i] >> pass->shift) & (MORTON_RADIX-1)];
+    }
+}
+
+// Worker task: move a chunk of the keys and values to their sorted places
+static void
+_ScatterMortonCodes(void *userdata, unsigned int task_index)
+{
+    MortonSortPass *pass = (MortonSortPass *)userdata;
+    uint32_t *offsets = pass->offsets[task_index];
+
+    size_t start, end;
+    _GetSortChunk(pass, task_index, &start, &end);
+    for(size_t i=start; i<end; ++i)
+    {
+        const uint32_t key = pass->in_keys[i];
+        const uint32_t offset = offsets[(key >> pass->shift) & (MORTON_RADIX-1)]++;
+        pass->out_keys[offset] = key;
+        pass->out_values[offset] = pass->in_values[i];
+    }
+}
+
+static void
+_RunMortonSortPass(MortonSortPass *pass, WorkerPool *workers)
+{
+    RunWorkerTasks(workers, &_CountMortonDigits, pass, MORTON_SORT_TASKS);
+
+    // Each task writes its keys with a digit after those of the earlier
+    // tasks, which keeps the sort stable
+    uint32_t offset = 0;
+    for(unsigned int digit=0; digit<MORTON_RADIX; ++digit)
+    {
+        for(unsigned int task=0; task<MORTON_SORT_TASKS; ++task)
+        {
+            const uint32_t count = pass->offsets[task][digit];
+            pass->offsets[task][digit] = offset;
+            offset += count;
+        }
+    }
+
+    RunWorkerTasks(workers, &_ScatterMortonCodes, pass, MORTON_SORT_TASKS);
+}
+
+void
+SortMortonCodes(const uint32_t *keys, const uint32_t *values, size_t count,
+                uint32_t *sorted_keys, uint32_t *sorted_values,
+                MortonSortBuffers *buffers, WorkerPool *workers)
+{
+    if(buffers->capacity < count)
+    {
+        free(buffers->keys);
+        free(buffers->values);
+        buffers->keys = (uint32_t *)malloc(count * sizeof(uint32_t));
+        buffers->values = (uint32_t *)malloc(count * sizeof(uint32_t));
+        assert(buffers->keys && buffers->values);
+        buffers->capacity = count;
+    }
+
+    if(!buffers->offsets)
+    {
+        buffers->offsets = (uint32_t (*)[MORTON_RADIX])malloc(MORTON_SORT_TASKS * sizeof(*buffers->offsets));
+        assert(buffers->offsets);
+    }
+
+    // Three passes, from the lowest digit up: The input to the output, the
+    // output to the scratch buffers, and back to the output
+    static_assert(MORTON_BITS*3 == 30, "The sort does one pass per axis");
+    MortonSortPass pass;
+    pass.count = count;
+    pass.offsets = buffers->offsets;
+
+    pass.in_keys = keys;
+    pass.in_values = values;
+    pass.out_keys = sorted_keys;
+    pass.out_values = sorted_values;
+    pass.shift = 0;
+    _RunMortonSortPass(&pass, workers);
+
+    pass.in_keys = sorted_keys;
+    pass.in_values = sorted_values;
+    pass.out_keys = buffers->keys;
+    pass.out_values = buffers->values;
+    pass.shift = MORTON_BITS;
+    _RunMortonSortPass(&pass, workers);
+
+    pass.in_keys = buffers->keys;
+    pass.in_values = buffers->values;
+    pass.out_keys = sorted_keys;
+    pass.out_values = sorted_values;
+    pass.shift = 2*MORTON_BITS;
+    _RunMortonSortPass(&pass, workers);
+}
+
+void
+FreeMortonSortBuffers(MortonSortBuffers *buffers)
+{
+    free(buffers->keys);
+    free(buffers->values);
+    free(buffers->offsets);
+    memset(buffers, 0, sizeof(MortonSortBuffers));
+}
@@ -0,0 +1,59 @@
+#ifndef MORTON_H_
+#define MORTON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "worker_pool.h"
+
+// Morton codes interleave the bits of 3D cell coordinates, x in the lowest
+// bit, so cells that are close in space tend to be close in the order of
+// their codes. Each axis has MORTON_BITS bits, and every 3 bits of a code,
+// from the top, pick an octant one level deeper.
+#define MORTON_BITS 10
+#define MORTON_CELLS (1 << MORTON_BITS)
+
+// Spread the low 10 bits of v out to every third bit
+static inline uint32_t
+MortonSpreadBits(uint32_t v)
+{
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v <<  8)) & 0x0300F00F;
+    v = (v | (v <<  4)) & 0x030C30C3;
+    v = (v | (v <<  2)) & 0x09249249;
+    return v;
+}
+
+static inline uint32_t
+MortonEncode(uint32_t x, uint32_t y, uint32_t z)
+{
+    return MortonSpreadBits(x) | (MortonSpreadBits(y) << 1) | (MortonSpreadBits(z) << 2);
+}
+
+// The sort is split into this many tasks
+#define MORTON_SORT_TASKS 16
+
+// One pass of the sort per MORTON_BITS bits of the codes
+#define MORTON_RADIX MORTON_CELLS
+
+// Scratch space for SortMortonCodes, reused between sorts
+typedef struct
+{
+    uint32_t *keys;
+    uint32_t *values;
+    size_t capacity;
+
+    uint32_t (*offsets)[MORTON_RADIX]; // Per task
+} MortonSortBuffers;
+
+void FreeMortonSortBuffers(MortonSortBuffers *buffers);
+
+// Sort count Morton codes, and a value per code, by the codes, into
+// sorted_keys and sorted_values. The sort is stable, so values with the
+// same code stay in the order they were in. The passes are split over the
+// worker pool.
+void SortMortonCodes(const uint32_t *keys, const uint32_t *values, size_t count,
+                     uint32_t *sorted_keys, uint32_t *sorted_values,
+                     MortonSortBuffers *buffers, WorkerPool *workers);
+
+#endif /* end of include guard: MORTON_H_ */
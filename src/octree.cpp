@@ -1,141 +1,603 @@
 #include "octree.h"
+
+#include "utils.h"
+#include <assert.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+static void
+_ReserveOctreeNodes(OctreeNodeList *list, size_t count)
+{
+    if(list->capacity < count)
+    {
+        size_t capacity = MAX(list->capacity*2, MAX(count, (size_t)64));
+        list->nodes = (OctreeNode *)realloc(list->nodes, capacity * sizeof(OctreeNode));
+        assert(list->nodes);
+        list->capacity = capacity;
+    }
+}
+
+static inline uint32_t
+_MortonCell(float v, float min, float cell_size)
+{
+    // The points on the far faces of the cube go in the last cell
+    int cell = (int)((v - min) / cell_size);
+    return (uint32_t)MIN(MAX(cell, 0), MORTON_CELLS-1);
+}
 
-static void _AddPoint(Octree *tree, V3 point, OctreeNode *node);
+static inline bool
+_IsInOctreeBox(const Octree *tree, V3 p)
+{
+    return p.x >= tree->min.x && p.x <= tree->box_max.x &&
+           p.y >= tree->min.y && p.y <= tree->box_max.y &&
+           p.z >= tree->min.z && p.z <= tree->box_max.z;
+}
 
+static inline void
+_GetBuildChunk(const Octree *tree, unsigned int task_index, size_t *start, size_t *end)
+{
+    *start = (tree->num_input_points * task_index) / MORTON_SORT_TASKS;
+    *end = (tree->num_input_points * (task_index+1)) / MORTON_SORT_TASKS;
+}
+
+// Worker task: count the points of a chunk that are within the box
 static void
-_AddPointToCorrectChild(Octree *tree, V3 point, OctreeNode *node)
+_CountOctreePoints(void *userdata, unsigned int task_index)
 {
-    // 0: -x -y -z
-    // 1:  x -y -z
-    // 2: -x  y -z
-    // 3:  x  y -z
-    // 4: -x -y  z
-    // 5:  x -y  z
-    // 6: -x  y  z
-    // 7:  x  y  z
+    Octree *tree = (Octree *)userdata;
 
-    int index = 0;
-    if(point.x > node->center.x) index |= 0x1;
-    if(point.y > node->center.y) index |= 0x2;
-    if(point.z > node->center.z) index |= 0x4;
+    size_t start, end;
+    _GetBuildChunk(tree, task_index, &start, &end);
+
+    uint32_t count = 0;
+    for(size_t i=start; i<end; ++i)
+    {
+        count += _IsInOctreeBox(tree, tree->input_points[i]);
+    }
 
-    // printf("Recursing to child %d (node %lu)\n", index, ((size_t)(node->children[index]) - (size_t)tree->node_pool)/sizeof(OctreeNode));
-    _AddPoint(tree, point, node->children[index]);
+    tree->chunk_offsets[task_index] = count;
 }
 
+// Worker task: compute the Morton codes of the points of a chunk that are
+// within the box
 static void
-_AddPoint(Octree *tree, V3 point, OctreeNode *node)
+_EncodeOctreePoints(void *userdata, unsigned int task_index)
 {
-    ++node->count;
+    Octree *tree = (Octree *)userdata;
 
-    if(node->count > OCTREE_BIN_SIZE)
+    size_t start, end;
+    _GetBuildChunk(tree, task_index, &start, &end);
+
+    uint32_t offset = tree->chunk_offsets[task_index];
+    for(size_t i=start; i<end; ++i)
     {
-        if(node->count == OCTREE_BIN_SIZE+1)
+        const V3 p = tree->input_points[i];
+        if(_IsInOctreeBox(tree, p))
         {
-            // printf("Splitting node %lu\n", ((size_t)node - (size_t)tree->node_pool)/sizeof(OctreeNode));
-            V3 points[OCTREE_BIN_SIZE];
-            memcpy(points, node->points, sizeof(points));
+            tree->codes[offset] = MortonEncode(_MortonCell(p.x, tree->min.x, tree->cell_size),
+                                               _MortonCell(p.y, tree->min.y, tree->cell_size),
+                                               _MortonCell(p.z, tree->min.z, tree->cell_size));
+            tree->input_indices[offset] = (uint32_t)i;
+            ++offset;
+        }
+    }
+}
 
-            for(int i=0; i<8; ++i)
-            {
-                // We ensure in initialization that there will be enough
-                // nodes in the pool, and they are all zero-initialized,
-                // thanks to the memset in ResetOctree
-                OctreeNode *child = &tree->node_pool[tree->node_pool_index++];
-                child->size = node->size / 2;
+// Worker task: copy a chunk of the points to their sorted places
+static void
+_GatherOctreePoints(void *userdata, unsigned int task_index)
+{
+    Octree *tree = (Octree *)userdata;
 
-                V3 offset = (V3){
-                    (i & 0x1) ? (child->size/2) : (child->size/-2),
-                    (i & 0x2) ? (child->size/2) : (child->size/-2),
-                    (i & 0x4) ? (child->size/2) : (child->size/-2)
-                };
+    const size_t start = (tree->num_points * task_index) / MORTON_SORT_TASKS;
+    const size_t end = (tree->num_points * (task_index+1)) / MORTON_SORT_TASKS;
+    for(size_t i=start; i<end; ++i)
+    {
+        tree->points[i] = tree->input_points[tree->point_indices[i]];
+    }
+}
 
-                child->center = AddV3(node->center, offset);
+// Add the children of the node to the list, next to each other, and return
+// how many there are. Leaves get none. The list must have room for 8 more
+// nodes, as the node may be in it.
+static unsigned int
+_SplitOctreeNode(const Octree *tree, OctreeNode *node, OctreeNodeList *list)
+{
+    if(node->point_count <= OCTREE_BIN_SIZE || node->level == MORTON_BITS)
+    {
+        node->child_mask = 0;
+        node->first_child = 0;
+        return 0;
+    }
 
-                node->children[i] = child;
-            }
+    const unsigned int shift = 3*(MORTON_BITS - 1 - node->level);
+    const uint16_t child_size = (uint16_t)(MORTON_CELLS >> (node->level+1));
+    const uint32_t *codes = &tree->sorted_codes[node->first_point];
 
-            for(int i=0; i<OCTREE_BIN_SIZE; ++i)
-            {
-                // printf("Redistributing point %d\n", i);
-                _AddPointToCorrectChild(tree, points[i], node);
-            }
-        }
+    node->child_mask = 0;
+    node->first_child = (uint32_t)list->count;
+
+    // The codes are sorted, so each octant is one run of them
+    uint32_t i = 0;
+    unsigned int num_children = 0;
+    while(i < node->point_count)
+    {
+        const unsigned int octant = (codes[i] >> shift) & 0x7;
+        uint32_t end = i+1;
+        while(end < node->point_count && ((codes[end] >> shift) & 0x7) == octant) ++end;
+
+        OctreeNode *child = &list->nodes[list->count++];
+        child->first_point = node->first_point + i;
+        child->point_count = end - i;
+        child->first_child = 0;
+        child->x = node->x + ((octant & 0x1) ? child_size : 0);
+        child->y = node->y + ((octant & 0x2) ? child_size : 0);
+        child->z = node->z + ((octant & 0x4) ? child_size : 0);
+        child->level = node->level+1;
+        child->child_mask = 0;
+
+        node->child_mask |= (uint8_t)(1 << octant);
+        ++num_children;
+        i = end;
+    }
+
+    return num_children;
+}
+
+// Split the node at the given index of the list, and its children, until
+// every node is a leaf
+static void
+_BuildOctreeNode(const Octree *tree, OctreeNodeList *list, uint32_t node_index)
+{
+    _ReserveOctreeNodes(list, list->count+8);
+    const unsigned int num_children = _SplitOctreeNode(tree, &list->nodes[node_index], list);
+    const uint32_t first_child = list->nodes[node_index].first_child;
+    for(unsigned int i=0; i<num_children; ++i)
+    {
+        _BuildOctreeNode(tree, list, first_child+i);
+    }
+}
+
+// Worker task: build the subtree below a node at OCTREE_SPLIT_LEVEL into a
+// list of its own. Its node indices are relative to the list.
+static void
+_BuildOctreeSubtree(void *userdata, unsigned int task_index)
+{
+    Octree *tree = (Octree *)userdata;
+    OctreeNodeList *list = &tree->subtrees[task_index];
+    list->count = 0;
 
-        // puts("Passing the current node on");
-        _AddPointToCorrectChild(tree, point, node);
+    // The node list is not resized while the subtrees are built, and each
+    // task has a root of its own
+    OctreeNode *root = &tree->nodes.nodes[tree->subtree_roots[task_index]];
+    _ReserveOctreeNodes(list, 8);
+    const unsigned int num_children = _SplitOctreeNode(tree, root, list);
+    for(unsigned int i=0; i<num_children; ++i)
+    {
+        _BuildOctreeNode(tree, list, i);
     }
-    else
+}
+
+// Worker task: copy a subtree into the node list, after the nodes above it
+static void
+_MergeOctreeSubtree(void *userdata, unsigned int task_index)
+{
+    Octree *tree = (Octree *)userdata;
+    const OctreeNodeList *list = &tree->subtrees[task_index];
+    const uint32_t offset = tree->subtree_offsets[task_index];
+
+    tree->nodes.nodes[tree->subtree_roots[task_index]].first_child = offset;
+
+    OctreeNode *nodes = &tree->nodes.nodes[offset];
+    for(size_t i=0; i<list->count; ++i)
     {
-        node->points[node->count-1] = point;
-        // printf("Added point to leaf node %lu\n", ((size_t)node - (size_t)tree->node_pool)/sizeof(OctreeNode));
+        nodes[i] = list->nodes[i];
+        if(nodes[i].child_mask) nodes[i].first_child += offset;
     }
 }
 
 void
-ResetOctree(Octree *tree, size_t max_num_points, float bounding_size)
+BuildOctree(Octree *tree, const V3 *points, size_t num_points, V3 box_min, V3 box_max, WorkerPool *workers)
 {
-    // NOTE(istarnion): !!! max_num_points MUST be consistent during runtime.
-    // we don't support reallocating the nodes ATM
-    if(tree->node_pool)
+    assert(num_points <= UINT32_MAX);
+
+    const float cube_size = MAX(box_max.x - box_min.x, MAX(box_max.y - box_min.y, box_max.z - box_min.z));
+    tree->min = box_min;
+    tree->box_max = box_max;
+    tree->cell_size = cube_size / MORTON_CELLS;
+    tree->input_points = points;
+    tree->num_input_points = num_points;
+
+    if(tree->capacity < num_points)
     {
-        memset(tree->node_pool, 0, sizeof(OctreeNode) * tree->node_pool_size);
+        free(tree->codes);
+        free(tree->input_indices);
+        free(tree->sorted_codes);
+        free(tree->point_indices);
+        free(tree->points);
+
+        tree->codes = (uint32_t *)malloc(num_points * sizeof(uint32_t));
+        tree->input_indices = (uint32_t *)malloc(num_points * sizeof(uint32_t));
+        tree->sorted_codes = (uint32_t *)malloc(num_points * sizeof(uint32_t));
+        tree->point_indices = (uint32_t *)malloc(num_points * sizeof(uint32_t));
+        tree->points = (V3 *)malloc(num_points * sizeof(V3));
+        assert(tree->codes && tree->input_indices && tree->sorted_codes &&
+               tree->point_indices && tree->points);
+
+        tree->capacity = num_points;
     }
-    else
+
+    // Leave out the points outside the box, keeping the rest in order
+    RunWorkerTasks(workers, &_CountOctreePoints, tree, MORTON_SORT_TASKS);
+
+    uint32_t offset = 0;
+    for(unsigned int i=0; i<MORTON_SORT_TASKS; ++i)
     {
-        if(max_num_points <= OCTREE_BIN_SIZE)
-        {
-            tree->node_pool_size = 1;
-        }
-        else
+        const uint32_t count = tree->chunk_offsets[i];
+        tree->chunk_offsets[i] = offset;
+        offset += count;
+    }
+    tree->num_points = offset;
+
+    RunWorkerTasks(workers, &_EncodeOctreePoints, tree, MORTON_SORT_TASKS);
+    SortMortonCodes(tree->codes, tree->input_indices, tree->num_points,
+                    tree->sorted_codes, tree->point_indices,
+                    &tree->sort_buffers, workers);
+    RunWorkerTasks(workers, &_GatherOctreePoints, tree, MORTON_SORT_TASKS);
+
+    // The levels above OCTREE_SPLIT_LEVEL are built here, breadth first.
+    // The nodes of the split level with points enough to be split are the
+    // roots of the subtrees.
+    OctreeNodeList *nodes = &tree->nodes;
+    _ReserveOctreeNodes(nodes, 1);
+    nodes->count = 1;
+
+    OctreeNode *root = &nodes->nodes[0];
+    memset(root, 0, sizeof(OctreeNode));
+    root->point_count = (uint32_t)tree->num_points;
+
+    tree->num_subtrees = 0;
+    size_t level_start = 0;
+    for(unsigned int level=0; level<=OCTREE_SPLIT_LEVEL; ++level)
+    {
+        const size_t level_end = nodes->count;
+        for(size_t i=level_start; i<level_end; ++i)
         {
-            tree->node_pool_size = (size_t)8 * (max_num_points) + 1;
+            if(level < OCTREE_SPLIT_LEVEL)
+            {
+                _ReserveOctreeNodes(nodes, nodes->count+8);
+                _SplitOctreeNode(tree, &nodes->nodes[i], nodes);
+            }
+            else if(nodes->nodes[i].point_count > OCTREE_BIN_SIZE)
+            {
+                assert(tree->num_subtrees < OCTREE_MAX_SUBTREES);
+                tree->subtree_roots[tree->num_subtrees++] = (uint32_t)i;
+            }
         }
 
-        tree->node_pool = (OctreeNode *)calloc(tree->node_pool_size, sizeof(OctreeNode));
-        printf("Allocated %lu nodes in the octree\n", tree->node_pool_size);
+        level_start = level_end;
+    }
+
+    RunWorkerTasks(workers, &_BuildOctreeSubtree, tree, tree->num_subtrees);
+
+    size_t num_nodes = nodes->count;
+    for(unsigned int i=0; i<tree->num_subtrees; ++i)
+    {
+        tree->subtree_offsets[i] = (uint32_t)num_nodes;
+        num_nodes += tree->subtrees[i].count;
     }
 
-    tree->node_pool_index = 0;
-    tree->root = &tree->node_pool[tree->node_pool_index++];
-    tree->root->size = bounding_size;
+    _ReserveOctreeNodes(nodes, num_nodes);
+    RunWorkerTasks(workers, &_MergeOctreeSubtree, tree, tree->num_subtrees);
+    nodes->count = num_nodes;
 }
 
 void
-AddPointsToOctree(V3 *points, size_t num_points, Octree *tree)
+FinalizeOctree(Octree *tree)
 {
-    float tree_extent = tree->root->size/2.0f;
-    for(size_t i=0; i<num_points; ++i)
+    free(tree->nodes.nodes);
+    for(unsigned int i=0; i<OCTREE_MAX_SUBTREES; ++i)
+    {
+        free(tree->subtrees[i].nodes);
+    }
+
+    free(tree->codes);
+    free(tree->input_indices);
+    free(tree->sorted_codes);
+    free(tree->point_indices);
+    free(tree->points);
+    FreeMortonSortBuffers(&tree->sort_buffers);
+
+    memset(tree, 0, sizeof(Octree));
+}
+
+struct OctreeBoxQuery
+{
+    V3 min;
+    V3 max;
+
+    bool Overlaps(V3 node_min, V3 node_max) const
+    {
+        return !(node_max.x < min.x || node_min.x > max.x ||
+                 node_max.y < min.y || node_min.y > max.y ||
+                 node_max.z < min.z || node_min.z > max.z);
+    }
+
+    bool Contains(V3 node_min, V3 node_max) const
     {
-        // printf("Adding point %lu\n", i);
-        if(!(abs(points[i].x) > tree_extent ||
-             abs(points[i].y) > tree_extent ||
-             abs(points[i].y) > tree_extent))
+        return node_min.x >= min.x && node_max.x <= max.x &&
+               node_min.y >= min.y && node_max.y <= max.y &&
+               node_min.z >= min.z && node_max.z <= max.z;
+    }
+
+    bool ContainsPoint(V3 p) const
+    {
+        return p.x >= min.x && p.x <= max.x &&
+               p.y >= min.y && p.y <= max.y &&
+               p.z >= min.z && p.z <= max.z;
+    }
+};
+
+struct OctreeSphereQuery
+{
+    V3 center;
+    float radius_squared;
+
+    bool Overlaps(V3 node_min, V3 node_max) const
+    {
+        const V3 closest = MakeV3(Clamp(center.x, node_min.x, node_max.x),
+                                  Clamp(center.y, node_min.y, node_max.y),
+                                  Clamp(center.z, node_min.z, node_max.z));
+        return MagnitudeSquaredV3(SubV3(closest, center)) <= radius_squared;
+    }
+
+    bool Contains(V3 node_min, V3 node_max) const
+    {
+        const V3 farthest = MakeV3(fabsf(center.x-node_min.x) > fabsf(center.x-node_max.x) ? node_min.x : node_max.x,
+                                   fabsf(center.y-node_min.y) > fabsf(center.y-node_max.y) ? node_min.y : node_max.y,
+                                   fabsf(center.z-node_min.z) > fabsf(center.z-node_max.z) ? node_min.z : node_max.z);
+        return MagnitudeSquaredV3(SubV3(farthest, center)) <= radius_squared;
+    }
+
+    bool ContainsPoint(V3 p) const
+    {
+        return MagnitudeSquaredV3(SubV3(p, center)) <= radius_squared;
+    }
+};
+
+static inline void
+_GetOctreeNodeBounds(const Octree *tree, const OctreeNode *node, V3 *node_min, V3 *node_max)
+{
+    const float size = (float)(MORTON_CELLS >> node->level) * tree->cell_size;
+    *node_min = MakeV3(tree->min.x + node->x*tree->cell_size,
+                       tree->min.y + node->y*tree->cell_size,
+                       tree->min.z + node->z*tree->cell_size);
+    *node_max = MakeV3(node_min->x + size, node_min->y + size, node_min->z + size);
+}
+
+static inline void
+_AddOctreeMatches(const Octree *tree, uint32_t first_point, uint32_t count,
+                  uint32_t *out_indices, size_t max_indices, size_t *num_found)
+{
+    if(out_indices && *num_found < max_indices)
+    {
+        const size_t n = MIN((size_t)count, max_indices - *num_found);
+        memcpy(&out_indices[*num_found], &tree->point_indices[first_point], n*sizeof(uint32_t));
+    }
+
+    *num_found += count;
+}
+
+// Walk the nodes that overlap with the query. Nodes entirely within it are
+// counted without looking at their points.
+template<typename Query>
+static size_t
+_QueryOctree(const Octree *tree, const Query &query, uint32_t *out_indices, size_t max_indices)
+{
+    size_t num_found = 0;
+    if(!tree->nodes.count) return 0;
+
+    // At most 7 siblings are waiting per level, and one node on the last
+    uint32_t stack[7*MORTON_BITS + 1];
+    unsigned int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while(stack_size)
+    {
+        const OctreeNode *node = &tree->nodes.nodes[stack[--stack_size]];
+        if(!node->point_count) continue;
+
+        V3 node_min, node_max;
+        _GetOctreeNodeBounds(tree, node, &node_min, &node_max);
+
+        if(!query.Overlaps(node_min, node_max)) continue;
+
+        if(query.Contains(node_min, node_max))
         {
-            _AddPoint(tree, points[i], tree->root);
+            _AddOctreeMatches(tree, node->first_point, node->point_count,
+                              out_indices, max_indices, &num_found);
+        }
+        else if(node->child_mask)
+        {
+            const unsigned int num_children = __builtin_popcount(node->child_mask);
+            for(unsigned int i=0; i<num_children; ++i)
+            {
+                stack[stack_size++] = node->first_child + i;
+            }
+        }
+        else
+        {
+            const uint32_t end = node->first_point + node->point_count;
+            for(uint32_t i=node->first_point; i<end; ++i)
+            {
+                if(query.ContainsPoint(tree->points[i]))
+                {
+                    _AddOctreeMatches(tree, i, 1, out_indices, max_indices, &num_found);
+                }
+            }
         }
     }
+
+    return num_found;
+}
+
+size_t
+CountPointsInBox(const Octree *tree, V3 box_min, V3 box_max)
+{
+    const OctreeBoxQuery query = { box_min, box_max };
+    return _QueryOctree(tree, query, NULL, 0);
+}
+
+size_t
+FindPointsInBox(const Octree *tree, V3 box_min, V3 box_max, uint32_t *out_indices, size_t max_indices)
+{
+    const OctreeBoxQuery query = { box_min, box_max };
+    return _QueryOctree(tree, query, out_indices, max_indices);
+}
+
+size_t
+CountPointsInSphere(const Octree *tree, V3 center, float radius)
+{
+    const OctreeSphereQuery query = { center, radius*radius };
+    return _QueryOctree(tree, query, NULL, 0);
+}
+
+size_t
+FindPointsInSphere(const Octree *tree, V3 center, float radius, uint32_t *out_indices, size_t max_indices)
+{
+    const OctreeSphereQuery query = { center, radius*radius };
+    return _QueryOctree(tree, query, out_indices, max_indices);
 }
 
 bool
-CheckBoxCollision(Octree *tree, V3 box_min, V3 box_max)
+CheckBoxCollision(const Octree *tree, V3 box_min, V3 box_max)
 {
-    size_t touching_points = 0;
+    return CountPointsInBox(tree, box_min, box_max) > 3;
+}
 
-    // TODO(istarnion): Implement!
-    /*
-    if(!(point.x < box_center.x-box_size.x/2 ||
-         point.x > box_center.x+box_size.x/2 ||
-         point.y < box_center.y-box_size.y/2 ||
-         point.y > box_center.y+box_size.y/2 ||
-         point.z < box_center.z/2-box_size.z/2 ||
-         point.z > box_center.z/2+box_size.z/2))
+// The nearest points found so far are kept in a max heap on the squared
+// distances, in the output arrays, so the farthest is always first
+static void
+_SiftOctreeHeapDown(uint32_t *indices, float *distances, unsigned int count, unsigned int i)
+{
+    while(true)
     {
-        ++touching_points;
+        unsigned int largest = i;
+        const unsigned int left = 2*i+1;
+        const unsigned int right = 2*i+2;
+        if(left < count && distances[left] > distances[largest]) largest = left;
+        if(right < count && distances[right] > distances[largest]) largest = right;
+        if(largest == i) break;
+
+        std::swap(indices[i], indices[largest]);
+        std::swap(distances[i], distances[largest]);
+        i = largest;
+    }
+}
+
+static void
+_PushOctreeHeap(uint32_t *indices, float *distances, unsigned int count, uint32_t index, float distance)
+{
+    unsigned int i = count;
+    while(i > 0 && distances[(i-1)/2] < distance)
+    {
+        indices[i] = indices[(i-1)/2];
+        distances[i] = distances[(i-1)/2];
+        i = (i-1)/2;
     }
-    */
 
-    return touching_points > 3;
+    indices[i] = index;
+    distances[i] = distance;
 }
 
+static inline float
+_DistanceSquaredToBox(V3 p, V3 box_min, V3 box_max)
+{
+    const V3 closest = MakeV3(Clamp(p.x, box_min.x, box_max.x),
+                              Clamp(p.y, box_min.y, box_max.y),
+                              Clamp(p.z, box_min.z, box_max.z));
+    return MagnitudeSquaredV3(SubV3(closest, p));
+}
+
+unsigned int
+FindNearestPoints(const Octree *tree, V3 point, unsigned int k, float max_distance,
+                  uint32_t *out_indices, float *out_distances_squared)
+{
+    if(!tree->nodes.count || k == 0) return 0;
+
+    unsigned int num_found = 0;
+    const float max_distance_squared = max_distance*max_distance;
+
+    // The nodes are visited nearest first, and skipped once they are
+    // farther away than the farthest of the k points found
+    struct
+    {
+        uint32_t node;
+        float distance_squared;
+    } stack[7*MORTON_BITS + 1];
+    unsigned int stack_size = 0;
+    stack[stack_size++] = { 0, 0.0f };
+
+    while(stack_size)
+    {
+        --stack_size;
+        const float bound = (num_found == k) ? out_distances_squared[0] : max_distance_squared;
+        if(stack[stack_size].distance_squared > bound) continue;
+
+        const OctreeNode *node = &tree->nodes.nodes[stack[stack_size].node];
+        if(node->child_mask)
+        {
+            // Push the children farthest first
+            const unsigned int num_children = __builtin_popcount(node->child_mask);
+            const unsigned int first = stack_size;
+            for(unsigned int i=0; i<num_children; ++i)
+            {
+                V3 child_min, child_max;
+                _GetOctreeNodeBounds(tree, &tree->nodes.nodes[node->first_child+i], &child_min, &child_max);
+                const float distance_squared = _DistanceSquaredToBox(point, child_min, child_max);
+                if(distance_squared > bound) continue;
+
+                unsigned int j = stack_size++;
+                while(j > first && stack[j-1].distance_squared < distance_squared)
+                {
+                    stack[j] = stack[j-1];
+                    --j;
+                }
+
+                stack[j] = { node->first_child+i, distance_squared };
+            }
+        }
+        else
+        {
+            const uint32_t end = node->first_point + node->point_count;
+            for(uint32_t i=node->first_point; i<end; ++i)
+            {
+                const float distance_squared = MagnitudeSquaredV3(SubV3(tree->points[i], point));
+                if(num_found < k)
+                {
+                    if(distance_squared > max_distance_squared) continue;
+                    _PushOctreeHeap(out_indices, out_distances_squared, num_found++,
+                                    tree->point_indices[i], distance_squared);
+                }
+                else if(distance_squared < out_distances_squared[0])
+                {
+                    out_indices[0] = tree->point_indices[i];
+                    out_distances_squared[0] = distance_squared;
+                    _SiftOctreeHeapDown(out_indices, out_distances_squared, num_found, 0);
+                }
+            }
+        }
+    }
+
+    // Sort the heap, nearest first
+    for(unsigned int count=num_found; count>1; --count)
+    {
+        std::swap(out_indices[0], out_indices[count-1]);
+        std::swap(out_distances_squared[0], out_distances_squared[count-1]);
+        _SiftOctreeHeapDown(out_indices, out_distances_squared, count-1, 0);
+    }
+
+    return num_found;
+}
@@ -2,33 +2,89 @@
 #define OCTREE_H_
 
 #include "magic_math.h"
+#include "morton.h"
+#include "worker_pool.h"
 
+// The most points in a leaf, unless the leaf is a single Morton cell
 #define OCTREE_BIN_SIZE 32
 
-typedef struct _octree_node
+// The subtrees below this level are built in parallel. There are at most
+// 8^OCTREE_SPLIT_LEVEL of them.
+#define OCTREE_SPLIT_LEVEL 2
+#define OCTREE_MAX_SUBTREES 64
+
+// A node of a linear octree. The children of a node are next to each
+// other in the node array, in octant order. As the points are sorted in
+// Morton order, the points of any node are one range of the sorted points.
+typedef struct
 {
-    int count;
-    V3 center;
-    int size;
-
-    union
-    {
-        _octree_node *children[8];
-        V3 points[OCTREE_BIN_SIZE];
-    };
+    uint32_t first_point; // Into Octree::points
+    uint32_t point_count;
+    uint32_t first_child; // Only for nodes with children
+    uint16_t x, y, z;     // The min corner, in Morton cells
+    uint8_t level;        // 0 is the root, which covers all MORTON_CELLS cells
+    uint8_t child_mask;   // The octants that have a child. 0 for leaves
 } OctreeNode;
 
 typedef struct
 {
-    OctreeNode *root;
-    OctreeNode *node_pool;
-    size_t node_pool_size;
-    size_t node_pool_index;
+    OctreeNode *nodes;
+    size_t count;
+    size_t capacity;
+} OctreeNodeList;
+
+typedef struct
+{
+    V3 min;          // The min corner of the cube the tree covers
+    float cell_size; // The size of a Morton cell
+    V3 box_max;      // The max corner of the box of indexed points, from min
+
+    OctreeNodeList nodes; // The root is the first node
+
+    // The points within the box, in Morton order, and the index each of
+    // them had in the points the tree was built from
+    V3 *points;
+    uint32_t *point_indices;
+    size_t num_points;
+
+    // Build state, kept between builds
+    const V3 *input_points;
+    size_t num_input_points;
+    size_t capacity;
+    uint32_t *codes;
+    uint32_t *input_indices;
+    uint32_t *sorted_codes;
+    uint32_t chunk_offsets[MORTON_SORT_TASKS];
+    MortonSortBuffers sort_buffers;
+    uint32_t subtree_roots[OCTREE_MAX_SUBTREES];
+    uint32_t subtree_offsets[OCTREE_MAX_SUBTREES];
+    OctreeNodeList subtrees[OCTREE_MAX_SUBTREES];
+    unsigned int num_subtrees;
 } Octree;
 
-void ResetOctree(Octree *tree, size_t max_num_points, float bounding_size);
-void AddPointsToOctree(V3 *points, size_t num_points, Octree *tree);
-bool CheckBoxCollision(Octree *tree, V3 box_center, V3 box_size);
+// Build the tree over the points on or within the box from box_min to
+// box_max. Points outside the box are left out. The tree is a cube as large
+// as the longest side of the box, with its min corner at box_min. The tree
+// can be rebuilt any number of times, and reuses its memory. The work is
+// split over the worker pool.
+void BuildOctree(Octree *tree, const V3 *points, size_t num_points, V3 box_min, V3 box_max, WorkerPool *workers);
+void FinalizeOctree(Octree *tree);
 
-#endif /* end of include guard: OCTREE_H_ */
+// The points on or within the box or sphere. The Find functions write the
+// indices of up to max_indices of the points, in the points the tree was
+// built from, and return the number of points, which may be more.
+size_t CountPointsInBox(const Octree *tree, V3 box_min, V3 box_max);
+size_t FindPointsInBox(const Octree *tree, V3 box_min, V3 box_max, uint32_t *out_indices, size_t max_indices);
+size_t CountPointsInSphere(const Octree *tree, V3 center, float radius);
+size_t FindPointsInSphere(const Octree *tree, V3 center, float radius, uint32_t *out_indices, size_t max_indices);
 
+// The k points nearest to the point, and no farther away than max_distance.
+// Writes their indices, in the points the tree was built from, and their
+// squared distances, nearest first, and returns how many there are.
+unsigned int FindNearestPoints(const Octree *tree, V3 point, unsigned int k, float max_distance,
+                               uint32_t *out_indices, float *out_distances_squared);
+
+// If more than 3 points are within the box
+bool CheckBoxCollision(const Octree *tree, V3 box_min, V3 box_max);
+
+#endif /* end of include guard: OCTREE_H_ */
@@ -0,0 +1,142 @@
+
+#include "sensor_prefetch.h"
+
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *
+_PrefetchThread(void *userdata)
+{
+    SensorPrefetch *prefetch = (SensorPrefetch *)userdata;
+
+    pthread_mutex_lock(&prefetch->mutex);
+
+    while(true)
+    {
+        // Keep one slot for the frame in use
+        while(prefetch->running && prefetch->num_ready == prefetch->num_slots-1)
+        {
+            pthread_cond_wait(&prefetch->slot_free, &prefetch->mutex);
+        }
+
+        if(!prefetch->running) break;
+
+        unsigned int slot_index = (prefetch->next_slot + prefetch->num_ready) % prefetch->num_slots;
+        PrefetchSlot *slot = &prefetch->slots[slot_index];
+        pthread_mutex_unlock(&prefetch->mutex);
+
+        for(unsigned int i=0; i<prefetch->num_sensors; ++i)
+        {
+            SensorInfo *sensor = &prefetch->sensors[i];
+            const size_t num_color_pixels = sensor->color_stream_info.width * sensor->color_stream_info.height;
+            const size_t num_depth_pixels = sensor->depth_stream_info.width * sensor->depth_stream_info.height;
+
+            // The sensor interface reuses its buffers, so we copy the frames
+            memcpy(slot->color_frames[i], GetSensorColorFrame(sensor), num_color_pixels*sizeof(ColorPixel));
+            memcpy(slot->depth_frames[i], GetSensorDepthFrame(sensor), num_depth_pixels*sizeof(DepthPixel));
+        }
+
+        pthread_mutex_lock(&prefetch->mutex);
+        ++prefetch->num_ready;
+        pthread_cond_signal(&prefetch->frame_ready);
+    }
+
+    pthread_mutex_unlock(&prefetch->mutex);
+
+    return NULL;
+}
+
+void
+StartSensorPrefetch(SensorPrefetch *prefetch, SensorInfo *sensors, unsigned int num_sensors, unsigned int depth)
+{
+    assert(depth > 0);
+    assert(num_sensors <= MAX_PREFETCH_SENSORS);
+
+    prefetch->sensors = sensors;
+    prefetch->num_sensors = num_sensors;
+    prefetch->num_slots = MIN(depth, MAX_PREFETCH_DEPTH) + 1;
+    prefetch->next_slot = 0;
+    prefetch->num_ready = 0;
+
+    for(unsigned int i=0; i<prefetch->num_slots; ++i)
+    {
+        PrefetchSlot *slot = &prefetch->slots[i];
+        for(unsigned int j=0; j<num_sensors; ++j)
+        {
+            SensorInfo *sensor = &sensors[j];
+            slot->color_frames[j] = (ColorPixel *)calloc(sensor->color_stream_info.width * sensor->color_stream_info.height,
+                                                         sizeof(ColorPixel));
+            slot->depth_frames[j] = (DepthPixel *)calloc(sensor->depth_stream_info.width * sensor->depth_stream_info.height,
+                                                         sizeof(DepthPixel));
+            assert(slot->color_frames[j] && slot->depth_frames[j]);
+        }
+    }
+
+    pthread_mutex_init(&prefetch->mutex, NULL);
+    pthread_cond_init(&prefetch->frame_ready, NULL);
+    pthread_cond_init(&prefetch->slot_free, NULL);
+
+    prefetch->running = true;
+    int rc = pthread_create(&prefetch->thread_handle, NULL, &_PrefetchThread, prefetch);
+    assert(rc == 0);
+
+    printf("Prefetching up to %u frames from %u sensors\n", prefetch->num_slots-1, num_sensors);
+}
+
+void
+StopSensorPrefetch(SensorPrefetch *prefetch)
+{
+    if(!prefetch->running) return;
+
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->running = false;
+    pthread_cond_broadcast(&prefetch->slot_free);
+    pthread_mutex_unlock(&prefetch->mutex);
+
+    pthread_join(prefetch->thread_handle, NULL);
+
+    for(unsigned int i=0; i<prefetch->num_slots; ++i)
+    {
+        PrefetchSlot *slot = &prefetch->slots[i];
+        for(unsigned int j=0; j<prefetch->num_sensors; ++j)
+        {
+            free(slot->color_frames[j]);
+            free(slot->depth_frames[j]);
+        }
+    }
+
+    pthread_cond_destroy(&prefetch->slot_free);
+    pthread_cond_destroy(&prefetch->frame_ready);
+    pthread_mutex_destroy(&prefetch->mutex);
+
+    memset(prefetch, 0, sizeof(SensorPrefetch));
+}
+
+void
+GetPrefetchedSensorFrames(SensorPrefetch *prefetch, ColorPixel **color_frames, DepthPixel **depth_frames)
+{
+    pthread_mutex_lock(&prefetch->mutex);
+
+    while(prefetch->num_ready == 0)
+    {
+        pthread_cond_wait(&prefetch->frame_ready, &prefetch->mutex);
+    }
+
+    PrefetchSlot *slot = &prefetch->slots[prefetch->next_slot];
+    prefetch->next_slot = (prefetch->next_slot + 1) % prefetch->num_slots;
+    --prefetch->num_ready;
+
+    // The slot we returned last time is free again
+    pthread_cond_signal(&prefetch->slot_free);
+
+    pthread_mutex_unlock(&prefetch->mutex);
+
+    for(unsigned int i=0; i<prefetch->num_sensors; ++i)
+    {
+        color_frames[i] = slot->color_frames[i];
+        depth_frames[i] = slot->depth_frames[i];
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SENSOR_PREFETCH_H_
+#define SENSOR_PREFETCH_H_
+
+#include "sensor_interface.h"
+#include <pthread.h>
+
+#define MAX_PREFETCH_DEPTH 4
+#define MAX_PREFETCH_SENSORS 8
+
+// One frame from every sensor
+typedef struct
+{
+    ColorPixel *color_frames[MAX_PREFETCH_SENSORS];
+    DepthPixel *depth_frames[MAX_PREFETCH_SENSORS];
+} PrefetchSlot;
+
+// Fetches frames from the sensors on a separate thread, so the next frame
+// is read (and decompressed, for recordings) while the current one is
+// processed. The sensors are read in the same order as a plain loop over
+// GetSensorColorFrame and GetSensorDepthFrame would.
+typedef struct
+{
+    SensorInfo *sensors;
+    unsigned int num_sensors;
+
+    // depth+1 slots: up to depth prefetched frames, and the one in use
+    PrefetchSlot slots[MAX_PREFETCH_DEPTH+1];
+    unsigned int num_slots;
+    unsigned int next_slot;  // The oldest prefetched frame
+    unsigned int num_ready;  // The number of prefetched frames
+
+    pthread_t thread_handle;
+    pthread_mutex_t mutex;
+    pthread_cond_t frame_ready;
+    pthread_cond_t slot_free;
+    bool running;
+} SensorPrefetch;
+
+void StartSensorPrefetch(SensorPrefetch *prefetch, SensorInfo *sensors, unsigned int num_sensors, unsigned int depth);
+void StopSensorPrefetch(SensorPrefetch *prefetch);
+
+// Blocks until the next frame from every sensor is ready. The frames stay
+// valid until the next call.
+void GetPrefetchedSensorFrames(SensorPrefetch *prefetch, ColorPixel **color_frames, DepthPixel **depth_frames);
+
+#endif /* end of include guard: SENSOR_PREFETCH_H_ */
@@ -0,0 +1,23 @@
+#ifndef SIMD_KERNELS_H_
+#define SIMD_KERNELS_H_
+
+// The deprojection, trilinear interpolation, voxel MOG and depth background
+// kernels each have a scalar reference implementation, and SIMD versions
+// picked at runtime by what the CPU supports. The output must not depend on
+// which kernel runs, so every SIMD kernel does the float operations of its
+// scalar reference in the same order, each rounded on its own. They do not
+// use FMA, which rounds a multiply and an add as one, and the library is not
+// built with FMA enabled, so the compiler does not contract the scalar code
+// either. The helpers below are the scalar operations that have to be
+// written a certain way to round like their SIMD counterparts.
+
+// Clamp x to [min, max] the way _mm256_min_ps(_mm256_max_ps(x, min), max)
+// does: NaN becomes min, and -0.0f becomes min when min is 0.0f
+static inline float
+KernelClamp(float x, float min, float max)
+{
+    x = (x > min) ? x : min;
+    return (x < max) ? x : max;
+}
+
+#endif /* end of include guard: SIMD_KERNELS_H_ */
@@ -0,0 +1,90 @@
+
+#include "summed_volume.h"
+
+void
+SumVoxelPlanes(VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+               const Voxel *voxels, const uint32_t *foreground_counts,
+               uint32_t min_foreground_points, unsigned int first_z, unsigned int end_z)
+{
+    for(unsigned int z=first_z; z<end_z; ++z)
+    {
+        // The plane of voxel z is at z+1 in the table. Row and column 0
+        // are the empty sums.
+        VoxelCountSum *plane = &volume[SUMMED_VOLUME_INDEX(grid, 0, 0, z+1)];
+        for(unsigned int x=0; x<SUMMED_VOLUME_X(grid); ++x)
+        {
+            plane[x] = (VoxelCountSum){};
+        }
+
+        for(unsigned int y=0; y<grid->num_voxels_y; ++y)
+        {
+            const Voxel *voxel_row = &voxels[MagicMotion_VoxelIndex(grid, 0, y, z)];
+            const uint32_t *foreground_row = &foreground_counts[MagicMotion_VoxelIndex(grid, 0, y, z)];
+            const VoxelCountSum *above = &plane[y*SUMMED_VOLUME_X(grid)];
+            VoxelCountSum *row = &plane[(y+1)*SUMMED_VOLUME_X(grid)];
+
+            uint32_t point_count = 0;
+            uint32_t foreground_count = 0;
+            row[0] = (VoxelCountSum){};
+            for(unsigned int x=0; x<grid->num_voxels_x; ++x)
+            {
+                const uint32_t points = voxel_row[x].point_count;
+                point_count += points;
+                foreground_count += (points >= min_foreground_points) ? foreground_row[x] : 0;
+
+                row[x+1].point_count = above[x+1].point_count + point_count;
+                row[x+1].foreground_count = above[x+1].foreground_count + foreground_count;
+            }
+        }
+    }
+}
+
+void
+SumVolumeRows(VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+              unsigned int first_y, unsigned int end_y)
+{
+    // Plane 0 is the empty sums
+    for(unsigned int y=first_y; y<end_y; ++y)
+    {
+        VoxelCountSum *row = &volume[SUMMED_VOLUME_INDEX(grid, 0, y, 0)];
+        for(unsigned int x=0; x<SUMMED_VOLUME_X(grid); ++x)
+        {
+            row[x] = (VoxelCountSum){};
+        }
+
+        for(unsigned int z=1; z<SUMMED_VOLUME_Z(grid); ++z)
+        {
+            const VoxelCountSum *below = &volume[SUMMED_VOLUME_INDEX(grid, 0, y, z-1)];
+            VoxelCountSum *sums = &volume[SUMMED_VOLUME_INDEX(grid, 0, y, z)];
+            for(unsigned int x=0; x<SUMMED_VOLUME_X(grid); ++x)
+            {
+                sums[x].point_count += below[x].point_count;
+                sums[x].foreground_count += below[x].foreground_count;
+            }
+        }
+    }
+}
+
+VoxelCountSum
+SumVolumeBox(const VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+             unsigned int x0, unsigned int y0, unsigned int z0,
+             unsigned int x1, unsigned int y1, unsigned int z1)
+{
+    const VoxelCountSum a = volume[SUMMED_VOLUME_INDEX(grid, x1, y1, z1)];
+    const VoxelCountSum b = volume[SUMMED_VOLUME_INDEX(grid, x0, y1, z1)];
+    const VoxelCountSum c = volume[SUMMED_VOLUME_INDEX(grid, x1, y0, z1)];
+    const VoxelCountSum d = volume[SUMMED_VOLUME_INDEX(grid, x1, y1, z0)];
+    const VoxelCountSum e = volume[SUMMED_VOLUME_INDEX(grid, x0, y0, z1)];
+    const VoxelCountSum f = volume[SUMMED_VOLUME_INDEX(grid, x0, y1, z0)];
+    const VoxelCountSum g = volume[SUMMED_VOLUME_INDEX(grid, x1, y0, z0)];
+    const VoxelCountSum h = volume[SUMMED_VOLUME_INDEX(grid, x0, y0, z0)];
+
+    // Inclusion-exclusion. The unsigned arithmetic wraps, but the result
+    // is always in range.
+    VoxelCountSum result;
+    result.point_count = a.point_count - b.point_count - c.point_count - d.point_count +
+                         e.point_count + f.point_count + g.point_count - h.point_count;
+    result.foreground_count = a.foreground_count - b.foreground_count - c.foreground_count - d.foreground_count +
+                              e.foreground_count + f.foreground_count + g.foreground_count - h.foreground_count;
+    return result;
+}
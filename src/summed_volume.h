@@ -0,0 +1,38 @@
+#ifndef SUMMED_VOLUME_H_
+#define SUMMED_VOLUME_H_
+
+#include <stdint.h>
+#include "magic_motion.h"
+
+// A summed volume table of the voxel grid: the entry at (x, y, z) holds the
+// sums of all the voxels below x, y and z. It has one more entry than the
+// grid along each axis, so the sums of any box of voxels are 8 lookups.
+#define SUMMED_VOLUME_X(grid) ((grid)->num_voxels_x+1)
+#define SUMMED_VOLUME_Y(grid) ((grid)->num_voxels_y+1)
+#define SUMMED_VOLUME_Z(grid) ((grid)->num_voxels_z+1)
+#define SUMMED_VOLUME_SIZE(grid) ((size_t)SUMMED_VOLUME_X(grid)*SUMMED_VOLUME_Y(grid)*SUMMED_VOLUME_Z(grid))
+#define SUMMED_VOLUME_INDEX(grid, x, y, z) ((x) + (y)*SUMMED_VOLUME_X(grid) + (z)*SUMMED_VOLUME_X(grid)*SUMMED_VOLUME_Y(grid))
+
+typedef struct
+{
+    uint32_t point_count;
+    uint32_t foreground_count;
+} VoxelCountSum;
+
+// The table is built in two steps, each of which can be split over threads:
+// First the voxel planes [first_z, end_z) are summed along x and y, then
+// the rows [first_y, end_y) of the table are summed along z.
+// foreground_counts is the number of foreground points in each voxel. Voxels
+// with fewer than min_foreground_points points count as all background.
+void SumVoxelPlanes(VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+                    const Voxel *voxels, const uint32_t *foreground_counts,
+                    uint32_t min_foreground_points, unsigned int first_z, unsigned int end_z);
+void SumVolumeRows(VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+                   unsigned int first_y, unsigned int end_y);
+
+// The sums of the voxels in [x0, x1) x [y0, y1) x [z0, z1)
+VoxelCountSum SumVolumeBox(const VoxelCountSum *volume, const MagicMotionVoxelGrid *grid,
+                           unsigned int x0, unsigned int y0, unsigned int z0,
+                           unsigned int x1, unsigned int y1, unsigned int z1);
+
+#endif /* end of include guard: SUMMED_VOLUME_H_ */
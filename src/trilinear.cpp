@@ -0,0 +1,260 @@
+
+#include "trilinear.h"
+#include "simd_kernels.h"
+
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRILINEAR_X86 1
+#include <immintrin.h>
+#else
+#define TRILINEAR_X86 0
+#endif
+
+// Voxel space has the voxel centers on whole coordinates, so the cell of a
+// point is its coordinates rounded down, and the fractions are the weights.
+// The cell is clamped so its +1 neighbours are always in the grid.
+// Set by InitializeTrilinear.
+static struct
+{
+    V3 min;
+    float world_to_voxel;
+    float max_x, max_y, max_z;
+    int max_x0, max_y0, max_z0;
+
+    // Neighbour offsets in the voxel array
+    int stride_y;
+    int stride_z;
+
+    const VoxelBrickMap *bricks; // NULL for dense grids
+} _grid;
+
+#define STRIDE_X 1
+#define STRIDE_Y _grid.stride_y
+#define STRIDE_Z _grid.stride_z
+
+TrilinearlyInterpolateFunc TrilinearlyInterpolate = &TrilinearlyInterpolateScalar;
+
+void
+TrilinearlyInterpolateScalar(const V3 *points, unsigned int count,
+                             const float *voxel_values, float *out_values)
+{
+    for(unsigned int i=0; i<count; ++i)
+    {
+        const V3 point = points[i];
+        const float u = KernelClamp((point.x - _grid.min.x) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_x);
+        const float v = KernelClamp((point.y - _grid.min.y) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_y);
+        const float w = KernelClamp((point.z - _grid.min.z) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_z);
+
+        const int x0 = MIN((int)u, _grid.max_x0);
+        const int y0 = MIN((int)v, _grid.max_y0);
+        const int z0 = MIN((int)w, _grid.max_z0);
+        const float fx = u - (float)x0;
+        const float fy = v - (float)y0;
+        const float fz = w - (float)z0;
+
+        const float *c = &voxel_values[x0 + y0*STRIDE_Y + z0*STRIDE_Z];
+        const float c00 = c[0]                   + fx * (c[STRIDE_X]                   - c[0]);
+        const float c10 = c[STRIDE_Y]            + fx * (c[STRIDE_Y+STRIDE_X]          - c[STRIDE_Y]);
+        const float c01 = c[STRIDE_Z]            + fx * (c[STRIDE_Z+STRIDE_X]          - c[STRIDE_Z]);
+        const float c11 = c[STRIDE_Z+STRIDE_Y]   + fx * (c[STRIDE_Z+STRIDE_Y+STRIDE_X] - c[STRIDE_Z+STRIDE_Y]);
+        const float c0 = c00 + fy * (c10 - c00);
+        const float c1 = c01 + fy * (c11 - c01);
+        out_values[i] = c0 + fz * (c1 - c0);
+    }
+}
+
+// The value of a voxel of a sparse grid. Voxels without storage have never
+// had points, like the voxels of a dense grid that are still 0.
+static inline float
+_SparseVoxelValue(const float *voxel_values, int x, int y, int z)
+{
+    const uint32_t voxel = FindBrickVoxel(_grid.bricks, x, y, z);
+    return (voxel == NO_BRICK_VOXEL) ? 0.0f : voxel_values[voxel];
+}
+
+// Same as TrilinearlyInterpolateScalar, with the voxels looked up in the
+// bricks of a sparse grid
+static void
+_TrilinearlyInterpolateSparse(const V3 *points, unsigned int count,
+                              const float *voxel_values, float *out_values)
+{
+    const int brick_mask = VOXEL_BRICK_SIZE-1;
+
+    for(unsigned int i=0; i<count; ++i)
+    {
+        const V3 point = points[i];
+        const float u = KernelClamp((point.x - _grid.min.x) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_x);
+        const float v = KernelClamp((point.y - _grid.min.y) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_y);
+        const float w = KernelClamp((point.z - _grid.min.z) * _grid.world_to_voxel - 0.5f, 0.0f, _grid.max_z);
+
+        const int x0 = MIN((int)u, _grid.max_x0);
+        const int y0 = MIN((int)v, _grid.max_y0);
+        const int z0 = MIN((int)w, _grid.max_z0);
+        const float fx = u - (float)x0;
+        const float fy = v - (float)y0;
+        const float fz = w - (float)z0;
+
+        float c000, c100, c010, c110, c001, c101, c011, c111;
+        if((x0 & brick_mask) != brick_mask && (y0 & brick_mask) != brick_mask && (z0 & brick_mask) != brick_mask)
+        {
+            // The cell is within one brick, which has the same layout as a
+            // dense grid of VOXEL_BRICK_SIZE^3 voxels
+            const uint32_t base = FindBrickVoxel(_grid.bricks, x0, y0, z0);
+            if(base == NO_BRICK_VOXEL)
+            {
+                out_values[i] = 0.0f;
+                continue;
+            }
+
+            const int stride_y = VOXEL_BRICK_SIZE;
+            const int stride_z = VOXEL_BRICK_SIZE*VOXEL_BRICK_SIZE;
+            const float *c = &voxel_values[base];
+            c000 = c[0];
+            c100 = c[STRIDE_X];
+            c010 = c[stride_y];
+            c110 = c[stride_y+STRIDE_X];
+            c001 = c[stride_z];
+            c101 = c[stride_z+STRIDE_X];
+            c011 = c[stride_z+stride_y];
+            c111 = c[stride_z+stride_y+STRIDE_X];
+        }
+        else
+        {
+            c000 = _SparseVoxelValue(voxel_values, x0,   y0,   z0);
+            c100 = _SparseVoxelValue(voxel_values, x0+1, y0,   z0);
+            c010 = _SparseVoxelValue(voxel_values, x0,   y0+1, z0);
+            c110 = _SparseVoxelValue(voxel_values, x0+1, y0+1, z0);
+            c001 = _SparseVoxelValue(voxel_values, x0,   y0,   z0+1);
+            c101 = _SparseVoxelValue(voxel_values, x0+1, y0,   z0+1);
+            c011 = _SparseVoxelValue(voxel_values, x0,   y0+1, z0+1);
+            c111 = _SparseVoxelValue(voxel_values, x0+1, y0+1, z0+1);
+        }
+
+        const float c00 = c000 + fx * (c100 - c000);
+        const float c10 = c010 + fx * (c110 - c010);
+        const float c01 = c001 + fx * (c101 - c001);
+        const float c11 = c011 + fx * (c111 - c011);
+        const float c0 = c00 + fy * (c10 - c00);
+        const float c1 = c01 + fy * (c11 - c01);
+        out_values[i] = c0 + fz * (c1 - c0);
+    }
+}
+
+#if TRILINEAR_X86
+
+__attribute__((target("avx2")))
+static inline __m256
+_Lerp8(__m256 a, __m256 b, __m256 t)
+{
+    return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+// Same as TrilinearlyInterpolateScalar, 8 points at a time, with the same
+// rounding (see simd_kernels.h)
+__attribute__((target("avx2")))
+static void
+_TrilinearlyInterpolateAVX2(const V3 *points, unsigned int count,
+                            const float *voxel_values, float *out_values)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 world_to_voxel = _mm256_set1_ps(_grid.world_to_voxel);
+    const __m256 min_x = _mm256_set1_ps(_grid.min.x);
+    const __m256 min_y = _mm256_set1_ps(_grid.min.y);
+    const __m256 min_z = _mm256_set1_ps(_grid.min.z);
+    const __m256 max_x = _mm256_set1_ps(_grid.max_x);
+    const __m256 max_y = _mm256_set1_ps(_grid.max_y);
+    const __m256 max_z = _mm256_set1_ps(_grid.max_z);
+    const __m256i max_x0 = _mm256_set1_epi32(_grid.max_x0);
+    const __m256i max_y0 = _mm256_set1_epi32(_grid.max_y0);
+    const __m256i max_z0 = _mm256_set1_epi32(_grid.max_z0);
+    const __m256i stride_y = _mm256_set1_epi32(STRIDE_Y);
+    const __m256i stride_z = _mm256_set1_epi32(STRIDE_Z);
+
+    // The V3s are packed, so point i starts at float 3*i
+    const __m256i point_offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+
+    unsigned int i = 0;
+    for(; i+8<=count; i+=8)
+    {
+        const float *p = (const float *)(points + i);
+        const __m256 x = _mm256_i32gather_ps(p,     point_offsets, 4);
+        const __m256 y = _mm256_i32gather_ps(p + 1, point_offsets, 4);
+        const __m256 z = _mm256_i32gather_ps(p + 2, point_offsets, 4);
+
+        const __m256 u = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(x, min_x), world_to_voxel), half), zero), max_x);
+        const __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(y, min_y), world_to_voxel), half), zero), max_y);
+        const __m256 w = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(z, min_z), world_to_voxel), half), zero), max_z);
+
+        const __m256i x0 = _mm256_min_epi32(_mm256_cvttps_epi32(u), max_x0);
+        const __m256i y0 = _mm256_min_epi32(_mm256_cvttps_epi32(v), max_y0);
+        const __m256i z0 = _mm256_min_epi32(_mm256_cvttps_epi32(w), max_z0);
+        const __m256 fx = _mm256_sub_ps(u, _mm256_cvtepi32_ps(x0));
+        const __m256 fy = _mm256_sub_ps(v, _mm256_cvtepi32_ps(y0));
+        const __m256 fz = _mm256_sub_ps(w, _mm256_cvtepi32_ps(z0));
+
+        const __m256i base = _mm256_add_epi32(_mm256_add_epi32(x0, _mm256_mullo_epi32(y0, stride_y)),
+                                              _mm256_mullo_epi32(z0, stride_z));
+
+        // The neighbours are at fixed offsets from the base cell
+        const __m256 c000 = _mm256_i32gather_ps(voxel_values,                                base, 4);
+        const __m256 c100 = _mm256_i32gather_ps(voxel_values + STRIDE_X,                     base, 4);
+        const __m256 c010 = _mm256_i32gather_ps(voxel_values + STRIDE_Y,                     base, 4);
+        const __m256 c110 = _mm256_i32gather_ps(voxel_values + STRIDE_Y+STRIDE_X,            base, 4);
+        const __m256 c001 = _mm256_i32gather_ps(voxel_values + STRIDE_Z,                     base, 4);
+        const __m256 c101 = _mm256_i32gather_ps(voxel_values + STRIDE_Z+STRIDE_X,            base, 4);
+        const __m256 c011 = _mm256_i32gather_ps(voxel_values + STRIDE_Z+STRIDE_Y,            base, 4);
+        const __m256 c111 = _mm256_i32gather_ps(voxel_values + STRIDE_Z+STRIDE_Y+STRIDE_X,   base, 4);
+
+        const __m256 c00 = _Lerp8(c000, c100, fx);
+        const __m256 c10 = _Lerp8(c010, c110, fx);
+        const __m256 c01 = _Lerp8(c001, c101, fx);
+        const __m256 c11 = _Lerp8(c011, c111, fx);
+        const __m256 c0 = _Lerp8(c00, c10, fy);
+        const __m256 c1 = _Lerp8(c01, c11, fy);
+        _mm256_storeu_ps(out_values + i, _Lerp8(c0, c1, fz));
+    }
+
+    // The last few points
+    TrilinearlyInterpolateScalar(points + i, count - i, voxel_values, out_values + i);
+}
+
+#endif
+
+void
+InitializeTrilinear(const MagicMotionVoxelGrid *grid, const VoxelBrickMap *bricks)
+{
+    // Interpolation needs two voxels along each axis
+    assert(grid->num_voxels_x > 1 && grid->num_voxels_y > 1 && grid->num_voxels_z > 1);
+
+    _grid.min = grid->origin;
+    _grid.world_to_voxel = grid->voxels_per_unit;
+    _grid.max_x = (float)(grid->num_voxels_x-1);
+    _grid.max_y = (float)(grid->num_voxels_y-1);
+    _grid.max_z = (float)(grid->num_voxels_z-1);
+    _grid.max_x0 = (int)grid->num_voxels_x-2;
+    _grid.max_y0 = (int)grid->num_voxels_y-2;
+    _grid.max_z0 = (int)grid->num_voxels_z-2;
+    _grid.stride_y = (int)grid->num_voxels_x;
+    _grid.stride_z = (int)(grid->num_voxels_x*grid->num_voxels_y);
+    _grid.bricks = bricks;
+
+    if(bricks)
+    {
+        TrilinearlyInterpolate = &_TrilinearlyInterpolateSparse;
+        return;
+    }
+
+    TrilinearlyInterpolate = &TrilinearlyInterpolateScalar;
+
+#if TRILINEAR_X86
+    static_assert(sizeof(V3) == 3*sizeof(float), "The AVX2 kernel loads points as packed floats");
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        TrilinearlyInterpolate = &_TrilinearlyInterpolateAVX2;
+    }
+#endif
+}
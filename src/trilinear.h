@@ -0,0 +1,29 @@
+#ifndef TRILINEAR_H_
+#define TRILINEAR_H_
+
+#include "magic_math.h"
+#include "magic_motion.h"
+#include "voxel_bricks.h"
+
+// Interpolate a per-voxel value, like the background model, at count
+// points. The voxel values are at the voxel centers. Outside the centers of
+// the outermost voxels, the value of the closest voxel is used, so any
+// point gives a valid result.
+typedef void (*TrilinearlyInterpolateFunc)(const V3 *points, unsigned int count,
+                                           const float *voxel_values,
+                                           float *out_values);
+
+// Sets the voxel grid the values are in, and picks the fastest kernel the
+// CPU supports. All kernels give bit-identical output. bricks is the
+// storage of sparse grids, and NULL for dense grids. The voxels of a sparse
+// grid without storage count as 0.
+void InitializeTrilinear(const MagicMotionVoxelGrid *grid, const VoxelBrickMap *bricks);
+
+// Set by InitializeTrilinear
+extern TrilinearlyInterpolateFunc TrilinearlyInterpolate;
+
+// Reference implementation, always available
+void TrilinearlyInterpolateScalar(const V3 *points, unsigned int count,
+                                  const float *voxel_values, float *out_values);
+
+#endif /* end of include guard: TRILINEAR_H_ */
@@ -0,0 +1,129 @@
+
+#include "voxel_bricks.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void
+InitializeVoxelBrickMap(VoxelBrickMap *map, uint32_t max_bricks)
+{
+    // The voxel indices must fit in 32 bits, with NO_BRICK_VOXEL to spare
+    assert(max_bricks > 0 && max_bricks < UINT32_MAX / VOXEL_BRICK_VOXELS);
+
+    unsigned int table_bits = 1;
+    while((1u << table_bits) < 2*max_bricks) ++table_bits;
+    const uint32_t table_size = 1u << table_bits;
+
+    map->table_keys = (uint32_t *)malloc(table_size * sizeof(uint32_t));
+    map->table_slots = (uint32_t *)malloc(table_size * sizeof(uint32_t));
+    map->brick_keys = (uint32_t *)malloc(max_bricks * sizeof(uint32_t));
+    assert(map->table_keys && map->table_slots && map->brick_keys);
+
+    for(uint32_t i=0; i<table_size; ++i) map->table_keys[i] = NO_BRICK_VOXEL;
+
+    map->table_shift = 32 - table_bits;
+    map->max_bricks = max_bricks;
+    map->num_bricks = 0;
+    map->reported_full = false;
+    pthread_mutex_init(&map->add_mutex, NULL);
+}
+
+void
+FinalizeVoxelBrickMap(VoxelBrickMap *map)
+{
+    free(map->table_keys);
+    free(map->table_slots);
+    free(map->brick_keys);
+    pthread_mutex_destroy(&map->add_mutex);
+    *map = (VoxelBrickMap){};
+}
+
+// The first table entry to probe for a key. Fibonacci hashing: the top
+// bits of the product depend on all the bits of the key.
+static inline uint32_t
+_HashBrickKey(const VoxelBrickMap *map, uint32_t key)
+{
+    return (key * 2654435769u) >> map->table_shift;
+}
+
+static inline uint32_t
+_FindBrickSlot(const VoxelBrickMap *map, uint32_t key)
+{
+    const uint32_t mask = UINT32_MAX >> map->table_shift;
+    for(uint32_t i=_HashBrickKey(map, key); ; i=(i+1) & mask)
+    {
+        // Acquire, so the slot is read after the key is seen
+        const uint32_t entry = __atomic_load_n(&map->table_keys[i], __ATOMIC_ACQUIRE);
+        if(entry == key) return map->table_slots[i];
+
+        // The table is never full, so every probe ends at an empty entry
+        if(entry == NO_BRICK_VOXEL) return NO_BRICK_VOXEL;
+    }
+}
+
+static uint32_t
+_AddBrick(VoxelBrickMap *map, uint32_t key)
+{
+    pthread_mutex_lock(&map->add_mutex);
+
+    // Another thread may have added it since we looked
+    uint32_t slot = _FindBrickSlot(map, key);
+    if(slot == NO_BRICK_VOXEL && map->num_bricks < map->max_bricks)
+    {
+        slot = map->num_bricks;
+        map->brick_keys[slot] = key;
+
+        const uint32_t mask = UINT32_MAX >> map->table_shift;
+        uint32_t i = _HashBrickKey(map, key);
+        while(map->table_keys[i] != NO_BRICK_VOXEL) i = (i+1) & mask;
+
+        map->table_slots[i] = slot;
+        __atomic_store_n(&map->table_keys[i], key, __ATOMIC_RELEASE);
+        __atomic_store_n(&map->num_bricks, slot+1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&map->add_mutex);
+    return slot;
+}
+
+static inline uint32_t
+_BrickVoxelIndex(uint32_t slot, uint32_t x, uint32_t y, uint32_t z)
+{
+    const uint32_t mask = VOXEL_BRICK_SIZE-1;
+    return slot*VOXEL_BRICK_VOXELS +
+           (x & mask) + ((y & mask) << VOXEL_BRICK_SHIFT) + ((z & mask) << 2*VOXEL_BRICK_SHIFT);
+}
+
+uint32_t
+FindBrickVoxel(const VoxelBrickMap *map, uint32_t x, uint32_t y, uint32_t z)
+{
+    const uint32_t key = VOXEL_BRICK_KEY(x >> VOXEL_BRICK_SHIFT, y >> VOXEL_BRICK_SHIFT, z >> VOXEL_BRICK_SHIFT);
+    const uint32_t slot = _FindBrickSlot(map, key);
+    if(slot == NO_BRICK_VOXEL) return NO_BRICK_VOXEL;
+    return _BrickVoxelIndex(slot, x, y, z);
+}
+
+uint32_t
+AddBrickVoxel(VoxelBrickMap *map, uint32_t x, uint32_t y, uint32_t z)
+{
+    const uint32_t key = VOXEL_BRICK_KEY(x >> VOXEL_BRICK_SHIFT, y >> VOXEL_BRICK_SHIFT, z >> VOXEL_BRICK_SHIFT);
+    uint32_t slot = _FindBrickSlot(map, key);
+    if(slot == NO_BRICK_VOXEL)
+    {
+        // Once the pool is full, new bricks are turned away without locking
+        if(__atomic_load_n(&map->num_bricks, __ATOMIC_ACQUIRE) < map->max_bricks) slot = _AddBrick(map, key);
+
+        if(slot == NO_BRICK_VOXEL)
+        {
+            if(!__atomic_exchange_n(&map->reported_full, true, __ATOMIC_RELAXED))
+            {
+                fprintf(stderr, "WARNING: All %u voxel bricks are in use. Points in new bricks are left out of the voxel grid.\n",
+                        map->max_bricks);
+            }
+            return NO_BRICK_VOXEL;
+        }
+    }
+
+    return _BrickVoxelIndex(slot, x, y, z);
+}
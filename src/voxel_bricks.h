@@ -0,0 +1,44 @@
+#ifndef VOXEL_BRICKS_H_
+#define VOXEL_BRICKS_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "magic_motion.h"
+
+// The storage of sparse voxel grids. The bricks get slots in a pool of
+// max_bricks, in the order they are first added, and are found through an
+// open addressing hash table of their VOXEL_BRICK_KEYs. Bricks are never
+// removed, so the voxel indices stay valid for the lifetime of the map.
+#define NO_BRICK_VOXEL UINT32_MAX
+
+typedef struct
+{
+    // The hash table has at least twice as many entries as the pool, so
+    // the probe sequences stay short. Empty entries have the key
+    // NO_BRICK_VOXEL. The keys are written last, so finding a key means its
+    // slot is ready.
+    uint32_t *table_keys;
+    uint32_t *table_slots;
+    unsigned int table_shift; // 32 - log2(table size)
+
+    uint32_t *brick_keys;     // The key of the brick in each slot
+    uint32_t max_bricks;
+    uint32_t num_bricks;      // Atomic
+
+    // Serializes adding bricks. Finding bricks does not lock.
+    pthread_mutex_t add_mutex;
+    bool reported_full;       // Atomic. The pool being full is reported once
+} VoxelBrickMap;
+
+void InitializeVoxelBrickMap(VoxelBrickMap *map, uint32_t max_bricks);
+void FinalizeVoxelBrickMap(VoxelBrickMap *map);
+
+// The index of the voxel at the voxel grid coords, or NO_BRICK_VOXEL if its
+// brick has no slot
+uint32_t FindBrickVoxel(const VoxelBrickMap *map, uint32_t x, uint32_t y, uint32_t z);
+
+// The same, giving the brick a slot if it has none. NO_BRICK_VOXEL if the
+// pool is full. Safe to call from any number of threads.
+uint32_t AddBrickVoxel(VoxelBrickMap *map, uint32_t x, uint32_t y, uint32_t z);
+
+#endif /* end of include guard: VOXEL_BRICKS_H_ */
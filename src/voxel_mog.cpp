@@ -0,0 +1,493 @@
+
+#include "voxel_mog.h"
+
+#include "utils.h"
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define VOXEL_MOG_X86 1
+#include <immintrin.h>
+#else
+#define VOXEL_MOG_X86 0
+#endif
+
+// How fast the model adapts. About 1/(number of updates to remember)
+#define MOG_LEARNING_RATE 0.005f
+
+// An observation matches a component if it is closer than this, in
+// (squared) standard deviations
+#define MOG_MATCH_DISTANCE2 (3.0f*3.0f)
+
+// The weight at which a component is fully trusted to be background
+#define MOG_BACKGROUND_WEIGHT 0.8f
+
+// New components start out with a standard deviation of this fraction of
+// the point count, and 30 levels in each color channel
+#define MOG_INITIAL_COUNT_DEVIATION 0.5f
+#define MOG_INITIAL_COLOR_VARIANCE (30.0f*30.0f)
+
+// Voxels are decayed until their background probability falls below this,
+// and then it is set to 0
+#define MOG_MIN_BACKGROUND 0.01f
+
+#define MOG_MIN_COUNT_VARIANCE 1.0f
+#define MOG_MIN_COLOR_VARIANCE (4.0f*4.0f)
+
+// (1-MOG_LEARNING_RATE)^n for n missed updates. The last entry is 0, so
+// a voxel that has been empty for longer than the table resets its model.
+#define MOG_DECAY_TABLE_SIZE 4096
+static float _decay_table[MOG_DECAY_TABLE_SIZE];
+
+// Update the voxels given by block_masks in the blocks in block_indices
+typedef void (*UpdateVoxelMOGFunc)(VoxelMOG *mog, const Voxel *voxels,
+                                   const uint32_t *block_indices, unsigned int num_blocks,
+                                   float *background_model);
+
+static UpdateVoxelMOGFunc _update_kernel;
+
+// Update voxel i, which is lane l of block
+static inline void
+_UpdateVoxelMOGLane(VoxelMOGBlock *block, int l, const Voxel *voxels, uint32_t i,
+                    uint32_t num_updates, float *background_model)
+{
+    const float point_count = (float)voxels[i].point_count;
+    const float red = (float)voxels[i].color.r;
+    const float green = (float)voxels[i].color.g;
+    const float blue = (float)voxels[i].color.b;
+
+    // Catch up on the empty observations since the last update
+    const uint32_t missed = num_updates - block->last_updates[l] - 1;
+    const float decay = _decay_table[MIN(missed, MOG_DECAY_TABLE_SIZE-1)];
+
+    float weights[MOG_NUM_COMPONENTS];
+    for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+    {
+        weights[k] = block->weights[k][l] * decay;
+    }
+
+    // Find the closest matching component
+    int match = -1;
+    float best_distance = MOG_MATCH_DISTANCE2;
+    for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+    {
+        const float dc = point_count - block->count_means[k][l];
+        const float dr = red - block->red_means[k][l];
+        const float dg = green - block->green_means[k][l];
+        const float db = blue - block->blue_means[k][l];
+        const float distance = dc*dc / block->count_variances[k][l] +
+                               (dr*dr + dg*dg + db*db) / block->color_variances[k][l];
+
+        if(weights[k] > 0.0f && distance < best_distance)
+        {
+            best_distance = distance;
+            match = k;
+        }
+    }
+
+    const bool is_new = (match < 0);
+    if(is_new)
+    {
+        // Replace the weakest component. Its weight goes to being empty.
+        match = 0;
+        for(int k=1; k<MOG_NUM_COMPONENTS; ++k)
+        {
+            if(weights[k] < weights[match]) match = k;
+        }
+
+        const float deviation = point_count * MOG_INITIAL_COUNT_DEVIATION;
+        weights[match] = 0.0f;
+        block->count_means[match][l] = point_count;
+        block->count_variances[match][l] = deviation*deviation + MOG_MIN_COUNT_VARIANCE;
+        block->red_means[match][l] = red;
+        block->green_means[match][l] = green;
+        block->blue_means[match][l] = blue;
+        block->color_variances[match][l] = MOG_INITIAL_COLOR_VARIANCE;
+    }
+
+    for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+    {
+        weights[k] = weights[k] * (1.0f - MOG_LEARNING_RATE);
+    }
+    weights[match] = weights[match] + MOG_LEARNING_RATE;
+
+    if(!is_new)
+    {
+        const float rho = MIN(1.0f, MOG_LEARNING_RATE / weights[match]);
+
+        float count_mean = block->count_means[match][l];
+        count_mean = count_mean + rho * (point_count - count_mean);
+        const float dc = point_count - count_mean;
+        float count_variance = block->count_variances[match][l];
+        count_variance = count_variance + rho * (dc*dc - count_variance);
+
+        float red_mean = block->red_means[match][l];
+        float green_mean = block->green_means[match][l];
+        float blue_mean = block->blue_means[match][l];
+        red_mean = red_mean + rho * (red - red_mean);
+        green_mean = green_mean + rho * (green - green_mean);
+        blue_mean = blue_mean + rho * (blue - blue_mean);
+        const float dr = red - red_mean;
+        const float dg = green - green_mean;
+        const float db = blue - blue_mean;
+        float color_variance = block->color_variances[match][l];
+        color_variance = color_variance + rho * ((dr*dr + dg*dg + db*db) / 3.0f - color_variance);
+
+        block->count_means[match][l] = count_mean;
+        block->count_variances[match][l] = MAX(count_variance, MOG_MIN_COUNT_VARIANCE);
+        block->red_means[match][l] = red_mean;
+        block->green_means[match][l] = green_mean;
+        block->blue_means[match][l] = blue_mean;
+        block->color_variances[match][l] = MAX(color_variance, MOG_MIN_COLOR_VARIANCE);
+    }
+
+    for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+    {
+        block->weights[k][l] = weights[k];
+    }
+
+    block->last_updates[l] = num_updates;
+
+    // A component that explains the voxel most of the time is background.
+    // New components are foreground until they have been seen for a while.
+    background_model[i] = MIN(1.0f, weights[match] / MOG_BACKGROUND_WEIGHT);
+}
+
+static void
+_UpdateVoxelMOGScalar(VoxelMOG *mog, const Voxel *voxels,
+                      const uint32_t *block_indices, unsigned int num_blocks,
+                      float *background_model)
+{
+    for(unsigned int n=0; n<num_blocks; ++n)
+    {
+        const uint32_t block_index = block_indices[n];
+        const uint8_t mask = mog->block_masks[block_index];
+
+        for(int l=0; l<MOG_BLOCK_SIZE; ++l)
+        {
+            if(mask & (1 << l))
+            {
+                _UpdateVoxelMOGLane(&mog->blocks[block_index], l, voxels,
+                                    block_index*MOG_BLOCK_SIZE + l,
+                                    mog->num_updates, background_model);
+            }
+        }
+    }
+}
+
+#if VOXEL_MOG_X86
+
+// Same as _UpdateVoxelMOGScalar, for a whole block at a time, with the same
+// rounding (see simd_kernels.h). The voxels that are not occupied are
+// computed too, but not stored.
+__attribute__((target("avx2")))
+static void
+_UpdateVoxelMOGAVX2(VoxelMOG *mog, const Voxel *voxels,
+                    const uint32_t *block_indices, unsigned int num_blocks,
+                    float *background_model)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 learning_rate = _mm256_set1_ps(MOG_LEARNING_RATE);
+    const __m256 keep_rate = _mm256_set1_ps(1.0f - MOG_LEARNING_RATE);
+    const __m256 match_distance = _mm256_set1_ps(MOG_MATCH_DISTANCE2);
+    const __m256 background_weight = _mm256_set1_ps(MOG_BACKGROUND_WEIGHT);
+    const __m256 initial_deviation = _mm256_set1_ps(MOG_INITIAL_COUNT_DEVIATION);
+    const __m256 initial_color_variance = _mm256_set1_ps(MOG_INITIAL_COLOR_VARIANCE);
+    const __m256 min_count_variance = _mm256_set1_ps(MOG_MIN_COUNT_VARIANCE);
+    const __m256 min_color_variance = _mm256_set1_ps(MOG_MIN_COLOR_VARIANCE);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256i last_decay = _mm256_set1_epi32(MOG_DECAY_TABLE_SIZE-1);
+    const __m256i num_updates = _mm256_set1_epi32((int)mog->num_updates);
+    const __m256i previous_update = _mm256_set1_epi32((int)(mog->num_updates - 1));
+
+    for(unsigned int n=0; n<num_blocks; ++n)
+    {
+        const uint32_t block_index = block_indices[n];
+        const uint8_t mask = mog->block_masks[block_index];
+        VoxelMOGBlock *block = &mog->blocks[block_index];
+
+        const __m256i active_bits = _mm256_and_si256(_mm256_set1_epi32(mask), lane_bits);
+        const __m256i active = _mm256_cmpeq_epi32(active_bits, lane_bits);
+        const __m256 active_ps = _mm256_castsi256_ps(active);
+
+        // Each voxel is two 32 bit words: the point count, and r, g, b.
+        // Split the 8 voxels into counts and colors.
+        const __m256 words0 = _mm256_loadu_ps((const float *)(voxels + block_index*MOG_BLOCK_SIZE));
+        const __m256 words1 = _mm256_loadu_ps((const float *)(voxels + block_index*MOG_BLOCK_SIZE + 4));
+        const __m256i counts = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(words0, words1, _MM_SHUFFLE(2, 0, 2, 0))),
+                                                        _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256i colors = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(words0, words1, _MM_SHUFFLE(3, 1, 3, 1))),
+                                                        _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256 point_count = _mm256_cvtepi32_ps(counts);
+        const __m256 red = _mm256_cvtepi32_ps(_mm256_and_si256(colors, byte_mask));
+        const __m256 green = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(colors, 8), byte_mask));
+        const __m256 blue = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(colors, 16), byte_mask));
+
+        const __m256i last_updates = _mm256_load_si256((const __m256i *)block->last_updates);
+        const __m256i missed = _mm256_min_epu32(_mm256_sub_epi32(previous_update, last_updates), last_decay);
+        const __m256 decay = _mm256_i32gather_ps(_decay_table, missed, 4);
+
+        __m256 weights[MOG_NUM_COMPONENTS];
+        __m256 count_means[MOG_NUM_COMPONENTS];
+        __m256 count_variances[MOG_NUM_COMPONENTS];
+        __m256 red_means[MOG_NUM_COMPONENTS];
+        __m256 green_means[MOG_NUM_COMPONENTS];
+        __m256 blue_means[MOG_NUM_COMPONENTS];
+        __m256 color_variances[MOG_NUM_COMPONENTS];
+
+        __m256i match = _mm256_set1_epi32(-1);
+        __m256 best_distance = match_distance;
+
+        for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+        {
+            weights[k] = _mm256_mul_ps(_mm256_load_ps(block->weights[k]), decay);
+            count_means[k] = _mm256_load_ps(block->count_means[k]);
+            count_variances[k] = _mm256_load_ps(block->count_variances[k]);
+            red_means[k] = _mm256_load_ps(block->red_means[k]);
+            green_means[k] = _mm256_load_ps(block->green_means[k]);
+            blue_means[k] = _mm256_load_ps(block->blue_means[k]);
+            color_variances[k] = _mm256_load_ps(block->color_variances[k]);
+
+            const __m256 dc = _mm256_sub_ps(point_count, count_means[k]);
+            const __m256 dr = _mm256_sub_ps(red, red_means[k]);
+            const __m256 dg = _mm256_sub_ps(green, green_means[k]);
+            const __m256 db = _mm256_sub_ps(blue, blue_means[k]);
+            const __m256 color_distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr),
+                                                                      _mm256_mul_ps(dg, dg)),
+                                                        _mm256_mul_ps(db, db));
+            const __m256 distance = _mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(dc, dc), count_variances[k]),
+                                                  _mm256_div_ps(color_distance, color_variances[k]));
+
+            const __m256 better = _mm256_and_ps(_mm256_cmp_ps(weights[k], zero, _CMP_GT_OQ),
+                                                _mm256_cmp_ps(distance, best_distance, _CMP_LT_OQ));
+            best_distance = _mm256_blendv_ps(best_distance, distance, better);
+            match = _mm256_blendv_epi8(match, _mm256_set1_epi32(k), _mm256_castps_si256(better));
+        }
+
+        // Replace the weakest component where nothing matched
+        const __m256i is_new = _mm256_cmpeq_epi32(match, _mm256_set1_epi32(-1));
+        __m256i weakest = _mm256_setzero_si256();
+        __m256 weakest_weight = weights[0];
+        for(int k=1; k<MOG_NUM_COMPONENTS; ++k)
+        {
+            const __m256 weaker = _mm256_cmp_ps(weights[k], weakest_weight, _CMP_LT_OQ);
+            weakest_weight = _mm256_blendv_ps(weakest_weight, weights[k], weaker);
+            weakest = _mm256_blendv_epi8(weakest, _mm256_set1_epi32(k), _mm256_castps_si256(weaker));
+        }
+        match = _mm256_blendv_epi8(match, weakest, is_new);
+
+        const __m256 deviation = _mm256_mul_ps(point_count, initial_deviation);
+        const __m256 initial_count_variance = _mm256_add_ps(_mm256_mul_ps(deviation, deviation), min_count_variance);
+
+        __m256 matched_weight = zero;
+
+        for(int k=0; k<MOG_NUM_COMPONENTS; ++k)
+        {
+            const __m256i is_k = _mm256_cmpeq_epi32(match, _mm256_set1_epi32(k));
+            const __m256 replace = _mm256_castsi256_ps(_mm256_and_si256(is_k, is_new));
+            const __m256 update = _mm256_castsi256_ps(_mm256_andnot_si256(is_new, is_k));
+
+            weights[k] = _mm256_blendv_ps(weights[k], zero, replace);
+            count_means[k] = _mm256_blendv_ps(count_means[k], point_count, replace);
+            count_variances[k] = _mm256_blendv_ps(count_variances[k], initial_count_variance, replace);
+            red_means[k] = _mm256_blendv_ps(red_means[k], red, replace);
+            green_means[k] = _mm256_blendv_ps(green_means[k], green, replace);
+            blue_means[k] = _mm256_blendv_ps(blue_means[k], blue, replace);
+            color_variances[k] = _mm256_blendv_ps(color_variances[k], initial_color_variance, replace);
+
+            weights[k] = _mm256_mul_ps(weights[k], keep_rate);
+            weights[k] = _mm256_blendv_ps(weights[k], _mm256_add_ps(weights[k], learning_rate),
+                                          _mm256_castsi256_ps(is_k));
+            matched_weight = _mm256_blendv_ps(matched_weight, weights[k], _mm256_castsi256_ps(is_k));
+
+            const __m256 rho = _mm256_min_ps(one, _mm256_div_ps(learning_rate, weights[k]));
+
+            const __m256 count_mean = _mm256_add_ps(count_means[k],
+                                                    _mm256_mul_ps(rho, _mm256_sub_ps(point_count, count_means[k])));
+            const __m256 dc = _mm256_sub_ps(point_count, count_mean);
+            const __m256 count_variance = _mm256_add_ps(count_variances[k],
+                                                        _mm256_mul_ps(rho, _mm256_sub_ps(_mm256_mul_ps(dc, dc),
+                                                                                         count_variances[k])));
+
+            const __m256 red_mean = _mm256_add_ps(red_means[k], _mm256_mul_ps(rho, _mm256_sub_ps(red, red_means[k])));
+            const __m256 green_mean = _mm256_add_ps(green_means[k], _mm256_mul_ps(rho, _mm256_sub_ps(green, green_means[k])));
+            const __m256 blue_mean = _mm256_add_ps(blue_means[k], _mm256_mul_ps(rho, _mm256_sub_ps(blue, blue_means[k])));
+            const __m256 dr = _mm256_sub_ps(red, red_mean);
+            const __m256 dg = _mm256_sub_ps(green, green_mean);
+            const __m256 db = _mm256_sub_ps(blue, blue_mean);
+            const __m256 color_distance = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr),
+                                                                                    _mm256_mul_ps(dg, dg)),
+                                                                      _mm256_mul_ps(db, db)),
+                                                        three);
+            const __m256 color_variance = _mm256_add_ps(color_variances[k],
+                                                        _mm256_mul_ps(rho, _mm256_sub_ps(color_distance,
+                                                                                         color_variances[k])));
+
+            count_means[k] = _mm256_blendv_ps(count_means[k], count_mean, update);
+            count_variances[k] = _mm256_blendv_ps(count_variances[k],
+                                                  _mm256_max_ps(count_variance, min_count_variance), update);
+            red_means[k] = _mm256_blendv_ps(red_means[k], red_mean, update);
+            green_means[k] = _mm256_blendv_ps(green_means[k], green_mean, update);
+            blue_means[k] = _mm256_blendv_ps(blue_means[k], blue_mean, update);
+            color_variances[k] = _mm256_blendv_ps(color_variances[k],
+                                                  _mm256_max_ps(color_variance, min_color_variance), update);
+
+            // Only the occupied voxels of the block are written
+            _mm256_store_ps(block->weights[k], _mm256_blendv_ps(_mm256_load_ps(block->weights[k]), weights[k], active_ps));
+            _mm256_store_ps(block->count_means[k], _mm256_blendv_ps(_mm256_load_ps(block->count_means[k]), count_means[k], active_ps));
+            _mm256_store_ps(block->count_variances[k], _mm256_blendv_ps(_mm256_load_ps(block->count_variances[k]), count_variances[k], active_ps));
+            _mm256_store_ps(block->red_means[k], _mm256_blendv_ps(_mm256_load_ps(block->red_means[k]), red_means[k], active_ps));
+            _mm256_store_ps(block->green_means[k], _mm256_blendv_ps(_mm256_load_ps(block->green_means[k]), green_means[k], active_ps));
+            _mm256_store_ps(block->blue_means[k], _mm256_blendv_ps(_mm256_load_ps(block->blue_means[k]), blue_means[k], active_ps));
+            _mm256_store_ps(block->color_variances[k], _mm256_blendv_ps(_mm256_load_ps(block->color_variances[k]), color_variances[k], active_ps));
+        }
+
+        _mm256_store_si256((__m256i *)block->last_updates, _mm256_blendv_epi8(last_updates, num_updates, active));
+
+        float *background = background_model + block_index*MOG_BLOCK_SIZE;
+        _mm256_maskstore_ps(background, active,
+                            _mm256_min_ps(one, _mm256_div_ps(matched_weight, background_weight)));
+    }
+}
+
+#endif
+
+void
+InitializeVoxelMOG(VoxelMOG *mog, uint32_t num_voxels)
+{
+    static_assert(sizeof(VoxelMOGBlock) % 32 == 0, "The blocks are loaded as aligned 8-wide vectors");
+
+    mog->num_blocks = MOG_NUM_BLOCKS(num_voxels);
+
+    // All zero is a model where every voxel has always been empty
+    int rc = posix_memalign((void **)&mog->blocks, 64, mog->num_blocks * sizeof(VoxelMOGBlock));
+    assert(rc == 0);
+    memset(mog->blocks, 0, mog->num_blocks * sizeof(VoxelMOGBlock));
+
+    mog->updated_blocks = (uint32_t *)malloc(mog->num_blocks * sizeof(uint32_t));
+    mog->block_masks = (uint8_t *)calloc(mog->num_blocks, sizeof(uint8_t));
+    assert(mog->updated_blocks && mog->block_masks);
+
+    mog->decaying_voxels = (uint32_t *)malloc(num_voxels * sizeof(uint32_t));
+    mog->is_decaying = (uint8_t *)calloc(num_voxels, sizeof(uint8_t));
+    mog->num_decaying_voxels = 0;
+    assert(mog->decaying_voxels && mog->is_decaying);
+
+    mog->num_updates = 0;
+
+    float decay = 1.0f;
+    for(int n=0; n<MOG_DECAY_TABLE_SIZE; ++n)
+    {
+        _decay_table[n] = decay;
+        decay *= (1.0f - MOG_LEARNING_RATE);
+    }
+    _decay_table[MOG_DECAY_TABLE_SIZE-1] = 0.0f;
+
+    _update_kernel = &_UpdateVoxelMOGScalar;
+
+#if VOXEL_MOG_X86
+    static_assert(sizeof(Voxel) == 2*sizeof(int) && offsetof(Voxel, color) == sizeof(int),
+                  "The AVX2 kernel loads voxels as two 32 bit words");
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        _update_kernel = &_UpdateVoxelMOGAVX2;
+        puts("Using AVX2 background model");
+    }
+#endif
+}
+
+void
+FinalizeVoxelMOG(VoxelMOG *mog)
+{
+    free(mog->blocks);
+    free(mog->updated_blocks);
+    free(mog->block_masks);
+    free(mog->decaying_voxels);
+    free(mog->is_decaying);
+}
+
+// Relax the background probability of the voxels that were occupied
+// recently, but not in this update, as if they were updated with an empty
+// observation: a point showing up in one would most likely match its
+// strongest component.
+static void
+_DecayVoxelMOG(VoxelMOG *mog, float *background_model)
+{
+    const uint32_t num_updates = mog->num_updates;
+    unsigned int num_decaying_voxels = 0;
+
+    for(unsigned int n=0; n<mog->num_decaying_voxels; ++n)
+    {
+        const uint32_t i = mog->decaying_voxels[n];
+        const VoxelMOGBlock *block = &mog->blocks[i / MOG_BLOCK_SIZE];
+        const int l = i % MOG_BLOCK_SIZE;
+
+        const uint32_t missed = num_updates - block->last_updates[l];
+        if(missed > 0)
+        {
+            float strongest_weight = block->weights[0][l];
+            for(int k=1; k<MOG_NUM_COMPONENTS; ++k)
+            {
+                strongest_weight = MAX(strongest_weight, block->weights[k][l]);
+            }
+
+            const float decay = _decay_table[MIN(missed, MOG_DECAY_TABLE_SIZE-1)];
+            const float background = MIN(1.0f, strongest_weight * decay / MOG_BACKGROUND_WEIGHT);
+            if(background < MOG_MIN_BACKGROUND)
+            {
+                background_model[i] = 0.0f;
+                mog->is_decaying[i] = 0;
+                continue;
+            }
+
+            background_model[i] = background;
+        }
+
+        mog->decaying_voxels[num_decaying_voxels++] = i;
+    }
+
+    mog->num_decaying_voxels = num_decaying_voxels;
+}
+
+void
+UpdateVoxelMOG(VoxelMOG *mog, const Voxel *voxels,
+               const uint32_t *occupied_voxels, unsigned int num_occupied_voxels,
+               float *background_model)
+{
+    unsigned int num_blocks = 0;
+    for(unsigned int n=0; n<num_occupied_voxels; ++n)
+    {
+        const uint32_t i = occupied_voxels[n];
+        const uint32_t block_index = i / MOG_BLOCK_SIZE;
+        if(!mog->block_masks[block_index])
+        {
+            mog->updated_blocks[num_blocks++] = block_index;
+        }
+
+        mog->block_masks[block_index] |= (uint8_t)(1 << (i % MOG_BLOCK_SIZE));
+
+        // Decayed from the next update where it is empty
+        if(!mog->is_decaying[i])
+        {
+            mog->is_decaying[i] = 1;
+            mog->decaying_voxels[mog->num_decaying_voxels++] = i;
+        }
+    }
+
+    ++mog->num_updates;
+    _update_kernel(mog, voxels, mog->updated_blocks, num_blocks, background_model);
+    _DecayVoxelMOG(mog, background_model);
+
+    for(unsigned int n=0; n<num_blocks; ++n)
+    {
+        mog->block_masks[mog->updated_blocks[n]] = 0;
+    }
+}
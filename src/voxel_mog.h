@@ -0,0 +1,73 @@
+#ifndef VOXEL_MOG_H_
+#define VOXEL_MOG_H_
+
+#include <stdint.h>
+#include "magic_motion.h"
+
+// The number of gaussians per voxel
+#define MOG_NUM_COMPONENTS 3
+
+// The model is stored in blocks of this many consecutive voxels, one SIMD
+// lane per voxel. The voxels and the background model are read and written
+// a whole block at a time, so they must have MOG_NUM_BLOCKS(num_voxels)
+// blocks of entries, also when the grid is not whole blocks.
+#define MOG_BLOCK_SIZE 8
+#define MOG_NUM_BLOCKS(num_voxels) (((num_voxels) + MOG_BLOCK_SIZE-1) / MOG_BLOCK_SIZE)
+
+typedef struct
+{
+    float weights[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float count_means[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float count_variances[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float red_means[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float green_means[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float blue_means[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE];
+    float color_variances[MOG_NUM_COMPONENTS][MOG_BLOCK_SIZE]; // Shared by r, g and b
+
+    // The update each voxel was last updated in
+    uint32_t last_updates[MOG_BLOCK_SIZE];
+} VoxelMOGBlock;
+
+// A per-voxel mixture of gaussians over the point count and the average
+// color of the voxel. Every update is one observation of the voxels: The
+// occupied ones are observed with their points, and all the others are
+// observed empty.
+// The weight of being empty is whatever the gaussians leave of 1. Empty
+// observations only ever match that, so they are not applied one by one.
+// A voxel catches up on the empty observations it missed the next time it
+// is updated, which gives the same result.
+typedef struct
+{
+    VoxelMOGBlock *blocks;
+    uint32_t num_blocks;
+
+    // The blocks with occupied voxels in the current update, and which
+    // voxels in them are occupied. The masks are all 0 between updates.
+    uint32_t *updated_blocks;
+    uint8_t *block_masks;
+
+    // The voxels that have been occupied recently, whose background
+    // probability still has to relax toward empty as they stay empty
+    uint32_t *decaying_voxels;
+    unsigned int num_decaying_voxels;
+    uint8_t *is_decaying;
+
+    uint32_t num_updates;
+} VoxelMOG;
+
+// Allocates the model, with every voxel empty, and picks the fastest
+// kernel the CPU supports. All kernels give bit-identical output.
+void InitializeVoxelMOG(VoxelMOG *mog, uint32_t num_voxels);
+void FinalizeVoxelMOG(VoxelMOG *mog);
+
+// Call once per observed frame, with the occupied voxels of the frame.
+// The background probability of the occupied and the decaying voxels is
+// written to background_model. The rest of background_model is unchanged,
+// which is 0 for voxels that have been empty for long.
+// This takes time proportional to the number of occupied and recently
+// occupied voxels, not the size of the grid.
+void UpdateVoxelMOG(VoxelMOG *mog, const Voxel *voxels,
+                    const uint32_t *occupied_voxels, unsigned int num_occupied_voxels,
+                    float *background_model);
+
+#endif /* end of include guard: VOXEL_MOG_H_ */
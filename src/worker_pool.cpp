@@ -0,0 +1,149 @@
+
+#include "worker_pool.h"
+
+#include "utils.h"
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Take tasks from the current batch until there are none left.
+// Must be called with the mutex held, and returns with it held.
+static void
+_RunTasksLocked(WorkerPool *pool)
+{
+    while(pool->next_task < pool->num_tasks)
+    {
+        unsigned int task_index = pool->next_task++;
+        WorkerTaskFunc task = pool->task;
+        void *userdata = pool->userdata;
+
+        pthread_mutex_unlock(&pool->mutex);
+        task(userdata, task_index);
+        pthread_mutex_lock(&pool->mutex);
+
+        if(++pool->tasks_done == pool->num_tasks)
+        {
+            pthread_cond_broadcast(&pool->work_done);
+        }
+    }
+}
+
+static void *
+_WorkerThread(void *userdata)
+{
+    WorkerPool *pool = (WorkerPool *)userdata;
+    unsigned int last_batch = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while(pool->running)
+    {
+        if(pool->batch == last_batch)
+        {
+            pthread_cond_wait(&pool->work_available, &pool->mutex);
+            continue;
+        }
+
+        last_batch = pool->batch;
+        _RunTasksLocked(pool);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+void
+InitializeWorkerPool(WorkerPool *pool, unsigned int num_threads)
+{
+    if(num_threads == 0)
+    {
+        long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (num_cores > 1) ? (unsigned int)(num_cores - 1) : 0;
+    }
+
+    pool->num_threads = MIN(num_threads, MAX_WORKER_THREADS);
+    pool->task = NULL;
+    pool->userdata = NULL;
+    pool->num_tasks = 0;
+    pool->next_task = 0;
+    pool->tasks_done = 0;
+    pool->batch = 0;
+    pool->running = true;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for(unsigned int i=0; i<pool->num_threads; ++i)
+    {
+        int rc = pthread_create(&pool->threads[i], NULL, &_WorkerThread, pool);
+        if(rc)
+        {
+            fprintf(stderr, "Failed to start worker thread %u. Continuing with %u.\n", i, i);
+            pool->num_threads = i;
+            break;
+        }
+    }
+
+    printf("Started %u worker threads\n", pool->num_threads);
+}
+
+void
+FinalizeWorkerPool(WorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(unsigned int i=0; i<pool->num_threads; ++i)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->num_threads = 0;
+}
+
+void
+RunWorkerTasks(WorkerPool *pool, WorkerTaskFunc task, void *userdata, unsigned int num_tasks)
+{
+    if(num_tasks == 0) return;
+
+    if(pool->num_threads == 0 || num_tasks == 1)
+    {
+        // No need to wake anyone
+        for(unsigned int i=0; i<num_tasks; ++i)
+        {
+            task(userdata, i);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+
+    // Only one batch runs at a time
+    assert(pool->tasks_done == pool->num_tasks);
+
+    pool->task = task;
+    pool->userdata = userdata;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->tasks_done = 0;
+    ++pool->batch;
+    pthread_cond_broadcast(&pool->work_available);
+
+    // The calling thread helps out instead of just waiting
+    _RunTasksLocked(pool);
+
+    while(pool->tasks_done < pool->num_tasks)
+    {
+        pthread_cond_wait(&pool->work_done, &pool->mutex);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
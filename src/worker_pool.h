@@ -0,0 +1,43 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// This is quite arbitrary, but there is little to gain from more threads
+// than there are tiles of work in a frame
+#define MAX_WORKER_THREADS 16
+
+// A task is called once for every task_index in [0, num_tasks)
+typedef void (*WorkerTaskFunc)(void *userdata, unsigned int task_index);
+
+typedef struct
+{
+    pthread_t threads[MAX_WORKER_THREADS];
+    unsigned int num_threads; // Not counting the thread calling RunWorkerTasks
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_available;
+    pthread_cond_t work_done;
+
+    // The current batch of tasks. Protected by mutex
+    WorkerTaskFunc task;
+    void *userdata;
+    unsigned int num_tasks;
+    unsigned int next_task;
+    unsigned int tasks_done;
+    unsigned int batch; // Incremented for each call to RunWorkerTasks
+
+    bool running;
+} WorkerPool;
+
+// If num_threads is 0, one worker is started per CPU core, minus one
+// for the calling thread
+void InitializeWorkerPool(WorkerPool *pool, unsigned int num_threads);
+void FinalizeWorkerPool(WorkerPool *pool);
+
+// Run num_tasks tasks on the pool and the calling thread,
+// and block until they are all done
+void RunWorkerTasks(WorkerPool *pool, WorkerTaskFunc task, void *userdata, unsigned int num_tasks);
+
+#endif /* end of include guard: WORKER_POOL_H_ */